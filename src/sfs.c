@@ -7,6 +7,7 @@
 
 */
 
+#define _GNU_SOURCE //for O_DIRECT
 #include "params.h"
 #include "block.h"
 
@@ -15,11 +16,16 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <libgen.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/types.h>
 
@@ -28,67 +34,237 @@
 #endif
 
 #include "log.h"
+#include "sfs_crc.h"
+#include "sfs_format.h"
+#include "sfs_ioctl.h"
+#include "sfs_trace.h"
 
-// ------------------------------------------------------------------------------------------------------
-// |superBlock (1)| Inodes (128)| Indirect Blocks (192)| Double I. Blocks (1)| data block metadata (56) |
-// ------------------------------------------------------------------------------------------------------
-// units in () are meassured in disk blocks
-
-#define NUM_NODES 128
-#define NODE_STRT 1
-#define IBLK_STRT 129
-#define DIBLK 321
-#define MDATA_STRT 322
-#define INDIR_DATA 378
-#define DISK_STRT 379
-#define DISK_END 29051 
-#define VER 987
-
-typedef struct _inode
-{
-	int node_num;
-	mode_t mode;
-	int link_count;
-	size_t size;
-	long access;
+//log.c finds its log file through the high-level fuse context, which doesn't exist under
+//the low-level api, so all logging goes through sfs_log instead
+#define log_msg sfs_log
+
+#define SLOT_INO(slot) ((fuse_ino_t)(slot)+2) //inode number of the inode in slot, 1 is the root
+#define INO_SLOT(ino) ((int)(ino)-2)
+#define DEF_TIMEOUT 30.0 //default seconds the kernel may cache names and attributes
+
+typedef struct _fs_info
+{
+	//what is known about the open disk file
+	int fd; //the first member, which holds the superblock
+	int block_size;
+	int direct; //opened with O_DIRECT, see direct_io_start
+	int members; //disk files the volume is striped over, see stripe_locate
+	int stripe_width;
+	int fds[MAX_MEMBERS];
+	int mdata_used[NUM_MDATA]; //used data blocks in each metadata block, full ones are skipped
+	char mdata_shared[NUM_MDATA]; //has a block in each metadata block ever been shared
+	unsigned int name_hash[NUM_NODES]; //hash of the name in each inode slot, 0 for none
+	unsigned int* csums; //checksum of every block as the checksum blocks hold them, see csum_load
+	char csum_dirty[NUM_CSUM]; //checksum blocks changed in csums since they were written
+} fs_info;
+
+fs_info fs={.fd=-1,.block_size=DEF_BLOCK_SIZE};
+
+struct sfs_options
+{
+	int block_size; //block size for formatting a new disk file
+	int lowlevel; //serve requests through the low-level inode api
+	double entry_timeout; //seconds the kernel may cache a name lookup
+	double attr_timeout; //seconds the kernel may cache attributes
+	double negative_timeout; //seconds the kernel may remember that a name doesn't exist
+	int o_direct; //bypass the host's page cache for the disk file
+	int stripe_width; //blocks in a row on each member when formatting a striped volume
+	char* trace; //file to record every call in, see trace_op
+	int compress; //new files get SFS_FL_COMPRESS
+	int dedup; //share whole blocks written with blocks already holding the same data
+	int verify; //VERIFY_*, the blocks checked against their checksums when read
+};
+
+#define VERIFY_NONE 0
+#define VERIFY_META 1 //everything before DISK_STRT
+#define VERIFY_FULL 2 //data blocks too
+
+//everything that changes the disk file goes through this mount, so the kernel's caches only
+//go stale when something changes behind its back, see kernel_saw
+struct sfs_options sfs_opts={DEF_BLOCK_SIZE,0,DEF_TIMEOUT,DEF_TIMEOUT,DEF_TIMEOUT,0,DEF_STRIPE_WIDTH,NULL,0,0,VERIFY_META};
+
+#define SFS_OPT(t, p) { t, offsetof(struct sfs_options, p), 1 }
+
+struct fuse_opt sfs_opt_spec[] = {
+  SFS_OPT("block_size=%d", block_size),
+  SFS_OPT("lowlevel", lowlevel),
+  SFS_OPT("entry_timeout=%lf", entry_timeout),
+  SFS_OPT("attr_timeout=%lf", attr_timeout),
+  SFS_OPT("negative_timeout=%lf", negative_timeout),
+  SFS_OPT("o_direct", o_direct),
+  SFS_OPT("stripe_width=%d", stripe_width),
+  SFS_OPT("trace=%s", trace),
+  SFS_OPT("compress", compress),
+  SFS_OPT("dedup", dedup),
+  { "verify=none", offsetof(struct sfs_options, verify), VERIFY_NONE },
+  { "verify=meta", offsetof(struct sfs_options, verify), VERIFY_META },
+  { "verify=full", offsetof(struct sfs_options, verify), VERIFY_FULL },
+  FUSE_OPT_END
+};
+
+struct sfs_state* sfs_data; //set up by main, the same thing fuse hands back as private data
+
+//held while a name is created or removed, which is also when the superblock's node_list and
+//num_files change, see file_create and file_free.  Taken before nlookup_lock
+pthread_mutex_t names_lock=PTHREAD_MUTEX_INITIALIZER;
+
+//how many lookups of each inode the kernel holds, see sfs_ll_forget
+unsigned long nlookup[NUM_NODES];
+pthread_mutex_t nlookup_lock=PTHREAD_MUTEX_INITIALIZER;
+
+//modify time and size of each inode as last handed to the kernel, see kernel_saw
+typedef struct _kernel_view
+{
+	int valid;
+	int stale; //changed since, the kernel's cached pages can't be kept
 	long modify;
-	long change;
-	int direct[32];
-	int single_indirect[64];
-	int double_indirect;
-	char name[50];
-	int fh; //place to start from in the file
-} inode;
+	size_t size;
+} kernel_view;
+
+kernel_view kview[NUM_NODES];
+pthread_mutex_t kview_lock=PTHREAD_MUTEX_INITIALIZER;
+
+//allocation groups: each metadata block with the data blocks it maps, see find_direct
+#define GROUP_OF(block) (((block)-DISK_STRT)/fs.block_size)
+#define NODE_GROUP(slot) ((slot)*NUM_MDATA/NUM_NODES) //where the inode in slot keeps its data
+pthread_mutex_t group_lock[NUM_MDATA]; //held while changing a group's metadata block
+pthread_mutex_t indir_lock=PTHREAD_MUTEX_INITIALIZER; //same for the indirect block pool
+
+//decoded block maps of open files, see bmap_get
+typedef struct _block_map
+{
+	int opens; //open handles on the file
+	int** chunks; //pointers of each indirect block, NULL until loaded
+	int pack_lo; //clusters written since file_pack last ran, none when pack_hi<=pack_lo
+	int pack_hi;
+	unsigned int gen; //files freed from the slot so far, see fh_slot
+	unsigned long changes; //bmap_set and bmap_drop calls so far, see bmap_get
+} block_map;
+
+#define NUM_CHUNKS (NUM_SINGLE+PTRS_PER_BLK) //indirect blocks a file can have
+block_map bmaps[NUM_NODES];
+int bmap_holes[1]; //stands in for the chunk of an indirect block that isn't there
+pthread_mutex_t bmap_lock=PTHREAD_MUTEX_INITIALIZER;
 
-typedef struct _indirect
+//held shared by reads and writes of a file, and alone by file_defrag and file_pack while
+//they move its blocks, see file_hold
+pthread_rwlock_t file_lock[NUM_NODES];
+unsigned long file_moves; //times blocks of any file were moved under it
+
+//inodes changed in memory but not written yet, see mark_inode
+#define DIRTY_TIMES 1 //only the times changed
+#define DIRTY_SIZE 2 //size or block pointers changed, needed to get at the data
+typedef struct _dirty_inode
 {
-	int blocks[128]; //list of block numbers of file
-} indirect;
+	int dirty; //0, DIRTY_TIMES or DIRTY_SIZE
+	inode node;
+} dirty_inode;
+
+dirty_inode dnodes[NUM_NODES];
+pthread_mutex_t dnodes_lock=PTHREAD_MUTEX_INITIALIZER;
 
-typedef struct _indir_data
+//block buffers kept by each thread for reuse, see block_get
+#define SCRATCH_ALIGN 4096 //good enough for O_DIRECT, see block_alloc
+typedef struct _scratch
 {
-	char indir_blocks[192]; //is the indirect block used or not
-	char d_indir_block; //is the one double indirect block used or not
-} indir_data;
+	int size; //block size the buffers were made for
+	int count; //buffers made
+	int used; //the first used of them are handed out
+	char** bufs;
+	unsigned long reads; //disk blocks the thread has read, see op_start
+	unsigned long writes;
+	fuse_ino_t entry_ino; //inode number last handed to the kernel by ll_entry, see trace_op
+} scratch;
+
+pthread_key_t scratch_key;
+pthread_once_t scratch_once=PTHREAD_ONCE_INIT;
+
+//what every handler has been up to since mount or the last SFS_IOC_STATS_RESET, read through
+//the hidden file STATS_NAME in the root, see stats_text.  The operations are in sfs_trace.h
+const char* op_names[NUM_OPS]={"lookup","forget","getattr","create","unlink","open","release","flush","fsync",
+	"read","write","mkdir","rmdir","opendir","readdir","releasedir","ioctl"};
 
-typedef struct _data_list
+//latencies in nanoseconds go in log-linear buckets, HIST_SUB of them for each power of two, so
+//every bucket is within 1/HIST_SUB of the values in it, see hist_bucket
+#define HIST_BITS 3
+#define HIST_SUB (1<<HIST_BITS)
+#define HIST_BUCKETS ((64-HIST_BITS+1)*HIST_SUB)
+
+typedef struct _op_stats
 {
-	//could have made this more efficient with bit-wise operations, but less mistakes this way
-	char data[512];
-} data_list;
+	unsigned long calls;
+	unsigned long errors; //only known for the high-level api, the low-level handlers reply themselves
+	unsigned long reads; //disk blocks read on its behalf
+	unsigned long writes;
+	unsigned long long ns; //time spent in it
+	unsigned long long max_ns;
+	unsigned long hist[HIST_BUCKETS];
+} op_stats;
 
-typedef struct _super_block
+typedef struct _fs_stats
 {
-	//info for root stored in superblock
-	mode_t mode;
-	size_t size;
-	long access;
-	long modify;
-	long change;
-	int verify; //is this our filesystem?
-	int num_files; //number of current files
-	char node_list[NUM_NODES]; //bit-vector to keep track of unsued inode blocks
-} superblock;
+	op_stats ops[NUM_OPS];
+	unsigned long alloc_scans; //find_direct calls
+	unsigned long alloc_groups; //metadata blocks they went through
+	unsigned long alloc_entries; //map entries they looked at
+	unsigned long long alloc_max; //most entries one call looked at
+	unsigned long bmap_hits; //bmap_get found the indirect block decoded already
+	unsigned long bmap_misses; //and had to read it
+	unsigned long dnode_hits; //get_inode found the inode held back in memory
+	unsigned long dnode_misses; //and had to read it
+	unsigned long packs; //clusters compressed, see file_pack
+	unsigned long pack_saved; //blocks that saved
+	unsigned long pack_raw; //clusters that didn't compress well enough and were left alone
+	unsigned long pack_reads; //compressed clusters decompressed
+	unsigned long unpacks; //and given their blocks back to be written
+	unsigned long dedup_hashed; //whole blocks written with -o dedup
+	unsigned long dedup_shared; //of them pointed at a block already holding the data instead
+	unsigned long dedup_stale; //index entries whose block turned out to hold something else
+	unsigned long csum_errors; //blocks read that didn't match their checksum
+} fs_stats;
+
+fs_stats stats;
+
+#define STATS_NAME ".sfs_stats"
+#define STATS_PATH "/" STATS_NAME
+#define STATS_INO SLOT_INO(NUM_NODES) //low-level inode number of STATS_NAME, past all the real ones
+#define STAT_ADD(counter, n) __sync_fetch_and_add(&(counter),(n))
+
+//the trace being recorded, see trace_op
+#define TRACE_BUF 65536
+int trace_fd=-1;
+char* trace_buf;
+size_t trace_len;
+unsigned long long trace_start; //nanoseconds
+pthread_mutex_t trace_lock=PTHREAD_MUTEX_INITIALIZER;
+
+//fingerprints of whole blocks written, see dedup_write.  Open addressing over a power of two
+//slots, a fingerprint is looked for in the DEDUP_PROBE slots from its own on and once those are
+//taken replaces whatever is in its own: losing entries only loses sharing
+#define DEDUP_MAX_SLOTS (1<<20)
+#define DEDUP_PROBE 8
+dedup_entry* dedup_index; //NULL without -o dedup
+unsigned int dedup_mask; //slots-1
+pthread_mutex_t dedup_lock=PTHREAD_MUTEX_INITIALIZER;
+
+const char* csum_name="tables"; //what computes the checksums, see crc32c_init
+const char* verify_names[]={"no blocks","metadata","metadata and data"};
+
+struct fuse_chan* sfs_chan; //low-level channel, for telling the kernel to drop its caches
+int sfs_multithreaded;
+
+void sfs_log(const char* format, ...)
+{
+	va_list ap;
+	va_start(ap,format);
+	vfprintf(sfs_data->logfile,format,ap);
+	va_end(ap);
+}
 
 
 ///////////////////////////////////////////////////////////
@@ -97,1054 +273,5631 @@ typedef struct _super_block
 // come indirectly from /usr/include/fuse.h
 //
 
+void* block_alloc()
+{
+	//a block sized buffer aligned well enough to read and write the disk file with O_DIRECT
+	void* buf;
+	if(posix_memalign(&buf,SCRATCH_ALIGN,fs.block_size)!=0)
+	{
+		log_msg("\ncould not allocate a block buffer, exiting failure\n");
+		exit(EXIT_FAILURE);
+	}
+	return buf;
+}
+
+void scratch_free(void* arg)
+{
+	//the thread is going away, and its buffers with it
+	scratch* sc=(scratch*)arg;
+	int i;
+	for(i=0;i<sc->count;i++)
+	{
+		free(sc->bufs[i]);
+	}
+	free(sc->bufs);
+	free(sc);
+}
+
+void scratch_init()
+{
+	pthread_key_create(&scratch_key,scratch_free);
+}
+
+/*
+ * A block sized, block aligned buffer to read and write blocks through,
+ * given back with block_put.  Each thread keeps the ones it has used
+ * before, so the I/O paths don't go to the allocator at all once a thread
+ * has warmed up.
+ */
+scratch* scratch_get()
+{
+	//what the calling thread keeps, see scratch
+	pthread_once(&scratch_once,scratch_init);
+	scratch* sc=(scratch*)pthread_getspecific(scratch_key);
+	if(sc==NULL)
+	{
+		sc=calloc(1,sizeof(scratch));
+		pthread_setspecific(scratch_key,sc);
+	}
+	return sc;
+}
+
+void* block_get()
+{
+	scratch* sc=scratch_get();
+	if(sc->size!=fs.block_size&&sc->used==0)
+	{
+		//left from a mount with another block size
+		int i;
+		for(i=0;i<sc->count;i++)
+		{
+			free(sc->bufs[i]);
+		}
+		sc->count=0;
+		sc->size=fs.block_size;
+	}
+	if(sc->used==sc->count)
+	{
+		sc->bufs=realloc(sc->bufs,(sc->count+1)*sizeof(char*));
+		sc->bufs[sc->count++]=block_alloc();
+	}
+	return sc->bufs[sc->used++];
+}
+
+void block_put(void* buf)
+{
+	//give back a buffer from block_get, in any order
+	scratch* sc=(scratch*)pthread_getspecific(scratch_key);
+	int i;
+	for(i=0;i<sc->used;i++)
+	{
+		if(sc->bufs[i]==buf)
+		{
+			sc->bufs[i]=sc->bufs[sc->used-1];
+			sc->bufs[--sc->used]=buf;
+			return;
+		}
+	}
+}
+
+void stat_max(unsigned long long* max, unsigned long long value)
+{
+	unsigned long long old=*max;
+	while(value>old&&!__sync_bool_compare_and_swap(max,old,value))
+	{
+		old=*max;
+	}
+}
+
+int hist_bucket(unsigned long long ns)
+{
+	//the histogram bucket ns falls in: the position of the top bit, and the HIST_BITS under it
+	if(ns<HIST_SUB)
+	{
+		return (int)ns;
+	}
+	int top=63-__builtin_clzll(ns);
+	return (top-HIST_BITS+1)*HIST_SUB+(int)((ns>>(top-HIST_BITS))&(HIST_SUB-1));
+}
+
+unsigned long long hist_floor(int bucket)
+{
+	//smallest value that falls in bucket
+	if(bucket<HIST_SUB)
+	{
+		return bucket;
+	}
+	int top=bucket/HIST_SUB+HIST_BITS-1;
+	return (unsigned long long)(HIST_SUB+bucket%HIST_SUB)<<(top-HIST_BITS);
+}
+
+typedef struct _op_timer
+{
+	struct timespec start;
+	unsigned long reads; //what the thread had read and written before
+	unsigned long writes;
+	//what the call was about, for the trace
+	const char* name;
+	fuse_ino_t ino;
+	off_t offset;
+	unsigned long long size;
+	struct fuse_file_info* fi;
+} op_timer;
+
+void op_start(op_timer* t, const char* name, fuse_ino_t ino, off_t offset, unsigned long long size, struct fuse_file_info* fi)
+{
+	scratch* sc=scratch_get();
+	t->reads=sc->reads;
+	t->writes=sc->writes;
+	t->name=name;
+	t->ino=ino;
+	t->offset=offset;
+	t->size=size;
+	t->fi=fi;
+	sc->entry_ino=0;
+	clock_gettime(CLOCK_MONOTONIC,&(t->start));
+}
+
+unsigned long long ts_ns(struct timespec* ts)
+{
+	return (unsigned long long)ts->tv_sec*1000000000ULL+ts->tv_nsec;
+}
+
+void trace_flush()
+{
+	//write out what has been buffered, with trace_lock held.  Tracing stops if that fails
+	size_t done=0;
+	while(done<trace_len)
+	{
+		ssize_t n=write(trace_fd,trace_buf+done,trace_len-done);
+		if(n<0&&errno==EINTR)
+		{
+			continue;
+		}
+		if(n<=0)
+		{
+			log_msg("\ncould not write the trace (%s), no longer tracing\n",strerror(errno));
+			close(trace_fd);
+			trace_fd=-1;
+			break;
+		}
+		done+=n;
+	}
+	trace_len=0;
+}
+
+void trace_op(int op, op_timer* t, int retstat, unsigned long long end, fuse_ino_t found)
+{
+	//add a record of the call to the trace, see sfs_trace.h
+	struct sfs_trace_rec rec;
+	size_t name_len=(t->name!=NULL) ? strlen(t->name) : 0;
+	if(name_len>TRACE_MAX_NAME)
+	{
+		name_len=TRACE_MAX_NAME;
+	}
+	memset(&rec,0,sizeof(rec));
+	rec.start=ts_ns(&(t->start))-trace_start;
+	unsigned long long took=end-ts_ns(&(t->start));
+	rec.took=(took<UINT32_MAX) ? (uint32_t)took : UINT32_MAX;
+	rec.op=op;
+	rec.name_len=name_len;
+	rec.result=retstat;
+	rec.ino=(t->ino!=0) ? t->ino : found;
+	rec.offset=t->offset;
+	rec.size=t->size;
+	rec.fh=(t->fi!=NULL) ? t->fi->fh : 0;
+	pthread_mutex_lock(&trace_lock);
+	if(trace_fd>=0)
+	{
+		if(trace_len+sizeof(rec)+name_len>TRACE_BUF)
+		{
+			trace_flush();
+		}
+		memcpy(trace_buf+trace_len,&rec,sizeof(rec));
+		if(name_len>0)
+		{
+			memcpy(trace_buf+trace_len+sizeof(rec),t->name,name_len);
+		}
+		trace_len+=sizeof(rec)+name_len;
+	}
+	pthread_mutex_unlock(&trace_lock);
+}
+
+void op_done(int op, op_timer* t, int retstat)
+{
+	//add one call to op, started with op_start on the same thread
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC,&end);
+	unsigned long long ns=ts_ns(&end)-ts_ns(&(t->start));
+	scratch* sc=scratch_get();
+	if(trace_fd>=0)
+	{
+		trace_op(op,t,retstat,ts_ns(&end),sc->entry_ino);
+	}
+	op_stats* o=&(stats.ops[op]);
+	STAT_ADD(o->calls,1);
+	if(retstat<0)
+	{
+		STAT_ADD(o->errors,1);
+	}
+	STAT_ADD(o->reads,sc->reads-t->reads);
+	STAT_ADD(o->writes,sc->writes-t->writes);
+	STAT_ADD(o->ns,ns);
+	STAT_ADD(o->hist[hist_bucket(ns)],1);
+	stat_max(&(o->max_ns),ns);
+}
+
+int block_fd(int block_num, off_t* pos)
+{
+	//the member disk file a block lives on, and where in it
+	off_t mblock;
+	int member=stripe_locate(block_num,fs.members,fs.stripe_width,&mblock);
+	*pos=mblock*fs.block_size;
+	return fs.fds[member];
+}
+
+//disk blocks gone through fs_block_read and fs_block_write, see sfs_bench.c
+unsigned long blocks_read;
+unsigned long blocks_written;
+
+/*
+ * Checksums.  Every block fs_block_write writes gets its CRC32C put in
+ * fs.csums, and the blocks sfs_opts.verify asks for are checked against it
+ * by fs_block_read, which fails with EIO when they don't match.  Blocks
+ * written by splicing (see file_write_buf) never pass through memory, their
+ * checksum is dropped instead.  csums is only written back at unmount, not
+ * by fsync: after a crash there is no telling which checksums made it out
+ * along with their blocks, so csum_load drops those of the data blocks and
+ * takes the metadata's again from what is there.  Data is only covered
+ * from a clean unmount on, or from when it is next written.
+ */
+void csum_set(int block_num, const void* buf)
+{
+	if(HAS_CSUM(block_num))
+	{
+		fs.csums[block_num]=block_csum(buf,fs.block_size);
+		fs.csum_dirty[block_num/CSUM_PER_BLK]=1;
+	}
+}
+
+void csum_forget(int block_num)
+{
+	//block_num was written without its contents being seen
+	if(fs.csums!=NULL&&HAS_CSUM(block_num))
+	{
+		fs.csums[block_num]=0;
+		fs.csum_dirty[block_num/CSUM_PER_BLK]=1;
+	}
+}
+
+void csum_copy(int from, int to)
+{
+	//to was just written with what from holds, damaged or not, and takes over its checksum
+	//so that the damage still shows
+	if(fs.csums!=NULL&&HAS_CSUM(from)&&HAS_CSUM(to))
+	{
+		fs.csums[to]=fs.csums[from];
+		fs.csum_dirty[to/CSUM_PER_BLK]=1;
+	}
+}
+
+int csum_bad(int block_num, const void* buf)
+{
+	//does block_num, just read into buf, not match its checksum
+	if(!HAS_CSUM(block_num)||fs.csums[block_num]==0||block_csum(buf,fs.block_size)==fs.csums[block_num])
+	{
+		return 0;
+	}
+	STAT_ADD(stats.csum_errors,1);
+	log_msg("\nblock %d doesn't match its checksum\n",block_num);
+	return 1;
+}
+
+int fs_block_read(int block_num, void* buf)
+{
+	//read one whole disk block; anything past the end of the disk file reads as zeros.
+	//-EIO if it doesn't match its checksum, with buf holding what was read anyway
+	STAT_ADD(blocks_read,1);
+	scratch_get()->reads++;
+	off_t pos;
+	int fd=block_fd(block_num,&pos);
+	ssize_t retstat=pread(fd,buf,fs.block_size,pos);
+	if(retstat<fs.block_size)
+	{
+		if(retstat<0)
+		{
+			log_msg("\nfs_block_read of block %d failed\n",block_num);
+		}
+		memset((char*)buf+(retstat>0 ? retstat : 0),0,fs.block_size-(retstat>0 ? retstat : 0));
+	}
+	if(fs.csums!=NULL&&sfs_opts.verify>=((block_num<DISK_STRT) ? VERIFY_META : VERIFY_FULL)&&csum_bad(block_num,buf))
+	{
+		return -EIO;
+	}
+	return retstat;
+}
+
+int fs_block_write(int block_num, const void* buf)
+{
+	STAT_ADD(blocks_written,1);
+	scratch_get()->writes++;
+	off_t pos;
+	int fd=block_fd(block_num,&pos);
+	ssize_t retstat=pwrite(fd,buf,fs.block_size,pos);
+	if(retstat<0)
+	{
+		log_msg("\nfs_block_write of block %d failed\n",block_num);
+	}
+	else if(fs.csums!=NULL)
+	{
+		csum_set(block_num,buf);
+	}
+	return retstat;
+}
+
 int find_d_indirect()
 {
+	//take the double indirect block, -1 when it is in use and -EIO when the map of indirect
+	//blocks is damaged (it isn't written back then, with a checksum that would hide that)
 	indir_data indir;
-	char* block_buff=malloc(BLOCK_SIZE);
-	block_read(INDIR_DATA,block_buff);
+	char* block_buff=block_get();
+	pthread_mutex_lock(&indir_lock);
+	if(fs_block_read(INDIR_DATA,block_buff)<0)
+	{
+		pthread_mutex_unlock(&indir_lock);
+		block_put(block_buff);
+		return -EIO;
+	}
 	memcpy(&indir,block_buff,sizeof(indir_data));
-	if(indir.d_indir_block=='0')
+	if(indir.d_indir_block!='1')
 	{
 		indir.d_indir_block='1';
 		memcpy(block_buff,&indir,sizeof(indir_data));
-		block_write(INDIR_DATA,block_buff);
-		free(block_buff);
+		fs_block_write(INDIR_DATA,block_buff);
+		//set all of its pointers to -1, like find_indirect does
+		int* blocks=(int*)block_buff;
+		int j;
+		for(j=0;j<PTRS_PER_BLK;j++)
+		{
+			blocks[j]=-1;
+		}
+		fs_block_write(DIBLK,block_buff);
+		pthread_mutex_unlock(&indir_lock);
+		block_put(block_buff);
 		return DIBLK;
 	}
-	free(block_buff);
+	pthread_mutex_unlock(&indir_lock);
+	block_put(block_buff);
 	return -1;
 }
 
 int find_indirect()
 {
+	//take a free single indirect block, -1 when there is none, -EIO like find_d_indirect
 	indir_data indir;
-	char* block_buff=malloc(BLOCK_SIZE);
-	block_read(INDIR_DATA,block_buff);
+	char* block_buff=block_get();
+	pthread_mutex_lock(&indir_lock);
+	if(fs_block_read(INDIR_DATA,block_buff)<0)
+	{
+		pthread_mutex_unlock(&indir_lock);
+		block_put(block_buff);
+		return -EIO;
+	}
 	memcpy(&indir,block_buff,sizeof(indir_data));
 	int i;
 	for(i=0;i<192;i++)
 	{
-		if(indir.indir_blocks[i]=='0')
+		if(indir.indir_blocks[i]!='1')
 		{
 			indir.indir_blocks[i]='1';
 			memcpy(block_buff,&indir,sizeof(indir_data));
-			block_write(INDIR_DATA,block_buff);
+			fs_block_write(INDIR_DATA,block_buff);
 			//go to it and set all pointers to -1
-			block_read(i+IBLK_STRT,block_buff);
-			indirect new;
-			memcpy(&new,block_buff,sizeof(indirect));
+			int* blocks=(int*)block_buff;
 			int j;
-			for(j=0;j<128;j++)
+			for(j=0;j<PTRS_PER_BLK;j++)
 			{
-				new.blocks[j]=-1;
+				blocks[j]=-1;
 			}		
-			memcpy(block_buff,&new,sizeof(indirect));
-			block_write(i+IBLK_STRT,block_buff);
+			fs_block_write(i+IBLK_STRT,block_buff);
+			pthread_mutex_unlock(&indir_lock);
+			block_put(block_buff);
 			return i+IBLK_STRT;
 		}			
 	}
+	pthread_mutex_unlock(&indir_lock);
+	block_put(block_buff);
 	return -1;
 }
 
 
-int find_direct()
+void alloc_scanned(unsigned long entries)
+{
+	//one find_direct call looked at entries map entries
+	STAT_ADD(stats.alloc_entries,entries);
+	stat_max(&(stats.alloc_max),entries);
+}
+
+/*
+ * Find a free data disk block and mark it used: the first one at or after
+ * goal in goal's allocation group, or failing that in the groups after it.
+ * Files start out in their inode's group (NODE_GROUP) and grow from the
+ * block before, so they stay together and files written at the same time
+ * are allocated from different groups, each locked on its own.
+ */
+int find_direct(int goal)
 {
-	//find and return the number of the first free data disk block
-	int k,l,from=-1;
-	data_list metadata;
-	char* block_buff=malloc(BLOCK_SIZE);
-	for(k=0;k<56;k++)
+	int n,l;
+	if(goal<DISK_STRT||goal>=DISK_END)
+	{
+		goal=DISK_STRT;
+	}
+	int first=GROUP_OF(goal);
+	char* block_buff=block_get();
+	unsigned long scanned=0;
+	STAT_ADD(stats.alloc_scans,1);
+	//once around, then the start of the first group that was skipped
+	for(n=0;n<=NUM_MDATA;n++)
 	{
-		block_read(k+MDATA_STRT,block_buff);
-		memcpy(&metadata,block_buff,sizeof(data_list));
-		for(l=0;l<512;l++)
+		int k=(first+n)%NUM_MDATA;
+		int from=(n==0) ? (goal-DISK_STRT)%fs.block_size : 0;
+		if(fs.mdata_used[k]>=fs.block_size)
+		{
+			//full, no need to look
+			continue;
+		}
+		pthread_mutex_lock(&(group_lock[k]));
+		STAT_ADD(stats.alloc_groups,1);
+		if(fs.mdata_used[k]==0)
+		{
+			//all free, possibly never written
+			memset(block_buff,'0',fs.block_size);
+		}
+		else if(fs_block_read(k+MDATA_STRT,block_buff)<0)
+		{
+			//damaged, nothing is taken from it (or written back over it) until sfs_fsck has
+			//had a look
+			pthread_mutex_unlock(&(group_lock[k]));
+			continue;
+		}
+		for(l=from;l<fs.block_size;l++)
 		{
-			if(metadata.data[l]=='0')
+			if(MAP_REFS(block_buff[l])==0)
 			{
-				metadata.data[l]='1';
-				memcpy(block_buff,&metadata,sizeof(data_list));
-				block_write(k+MDATA_STRT,block_buff);
-				free(block_buff);
-				return DISK_STRT+(512*k+l);
+				block_buff[l]='1';
+				fs_block_write(k+MDATA_STRT,block_buff);
+				fs.mdata_used[k]++;
+				pthread_mutex_unlock(&(group_lock[k]));
+				block_put(block_buff);
+				alloc_scanned(scanned+l-from+1);
+				return DISK_STRT+(fs.block_size*k+l);
 			}
 		}	
+		pthread_mutex_unlock(&(group_lock[k]));
+		scanned+=fs.block_size-from;
 	}
-	free(block_buff);
+	block_put(block_buff);
+	alloc_scanned(scanned);
 	return -1;
 }
 
-/**
- * Initialize filesystem
- *
- * The return value will passed in the private_data field of
- * fuse_context to all file operations and as a parameter to the
- * destroy() method.
- *
- * Introduced in version 2.3
- * Changed in version 2.6
- */
-void *sfs_init(struct fuse_conn_info *conn)
+int block_refs(int block)
 {
-    //fprintf(stderr, "in sfs_init\n");
-    log_msg("\nsfs_init()\n");
-    
-    disk_open(SFS_DATA->diskfile);
-    superblock sblock;
-    char* block_buff=malloc(BLOCK_SIZE);
-    int check=block_read(0,block_buff);
-    if(check<=0)
-    {
-	    //fs is not inited, so init it
-	    int i;
-	    log_msg("\nfs file not inited\n");
-	    sblock.verify=VER;
-	    sblock.num_files=0;
-	    sblock.access=(long)time(NULL);
-	    sblock.change=sblock.access;
-	    sblock.modify=sblock.access;
-	    sblock.mode=S_IRWXU;
-	    for(i=0;i<NUM_NODES;i++)
-	    {
-		    sblock.node_list[i]='0';
-	    }
-	    memcpy(block_buff,&sblock,sizeof(superblock));
-	    block_write(0,block_buff);
-	    data_list metadata;
-	    for(i=0;i<512;i++)
-	    {
-		    metadata.data[i]='0';
-	    }
-	    memcpy(block_buff,&metadata,sizeof(data_list));
-	    for(i=MDATA_STRT;i<INDIR_DATA;i++)
-	    {
-		    //initialize all metadatas to empty
-		block_write(i,block_buff);
-	    }
-	    indir_data indir;
-	    for(i=0;i<192;i++)
-	    {
-		indir.indir_blocks[i]='0';
-	    }
-	    indir.d_indir_block='0';
-	    memcpy(block_buff,&indir,sizeof(indir_data));
-	    block_write(INDIR_DATA,block_buff);
+	//how many pointers there are to data disk block block, -EIO if its map is damaged
+	block=block-DISK_STRT;
+	int md_block=block/fs.block_size;
+	if(!fs.mdata_shared[md_block])
+	{
+		//nothing in this metadata block was ever shared, no need to look
+		return 1;
+	}
+	char* block_buff=block_get();
+	pthread_mutex_lock(&(group_lock[md_block]));
+	int retstat=fs_block_read(md_block+MDATA_STRT,block_buff);
+	pthread_mutex_unlock(&(group_lock[md_block]));
+	int refs=(retstat<0) ? -EIO : MAP_REFS(block_buff[block%fs.block_size]);
+	block_put(block_buff);
+	return refs;
+}
 
-	    log_msg("\nfinished initing fs\n");
-    }
-    else
-    {
-    	//see if it is actually our fs
-	memcpy(&sblock,block_buff,sizeof(superblock));
-	if(sblock.verify!=VER)
+int ref_direct(int block)
+{
+	//add a pointer to data disk block block, fails once the count can't go higher or when
+	//its map is damaged
+	block=block-DISK_STRT;
+	int md_block=block/fs.block_size;
+	int md_index=block%fs.block_size;
+	char* block_buff=block_get();
+	pthread_mutex_lock(&(group_lock[md_block]));
+	int retstat=(fs_block_read(md_block+MDATA_STRT,block_buff)<0) ? -EIO : 0;
+	if(retstat==0&&MAP_REFS(block_buff[md_index])>=MAX_REFS)
 	{
-		log_msg("\nnot our fs, exiting failure\n");
-		exit(EXIT_FAILURE);
+		retstat=-EMLINK;
 	}
-	//otherwise it's fine
-	log_msg("\nsuccesfully opened fs file\n");
-    }
-    free(block_buff);
-    
+	if(retstat<0)
+	{
+		pthread_mutex_unlock(&(group_lock[md_block]));
+		block_put(block_buff);
+		return retstat;
+	}
+	block_buff[md_index]++;
+	fs.mdata_shared[md_block]=1;
+	fs_block_write(md_block+MDATA_STRT,block_buff);
+	pthread_mutex_unlock(&(group_lock[md_block]));
+	block_put(block_buff);
+	return 0;
+}
 
-    log_conn(conn);
-    //log_fuse_context(fuse_get_context());
+int free_direct(int block)
+{
+	//drop a pointer to data disk block block, marking it free in its metadata block once none are left.
+	//-EIO if that is damaged, the block then stays taken until sfs_fsck sorts the map out
+	block=block-DISK_STRT; //first,second,third,... data block
+	int md_block=block/fs.block_size; //which of the metadata blocks holds this ones data
+	int md_index=block%fs.block_size; //index of this block's data in the metadata block
+	char* block_buff=block_get();
+	pthread_mutex_lock(&(group_lock[md_block]));
+	if(fs_block_read(md_block+MDATA_STRT,block_buff)<0)
+	{
+		pthread_mutex_unlock(&(group_lock[md_block]));
+		block_put(block_buff);
+		log_msg("\nmap of block %d is damaged, not freeing it\n",block+DISK_STRT);
+		return -EIO;
+	}
+	int refs=MAP_REFS(block_buff[md_index]);
+	if(refs>1)
+	{
+		//still shared
+		block_buff[md_index]--;
+	}
+	else
+	{
+		if(refs==1)
+		{
+			fs.mdata_used[md_block]--;
+		}
+		block_buff[md_index]='0';
+	}
+	fs_block_write(md_block+MDATA_STRT,block_buff);
+	pthread_mutex_unlock(&(group_lock[md_block]));
+	block_put(block_buff);
+	return 0;
+}
+
+int free_run(int want, int* len, int* free_blocks, int* free_extents)
+{
+	//find the first run of at least want free data disk blocks, or the longest one if none is
+	//that long, and return its first block with its length in len.  Counts all the free
+	//blocks, and the runs they make up, on the way
+	int k,l;
+	int best=-1,best_len=0,start=0,run=0;
+	*free_blocks=0;
+	*free_extents=0;
+	char* block_buff=block_get();
+	for(k=0;k<NUM_MDATA;k++)
+	{
+		if(fs.mdata_used[k]==0)
+		{
+			//all free, possibly never written
+			memset(block_buff,'0',fs.block_size);
+		}
+		else if(fs.mdata_used[k]>=fs.block_size)
+		{
+			//full, no need to look
+			memset(block_buff,'1',fs.block_size);
+		}
+		else
+		{
+			pthread_mutex_lock(&(group_lock[k]));
+			if(fs_block_read(k+MDATA_STRT,block_buff)<0)
+			{
+				//damaged, none of it counts as free
+				memset(block_buff,'1',fs.block_size);
+			}
+			pthread_mutex_unlock(&(group_lock[k]));
+		}
+		for(l=0;l<fs.block_size;l++)
+		{
+			if(MAP_REFS(block_buff[l])!=0)
+			{
+				run=0;
+				continue;
+			}
+			if(run==0)
+			{
+				start=fs.block_size*k+l;
+				(*free_extents)++;
+			}
+			run++;
+			(*free_blocks)++;
+			if(best_len<want&&run>best_len)
+			{
+				best=start;
+				best_len=run;
+			}
+		}
+	}
+	block_put(block_buff);
+	*len=best_len;
+	return (best==-1) ? -1 : DISK_STRT+best;
+}
+
+int claim_direct(int block)
+{
+	//mark data disk block block as used by one file if it is still free, -1 when it isn't: free_run
+	//looks without the group locks, so find_direct may have handed it out since
+	block=block-DISK_STRT;
+	int md_block=block/fs.block_size;
+	int md_index=block%fs.block_size;
+	char* block_buff=block_get();
+	int taken=0;
+	pthread_mutex_lock(&(group_lock[md_block]));
+	if(fs.mdata_used[md_block]==0)
+	{
+		//possibly never written
+		memset(block_buff,'0',fs.block_size);
+	}
+	else
+	{
+		//a map that can't be read isn't trusted to say the block is free
+		taken=fs_block_read(md_block+MDATA_STRT,block_buff)<0||MAP_REFS(block_buff[md_index])!=0;
+	}
+	if(taken)
+	{
+		pthread_mutex_unlock(&(group_lock[md_block]));
+		block_put(block_buff);
+		return -1;
+	}
+	block_buff[md_index]='1';
+	fs_block_write(md_block+MDATA_STRT,block_buff);
+	fs.mdata_used[md_block]++;
+	pthread_mutex_unlock(&(group_lock[md_block]));
+	block_put(block_buff);
+	return 0;
+}
+
+/*
+ * Deduplication.  Whole blocks written are fingerprinted with block_hash
+ * and looked up in dedup_index; when a block in use already holds the same
+ * bytes the file's pointer is set to it and its count goes up, like a
+ * clone, instead of writing a block of its own.  Otherwise the block is
+ * written as usual and indexed.  Nothing is taken out of the index when
+ * blocks are freed or written over, dedup_ref compares the block under its
+ * group's lock before sharing it, and writing to a shared block copies it
+ * first (see map_block) so the others keep what they had.
+ */
+#define ROTL64(x, r) (((x)<<(r))|((x)>>(64-(r))))
+
+unsigned long long block_hash(const char* buf)
+{
+	//fingerprint of a whole block, four lanes of 8 byte words mixed like xxHash64 does
+	const unsigned long long p1=11400714785074694791ULL,p2=14029467366897019727ULL;
+	unsigned long long v[4]={p1+p2,p2,0,-p1};
+	unsigned long long w;
+	const char* end=buf+fs.block_size;
+	int i;
+	for(;buf<end;buf+=4*sizeof(w))
+	{
+		for(i=0;i<4;i++)
+		{
+			memcpy(&w,buf+i*sizeof(w),sizeof(w));
+			v[i]=ROTL64(v[i]+w*p2,31)*p1;
+		}
+	}
+	unsigned long long h=ROTL64(v[0],1)+ROTL64(v[1],7)+ROTL64(v[2],12)+ROTL64(v[3],18);
+	h^=h>>33;
+	h*=p2;
+	h^=h>>29;
+	return h;
+}
+
+int dedup_find(unsigned long long hash)
+{
+	//block last indexed with this fingerprint, 0 for none
+	int i,block=0;
+	pthread_mutex_lock(&dedup_lock);
+	for(i=0;i<DEDUP_PROBE;i++)
+	{
+		dedup_entry* e=&(dedup_index[(hash+i)&dedup_mask]);
+		if(e->block!=0&&e->hash==hash)
+		{
+			block=e->block;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&dedup_lock);
+	return block;
+}
+
+void dedup_add(unsigned long long hash, int block)
+{
+	//index block as holding data with this fingerprint
+	int i;
+	dedup_entry* e=NULL;
+	pthread_mutex_lock(&dedup_lock);
+	for(i=0;i<DEDUP_PROBE;i++)
+	{
+		dedup_entry* at=&(dedup_index[(hash+i)&dedup_mask]);
+		if(at->block==0||at->hash==hash)
+		{
+			e=at;
+			break;
+		}
+	}
+	if(e==NULL)
+	{
+		e=&(dedup_index[hash&dedup_mask]);
+	}
+	e->hash=hash;
+	e->block=block;
+	pthread_mutex_unlock(&dedup_lock);
+}
+
+int dedup_ref(int block, const char* data)
+{
+	//add a pointer to data disk block block if it is in use and holds data, under its group's
+	//lock so it can't be freed in between.  Fails if it doesn't or the count can't go higher
+	int md_block=(block-DISK_STRT)/fs.block_size;
+	int md_index=(block-DISK_STRT)%fs.block_size;
+	char* block_buff=block_get();
+	char* held=block_get();
+	int retstat=-ENOENT;
+	pthread_mutex_lock(&(group_lock[md_block]));
+	if(fs.mdata_used[md_block]>0)
+	{
+		int refs=(fs_block_read(md_block+MDATA_STRT,block_buff)<0) ? -EIO : MAP_REFS(block_buff[md_index]);
+		if(refs<0)
+		{
+			retstat=refs;
+		}
+		else if(refs>=MAX_REFS)
+		{
+			retstat=-EMLINK;
+		}
+		else if(refs>0)
+		{
+			if(fs_block_read(block,held)>=0&&memcmp(held,data,fs.block_size)==0)
+			{
+				block_buff[md_index]++;
+				fs.mdata_shared[md_block]=1;
+				fs_block_write(md_block+MDATA_STRT,block_buff);
+				retstat=0;
+			}
+		}
+	}
+	pthread_mutex_unlock(&(group_lock[md_block]));
+	block_put(held);
+	block_put(block_buff);
+	return retstat;
+}
+
+int read_entry(int pblock, int index)
+{
+	//return pointer number index of the indirect block pblock, -EIO if it is damaged
+	char* block_buff=block_get();
+	int entry=(fs_block_read(pblock,block_buff)<0) ? -EIO : ((int*)block_buff)[index];
+	block_put(block_buff);
+	return entry;
+}
+
+int write_entry(int pblock, int index, int block)
+{
+	//set pointer number index of the indirect block pblock.  -EIO if it is damaged, it isn't
+	//written back then: that would give the damage a checksum that matches
+	char* block_buff=block_get();
+	int retstat=(fs_block_read(pblock,block_buff)<0) ? -EIO : 0;
+	if(retstat==0)
+	{
+		((int*)block_buff)[index]=block;
+		fs_block_write(pblock,block_buff);
+	}
+	block_put(block_buff);
+	return retstat;
+}
+
+int alloc_entry(int pblock, int index, int (*find)())
+{
+	//fill the empty pointer number index of the indirect block pblock with a block from find,
+	//-1 when there is none
+	int block=find();
+	if(block<0)
+	{
+		return block;
+	}
+	if(write_entry(pblock,index,block)<0)
+	{
+		//left taken until sfs_fsck finds nothing points at it
+		log_msg("\nindirect block %d is damaged, block %d leaks\n",pblock,block);
+		return -EIO;
+	}
+	return block;
+}
+
+/*
+ * Find where the pointer to logical block lblock of a file is kept: entry
+ * *index of node->direct when *pblock comes back -1, otherwise entry *index
+ * of indirect block *pblock.  Returns -1 if an indirect block on the way is
+ * missing, unless alloc is set and it gets allocated.
+ */
+int locate_block(inode* node, int lblock, int alloc, int* pblock, int* index)
+{
+	int rel;
+	if(lblock<0)
+	{
+		return -EINVAL;
+	}
+	if(lblock<SINGLE_STRT)
+	{
+		//direct
+		*pblock=-1;
+		*index=lblock;
+		return 0;
+	}
+	else if(lblock<DOUBLE_STRT)
+	{
+		//single indirects
+		rel=lblock-SINGLE_STRT;
+		int* indir_index=&(node->single_indirect[rel/PTRS_PER_BLK]);
+		if(*indir_index==-1)
+		{
+			if(!alloc)
+			{
+				//the whole indirect block is a hole
+				return -1;
+			}
+			int found=find_indirect();
+			if(found<0)
+			{
+				return (found==-1) ? -ENOSPC : found;
+			}
+			*indir_index=found;
+		}
+		*pblock=*indir_index;
+		*index=rel%PTRS_PER_BLK;
+		return 0;
+	}
+	else if(lblock<MAX_BLOCKS)
+	{
+		//double indirect
+		rel=lblock-DOUBLE_STRT;
+		if(node->double_indirect==-1)
+		{
+			if(!alloc)
+			{
+				return -1;
+			}
+			int found=find_d_indirect();
+			if(found<0)
+			{
+				return (found==-1) ? -ENOSPC : found;
+			}
+			node->double_indirect=found;
+		}
+		int indir_index=read_entry(node->double_indirect,rel/PTRS_PER_BLK);
+		if(indir_index<-1)
+		{
+			return indir_index;
+		}
+		if(indir_index==-1)
+		{
+			if(!alloc)
+			{
+				return -1;
+			}
+			indir_index=alloc_entry(node->double_indirect,rel/PTRS_PER_BLK,find_indirect);
+			if(indir_index<0)
+			{
+				return (indir_index==-1) ? -ENOSPC : indir_index;
+			}
+		}
+		*pblock=indir_index;
+		*index=rel%PTRS_PER_BLK;
+		return 0;
+	}
+	//past the largest file we can map
+	return -EFBIG;
+}
+
+int get_pointer(inode* node, int pblock, int index)
+{
+	return (pblock==-1) ? node->direct[index] : read_entry(pblock,index);
+}
+
+/*
+ * Decoded block maps, so translating a logical block past the direct ones
+ * costs no reads once its indirect block has been looked at.  There is one
+ * per inode slot, kept while the file is open and shared by every open of
+ * it, so they all see the blocks the others allocate.  Chunk c holds the
+ * pointers of the indirect block behind logical blocks SINGLE_STRT +
+ * c*PTRS_PER_BLK on, as loaded the first time one of them is looked up and
+ * kept up to date by set_pointer.
+ */
+uint64_t bmap_open(int slot)
+{
+	//returns the file handle for this open, see fh_slot
+	pthread_mutex_lock(&bmap_lock);
+	if(bmaps[slot].opens++==0)
+	{
+		bmaps[slot].chunks=calloc(NUM_CHUNKS,sizeof(int*));
+		bmaps[slot].pack_lo=0;
+		bmaps[slot].pack_hi=0;
+	}
+	uint64_t fh=((uint64_t)bmaps[slot].gen<<32)|(uint64_t)slot;
+	pthread_mutex_unlock(&bmap_lock);
+	return fh;
+}
+
+int fh_slot(uint64_t fh)
+{
+	//slot of the file a handle from bmap_open is open on, -ESTALE once that file has been
+	//freed (the high-level unlink doesn't wait for it to be closed), as the slot may hold
+	//another one by now
+	int slot=(int)(fh&0xffffffff);
+	pthread_mutex_lock(&bmap_lock);
+	int same=(bmaps[slot].gen==(unsigned int)(fh>>32));
+	pthread_mutex_unlock(&bmap_lock);
+	return same ? slot : -ESTALE;
+}
+
+void bmap_drop(int slot)
+{
+	//forget every loaded chunk, with bmap_lock held
+	int c;
+	bmaps[slot].changes++;
+	if(bmaps[slot].chunks==NULL)
+	{
+		return;
+	}
+	for(c=0;c<NUM_CHUNKS;c++)
+	{
+		if(bmaps[slot].chunks[c]!=bmap_holes)
+		{
+			free(bmaps[slot].chunks[c]);
+		}
+		bmaps[slot].chunks[c]=NULL;
+	}
+}
+
+void bmap_release(uint64_t fh)
+{
+	int slot=(int)(fh&0xffffffff);
+	pthread_mutex_lock(&bmap_lock);
+	if(bmaps[slot].gen!=(unsigned int)(fh>>32))
+	{
+		//bmap_forget already let go of the opens of the file that was in the slot
+		pthread_mutex_unlock(&bmap_lock);
+		return;
+	}
+	if(bmaps[slot].opens>0&&--bmaps[slot].opens==0)
+	{
+		bmap_drop(slot);
+		free(bmaps[slot].chunks);
+		bmaps[slot].chunks=NULL;
+	}
+	pthread_mutex_unlock(&bmap_lock);
+}
+
+void bmap_forget(int slot)
+{
+	//the file in slot is gone, the slot may be open again for another one.  Handles still open
+	//on the old file stop working, see fh_slot
+	pthread_mutex_lock(&bmap_lock);
+	bmap_drop(slot);
+	free(bmaps[slot].chunks);
+	bmaps[slot].chunks=NULL;
+	bmaps[slot].opens=0;
+	bmaps[slot].pack_lo=0;
+	bmaps[slot].pack_hi=0;
+	bmaps[slot].gen++;
+	pthread_mutex_unlock(&bmap_lock);
+}
+
+int bmap_read(inode* node, int c, int** chunk)
+{
+	//read the pointers of the indirect block behind chunk c of node's map into a new chunk,
+	//bmap_holes when there is none.  -EIO when it is damaged
+	int pblock;
+	*chunk=NULL;
+	if(c<NUM_SINGLE)
+	{
+		pblock=node->single_indirect[c];
+	}
+	else
+	{
+		pblock=(node->double_indirect==-1) ? -1 : read_entry(node->double_indirect,c-NUM_SINGLE);
+	}
+	if(pblock<-1)
+	{
+		return pblock;
+	}
+	if(pblock==-1)
+	{
+		*chunk=bmap_holes;
+		return 0;
+	}
+	*chunk=block_alloc();
+	if(fs_block_read(pblock,*chunk)<0)
+	{
+		//not kept, the next lookup fails the same way
+		free(*chunk);
+		*chunk=NULL;
+		return -EIO;
+	}
+	return 0;
+}
+
+int bmap_get(inode* node, int lblock)
+{
+	//pointer to logical block lblock, past the direct ones, from the decoded map of node.
+	//-2 when the file isn't open and has no map, -EIO when an indirect block is damaged.
+	//A chunk that isn't loaded is read without bmap_lock, so lookups don't all wait on one
+	//disk read, and only kept if no pointer of the file changed meanwhile: it could be from
+	//before the change, which bmap_set had no chunk to make in.  The next try reads it with
+	//the lock held, so a file written to all the time still gets it loaded
+	int slot=node->node_num-1;
+	int rel=lblock-SINGLE_STRT;
+	int c=rel/PTRS_PER_BLK;
+	int* loaded=NULL;
+	int retstat=0;
+	int tries=0;
+	pthread_mutex_lock(&bmap_lock);
+	if(bmaps[slot].chunks!=NULL&&bmaps[slot].chunks[c]!=NULL)
+	{
+		STAT_ADD(stats.bmap_hits,1);
+	}
+	else if(bmaps[slot].chunks!=NULL)
+	{
+		STAT_ADD(stats.bmap_misses,1);
+	}
+	while(bmaps[slot].chunks!=NULL&&bmaps[slot].chunks[c]==NULL)
+	{
+		unsigned long seen=bmaps[slot].changes;
+		if(tries==0)
+		{
+			pthread_mutex_unlock(&bmap_lock);
+		}
+		retstat=bmap_read(node,c,&loaded);
+		if(tries++==0)
+		{
+			pthread_mutex_lock(&bmap_lock);
+		}
+		if(retstat<0)
+		{
+			break;
+		}
+		if(bmaps[slot].chunks!=NULL&&bmaps[slot].chunks[c]==NULL&&bmaps[slot].changes==seen)
+		{
+			bmaps[slot].chunks[c]=loaded;
+			loaded=NULL;
+		}
+		if(loaded!=bmap_holes)
+		{
+			//someone else loaded it first, or it may be stale
+			free(loaded);
+		}
+		loaded=NULL;
+	}
+	int block=-2;
+	if(retstat<0)
+	{
+		block=retstat;
+	}
+	else if(bmaps[slot].chunks!=NULL)
+	{
+		int* chunk=bmaps[slot].chunks[c];
+		block=(chunk==bmap_holes) ? -1 : chunk[rel%PTRS_PER_BLK];
+	}
+	pthread_mutex_unlock(&bmap_lock);
+	return block;
+}
+
+void bmap_set(inode* node, int lblock, int block)
+{
+	//keep the decoded map of node in step with a pointer that changed
+	int slot=node->node_num-1;
+	int rel=lblock-SINGLE_STRT;
+	int c=rel/PTRS_PER_BLK;
+	pthread_mutex_lock(&bmap_lock);
+	bmaps[slot].changes++;
+	int** chunks=bmaps[slot].chunks;
+	if(chunks!=NULL&&chunks[c]!=NULL)
+	{
+		if(chunks[c]==bmap_holes)
+		{
+			//its indirect block was just allocated
+			chunks[c]=block_alloc();
+			memset(chunks[c],0xff,fs.block_size);
+		}
+		chunks[c][rel%PTRS_PER_BLK]=block;
+	}
+	pthread_mutex_unlock(&bmap_lock);
+}
+
+int set_pointer(inode* node, int lblock, int pblock, int index, int block)
+{
+	//point logical block lblock, whose pointer locate_block found at pblock and index, at block.
+	//-EIO if the indirect block is damaged, nothing changes then
+	if(pblock==-1)
+	{
+		node->direct[index]=block;
+	}
+	else
+	{
+		int retstat=write_entry(pblock,index,block);
+		if(retstat<0)
+		{
+			return retstat;
+		}
+		bmap_set(node,lblock,block);
+	}
+	return 0;
+}
+
+int get_inode(int slot, inode* node, char* block_buff)
+{
+	//fill node with the inode in slot, from memory if it has changes not written yet.
+	//block_buff is somewhere to read it into otherwise.  -EIO if its block is damaged
+	pthread_mutex_lock(&dnodes_lock);
+	if(dnodes[slot].dirty)
+	{
+		memcpy(node,&(dnodes[slot].node),sizeof(inode));
+		pthread_mutex_unlock(&dnodes_lock);
+		STAT_ADD(stats.dnode_hits,1);
+		return 0;
+	}
+	pthread_mutex_unlock(&dnodes_lock);
+	STAT_ADD(stats.dnode_misses,1);
+	int retstat=fs_block_read(slot+NODE_STRT,block_buff);
+	memcpy(node,block_buff,sizeof(inode));
+	return (retstat<0) ? -EIO : 0;
+}
+
+int read_inode(int slot, inode* node)
+{
+	//fill node with the inode in slot, as handed out to the low-level interface
+	if(slot<0||slot>=NUM_NODES)
+	{
+		return -ENOENT;
+	}
+	superblock sb;
+	char* block_buff=block_get();
+	fs_block_read(0,block_buff);
+	memcpy(&sb,block_buff,sizeof(superblock));
+	if(sb.node_list[slot]!='1')
+	{
+		block_put(block_buff);
+		return -ENOENT;
+	}
+	int retstat=get_inode(slot,node,block_buff);
+	block_put(block_buff);
+	return (retstat<0) ? retstat : slot;
+}
+
+void put_inode(int slot, inode* node)
+{
+	//write node to its block, with dnodes_lock held
+	char* block_buff=block_get();
+	memset(block_buff,0,fs.block_size);
+	memcpy(block_buff,node,sizeof(inode));
+	fs_block_write(slot+NODE_STRT,block_buff);
+	block_put(block_buff);
+	dnodes[slot].dirty=0;
+}
+
+void write_inode(int slot, inode* node)
+{
+	//write node now, along with anything mark_inode was holding back
+	pthread_mutex_lock(&dnodes_lock);
+	put_inode(slot,node);
+	pthread_mutex_unlock(&dnodes_lock);
+}
+
+/*
+ * Keep changes to an inode in memory instead of writing its block, for
+ * the ones every read and write makes: times, the size, and pointers to
+ * newly allocated blocks.  Losing those in a crash only leaks the blocks,
+ * which the next mount's check (or sfs_fsck) gets back.  They are written
+ * by flush_inode when the file is flushed, synced, released or forgotten
+ * by the kernel, or by the next write_inode.  how is DIRTY_TIMES, which
+ * only takes node's access time (what reads change), or DIRTY_SIZE, which
+ * takes all of it.
+ */
+void mark_inode(int slot, inode* node, int how)
+{
+	pthread_mutex_lock(&dnodes_lock);
+	if(how==DIRTY_TIMES)
+	{
+		//reads only change the access time, the rest of node may be older than what a write
+		//running alongside has put in dnodes or on disk since
+		inode* held=&(dnodes[slot].node);
+		if(!dnodes[slot].dirty)
+		{
+			char* block_buff=block_get();
+			int retstat=fs_block_read(slot+NODE_STRT,block_buff);
+			memcpy(held,block_buff,sizeof(inode));
+			block_put(block_buff);
+			if(retstat<0)
+			{
+				pthread_mutex_unlock(&dnodes_lock);
+				return;
+			}
+		}
+		//never backwards, a read that started later may have been here first
+		if(node->access>held->access)
+		{
+			held->access=node->access;
+		}
+	}
+	else
+	{
+		memcpy(&(dnodes[slot].node),node,sizeof(inode));
+	}
+	if(how>dnodes[slot].dirty)
+	{
+		dnodes[slot].dirty=how;
+	}
+	pthread_mutex_unlock(&dnodes_lock);
+}
+
+int flush_inode(int slot, int how)
+{
+	//write the inode in slot if it is held back with changes at least as important as how,
+	//returns whether it was
+	int flushed=0;
+	pthread_mutex_lock(&dnodes_lock);
+	if(dnodes[slot].dirty>=how)
+	{
+		put_inode(slot,&(dnodes[slot].node));
+		flushed=1;
+	}
+	pthread_mutex_unlock(&dnodes_lock);
+	return flushed;
+}
+
+unsigned long file_seen()
+{
+	//file_moves as of now, taken before reading an inode for file_hold
+	return __sync_fetch_and_add(&file_moves,0);
+}
+
+int file_hold(int slot, inode* node, unsigned long seen)
+{
+	//lock the file in slot for a read or write through node, which was read after
+	//file_seen returned seen.  If blocks were moved since, node is read again: it could
+	//point at blocks that were freed, or put back pointers that were replaced.  An error
+	//in slot is passed through, otherwise the slot comes back
+	if(slot<0)
+	{
+		return slot;
+	}
+	pthread_rwlock_rdlock(&(file_lock[slot]));
+	if(file_seen()!=seen)
+	{
+		int retstat=read_inode(slot,node);
+		if(retstat<0)
+		{
+			pthread_rwlock_unlock(&(file_lock[slot]));
+			return retstat;
+		}
+	}
+	return slot;
+}
+
+int file_seize(int slot, inode* node)
+{
+	//lock the file in slot to move its blocks, with node read again under the lock, as
+	//what the caller has may be older than a write that was running
+	pthread_rwlock_wrlock(&(file_lock[slot]));
+	int retstat=read_inode(slot,node);
+	if(retstat<0)
+	{
+		pthread_rwlock_unlock(&(file_lock[slot]));
+	}
+	return retstat;
+}
+
+void file_unhold(int slot, int moved)
+{
+	//undo file_hold, or file_seize after moving blocks if moved is set
+	if(moved)
+	{
+		__sync_fetch_and_add(&file_moves,1);
+	}
+	pthread_rwlock_unlock(&(file_lock[slot]));
+}
+
+/*
+ * Member threads, one for each member disk file past the first, kept for
+ * as long as the volume is mounted.  member_each hands each of them its
+ * member's part of a request (the blocks of a large read or write, see
+ * block_batch, or an fdatasync) and does the first member's part itself,
+ * so that one request keeps every drive busy.  One request has the
+ * threads at a time; another one wanting them meanwhile does its parts
+ * itself, one member after another, which costs little as requests
+ * running at once already spread over the members.  Spliced reads and
+ * writes (see file_read_buf and file_write_buf) are copied by fuse a
+ * piece at a time and don't come through here.
+ */
+typedef struct _member_pool
+{
+	pthread_t threads[MAX_MEMBERS];
+	int started; //threads running, for members 1 to started
+	unsigned long round; //parts handed out so far
+	int pending; //threads still busy with the current round
+	int quit;
+	void (*fn)(int, void*);
+	void* arg;
+} member_pool;
+
+member_pool pool;
+pthread_mutex_t pool_lock=PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t pool_work=PTHREAD_COND_INITIALIZER; //a new round, or quit
+pthread_cond_t pool_done=PTHREAD_COND_INITIALIZER; //pending reached 0
+pthread_mutex_t pool_busy=PTHREAD_MUTEX_INITIALIZER; //held by the request using the threads
+
+void* member_thread(void* arg)
+{
+	int member=(int)(intptr_t)arg;
+	unsigned long seen=0;
+	pthread_mutex_lock(&pool_lock);
+	for(;;)
+	{
+		while(!pool.quit&&pool.round==seen)
+		{
+			pthread_cond_wait(&pool_work,&pool_lock);
+		}
+		if(pool.quit)
+		{
+			break;
+		}
+		seen=pool.round;
+		void (*fn)(int, void*)=pool.fn;
+		void* fn_arg=pool.arg;
+		pthread_mutex_unlock(&pool_lock);
+		fn(member,fn_arg);
+		pthread_mutex_lock(&pool_lock);
+		if(--pool.pending==0)
+		{
+			pthread_cond_signal(&pool_done);
+		}
+	}
+	pthread_mutex_unlock(&pool_lock);
+	return NULL;
+}
+
+void pool_stop()
+{
+	//with no requests running
+	int i;
+	pthread_mutex_lock(&pool_lock);
+	pool.quit=1;
+	pthread_cond_broadcast(&pool_work);
+	pthread_mutex_unlock(&pool_lock);
+	for(i=1;i<=pool.started;i++)
+	{
+		pthread_join(pool.threads[i],NULL);
+	}
+	pool.started=0;
+}
+
+void pool_start()
+{
+	//start the member threads, from sfs_init as fuse may have forked into the background by then
+	int i;
+	pool_stop();
+	pool.round=0;
+	pool.quit=0;
+	for(i=1;i<fs.members;i++)
+	{
+		if(pthread_create(&(pool.threads[i]),NULL,member_thread,(void*)(intptr_t)i)!=0)
+		{
+			log_msg("\ncould not start a thread for member %d, members are used one after another\n",i);
+			pool_stop();
+			return;
+		}
+		pool.started=i;
+	}
+}
+
+void member_each(void (*fn)(int, void*), void* arg)
+{
+	//run fn(member,arg) for every member at once, see member_pool
+	int i;
+	if(pool.started!=fs.members-1||pool.started==0||pthread_mutex_trylock(&pool_busy)!=0)
+	{
+		for(i=0;i<fs.members;i++)
+		{
+			fn(i,arg);
+		}
+		return;
+	}
+	pthread_mutex_lock(&pool_lock);
+	pool.fn=fn;
+	pool.arg=arg;
+	pool.pending=pool.started;
+	pool.round++;
+	pthread_cond_broadcast(&pool_work);
+	pthread_mutex_unlock(&pool_lock);
+	fn(0,arg);
+	pthread_mutex_lock(&pool_lock);
+	while(pool.pending>0)
+	{
+		pthread_cond_wait(&pool_done,&pool_lock);
+	}
+	pthread_mutex_unlock(&pool_lock);
+	pthread_mutex_unlock(&pool_busy);
+}
+
+void member_sync(int member, void* arg)
+{
+	int* res=(int*)arg;
+	res[member]=(fdatasync(fs.fds[member])<0) ? -errno : 0;
+}
+
+int sync_members()
+{
+	//fdatasync every member disk file, all at once since they are likely on different drives
+	int res[MAX_MEMBERS];
+	int i;
+	int retstat=0;
+	member_each(member_sync,res);
+	for(i=0;i<fs.members;i++)
+	{
+		if(res[i]<0)
+		{
+			retstat=res[i];
+		}
+	}
+	return retstat;
+}
+
+/*
+ * The whole blocks of a large read or write of a striped volume, gathered
+ * while the file's pointers are looked up and then read or written with
+ * member_each, each member's blocks on its own thread.  Each block goes
+ * through a block_get buffer of that thread, as the caller's buffer isn't
+ * aligned for O_DIRECT.
+ */
+typedef struct _block_io
+{
+	int block;
+	int member;
+	int start_index; //where in the block the part the request wants starts
+	size_t len;
+	char* data; //that part, in the request's buffer
+	int failed;
+} block_io;
+
+typedef struct _block_batch
+{
+	block_io* ios; //NULL when the request isn't worth batching
+	int count;
+	int write; //whole blocks written from data instead of read into it
+	scratch* owner; //of the thread the request came in on
+	unsigned long moved[MAX_MEMBERS]; //blocks other threads got through, for its op_done
+} block_batch;
+
+void batch_begin(block_batch* batch, size_t size, int write)
+{
+	//worth it when the request runs over more than one member
+	memset(batch,0,sizeof(block_batch));
+	batch->write=write;
+	if(fs.members>1&&size>(size_t)fs.stripe_width*fs.block_size)
+	{
+		batch->ios=malloc((size/fs.block_size+2)*sizeof(block_io));
+	}
+}
+
+void batch_add(block_batch* batch, int block, char* data, int start_index, size_t len)
+{
+	block_io* io=&(batch->ios[batch->count++]);
+	off_t mblock;
+	io->block=block;
+	io->member=stripe_locate(block,fs.members,fs.stripe_width,&mblock);
+	io->start_index=start_index;
+	io->len=len;
+	io->data=data;
+	io->failed=0;
+}
+
+void batch_member(int member, void* arg)
+{
+	block_batch* batch=(block_batch*)arg;
+	char* block_buff=block_get();
+	unsigned long moved=0;
+	int i;
+	for(i=0;i<batch->count;i++)
+	{
+		block_io* io=&(batch->ios[i]);
+		if(io->member!=member)
+		{
+			continue;
+		}
+		if(batch->write)
+		{
+			memcpy(block_buff,io->data,fs.block_size);
+			fs_block_write(io->block,block_buff);
+		}
+		else if(fs_block_read(io->block,block_buff)<0)
+		{
+			io->failed=1;
+		}
+		else
+		{
+			memcpy(io->data,&(block_buff[io->start_index]),io->len);
+		}
+		moved++;
+	}
+	block_put(block_buff);
+	if(scratch_get()!=batch->owner)
+	{
+		batch->moved[member]=moved;
+	}
+}
+
+char* batch_end(block_batch* batch)
+{
+	//read or write what was gathered, returns where the first block that couldn't be read was to
+	//go, NULL when all of them could
+	int i;
+	char* failed=NULL;
+	if(batch->count>0)
+	{
+		batch->owner=scratch_get();
+		member_each(batch_member,batch);
+		for(i=0;i<fs.members;i++)
+		{
+			if(batch->write)
+			{
+				batch->owner->writes+=batch->moved[i];
+			}
+			else
+			{
+				batch->owner->reads+=batch->moved[i];
+			}
+		}
+		for(i=0;i<batch->count&&failed==NULL;i++)
+		{
+			if(batch->ios[i].failed)
+			{
+				failed=batch->ios[i].data;
+			}
+		}
+	}
+	free(batch->ios);
+	batch->ios=NULL;
+	return failed;
+}
+
+int file_sync(int slot, int datasync)
+{
+	//make what was written to the file durable: the data blocks, and the maps and indirect
+	//blocks pointing at them, have to be on disk before the inode pointing at those.  With
+	//datasync set, changed times alone aren't worth writing the inode for
+	int retstat=sync_members();
+	if(retstat<0)
+	{
+		return retstat;
+	}
+	if(flush_inode(slot,datasync ? DIRTY_SIZE : DIRTY_TIMES))
+	{
+		//the inode is in the superblock's member, only that one has anything new
+		if(fdatasync(fs.fd)<0)
+		{
+			return -errno;
+		}
+	}
+	return 0;
+}
+
+int cow_block(int from, int goal)
+{
+	//give the caller its own copy of a data block shared with other files, see find_direct for goal
+	int to=find_direct(goal);
+	if(to==-1)
+	{
+		return -ENOSPC;
+	}
+	char* block_buff=block_get();
+	if(fs_block_read(from,block_buff)<0)
+	{
+		//damaged.  Copied anyway, with csum_copy giving the copy the checksum of what it should
+		//hold, so it still fails to read: a write of part of it fails like on the original, one
+		//of all of it replaces it
+		log_msg("\ncopying damaged block %d for a write\n",from);
+	}
+	fs_block_write(to,block_buff);
+	csum_copy(from,to);
+	block_put(block_buff);
+	return to;
+}
+
+int alloc_goal(inode* node, int lblock)
+{
+	//where a new data block for logical block lblock should go: right after the one before
+	//it, or at the start of the inode's allocation group
+	if(lblock>0&&lblock<=MAX_BLOCKS)
+	{
+		int prev=(lblock-1<SINGLE_STRT) ? node->direct[lblock-1] : bmap_get(node,lblock-1);
+		int pblock,index;
+		if(prev==-2&&locate_block(node,lblock-1,0,&pblock,&index)==0)
+		{
+			//not open, no decoded map to ask
+			prev=get_pointer(node,pblock,index);
+		}
+		if(IS_PACKED(prev))
+		{
+			prev=(PACKED_BLOCK(prev)!=0) ? PACKED_BLOCK(prev) : -1;
+		}
+		if(prev>=0)
+		{
+			return prev+1;
+		}
+	}
+	return DISK_STRT+NODE_GROUP(node->node_num-1)*fs.block_size;
+}
+
+/*
+ * LZ77 codec for compressed clusters, in the style of LZ4: a run of
+ * sequences, each a token byte (number of literals in the high nibble,
+ * match length minus LZ_MIN_MATCH in the low one, 15 meaning more length
+ * bytes follow, each adding up to 255), the literals, then the match as a
+ * two byte offset back into what was already decoded.  The last sequence
+ * has no match, it ends where the input does.  Matches are found through
+ * a hash table of the last place each 4 bytes were seen.
+ */
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+#define LZ_MAX_OFFSET 65535
+
+unsigned int lz_hash(const unsigned char* p)
+{
+	unsigned int v;
+	memcpy(&v,p,sizeof(v));
+	return (v*2654435761u)>>(32-LZ_HASH_BITS);
+}
+
+int lz_length(unsigned char* out, int op, int len)
+{
+	//extra bytes of a length that didn't fit in its nibble
+	while(len>=255)
+	{
+		out[op++]=255;
+		len-=255;
+	}
+	out[op++]=len;
+	return op;
+}
+
+int lz_sequence(unsigned char* out, int op, int cap, const char* lit, int nlit, int offset, int mlen)
+{
+	//add one sequence, mlen 0 for the last one.  Returns where the output ends, -1 if past cap
+	if(op+1+nlit/255+1+nlit+2+mlen/255+1>cap)
+	{
+		return -1;
+	}
+	int mcode=(mlen>0) ? mlen-LZ_MIN_MATCH : 0;
+	out[op++]=((nlit<15) ? nlit : 15)<<4|((mcode<15) ? mcode : 15);
+	if(nlit>=15)
+	{
+		op=lz_length(out,op,nlit-15);
+	}
+	memcpy(out+op,lit,nlit);
+	op+=nlit;
+	if(mlen>0)
+	{
+		out[op++]=offset&0xff;
+		out[op++]=offset>>8;
+		if(mcode>=15)
+		{
+			op=lz_length(out,op,mcode-15);
+		}
+	}
+	return op;
+}
+
+int lz_compress(const char* in, int in_len, char* out, int cap)
+{
+	//returns the compressed length, or -1 if it would take more than cap bytes
+	const unsigned char* src=(const unsigned char*)in;
+	int table[1<<LZ_HASH_BITS];
+	int i;
+	for(i=0;i<(1<<LZ_HASH_BITS);i++)
+	{
+		table[i]=-1;
+	}
+	int ip=0,anchor=0,op=0;
+	while(ip+LZ_MIN_MATCH<=in_len)
+	{
+		unsigned int h=lz_hash(src+ip);
+		int ref=table[h];
+		table[h]=ip;
+		if(ref<0||ip-ref>LZ_MAX_OFFSET||memcmp(src+ref,src+ip,LZ_MIN_MATCH)!=0)
+		{
+			//the longer it goes without a match the faster it skips, data that doesn't compress
+			//is given up on quickly
+			ip+=1+((ip-anchor)>>6);
+			continue;
+		}
+		int len=LZ_MIN_MATCH;
+		while(ip+len<in_len&&src[ref+len]==src[ip+len])
+		{
+			len++;
+		}
+		op=lz_sequence((unsigned char*)out,op,cap,in+anchor,ip-anchor,ip-ref,len);
+		if(op<0)
+		{
+			return -1;
+		}
+		ip+=len;
+		anchor=ip;
+	}
+	return lz_sequence((unsigned char*)out,op,cap,in+anchor,in_len-anchor,0,0);
+}
+
+int lz_read_length(const unsigned char* in, int in_len, int* ip, int len)
+{
+	//a nibble of 15 and the bytes after it, -1 if they run off the end
+	int b;
+	do
+	{
+		if(*ip>=in_len)
+		{
+			return -1;
+		}
+		b=in[(*ip)++];
+		len+=b;
+	} while(b==255);
+	return len;
+}
+
+int lz_decompress(const char* in, int in_len, char* out, int cap)
+{
+	//returns the decompressed length, or -1 if in isn't something lz_compress made.  It has
+	//to end with a sequence without a match, so that input cut short after a match shows
+	const unsigned char* src=(const unsigned char*)in;
+	int ip=0,op=0;
+	while(1)
+	{
+		if(ip>=in_len)
+		{
+			return -1;
+		}
+		int token=src[ip++];
+		int nlit=token>>4;
+		if(nlit==15&&(nlit=lz_read_length(src,in_len,&ip,nlit))<0)
+		{
+			return -1;
+		}
+		if(nlit>in_len-ip||nlit>cap-op)
+		{
+			return -1;
+		}
+		memcpy(out+op,src+ip,nlit);
+		ip+=nlit;
+		op+=nlit;
+		if(ip==in_len)
+		{
+			//the last sequence
+			break;
+		}
+		if(ip+2>in_len)
+		{
+			return -1;
+		}
+		int offset=src[ip]|src[ip+1]<<8;
+		ip+=2;
+		int mlen=token&15;
+		if(mlen==15&&(mlen=lz_read_length(src,in_len,&ip,mlen))<0)
+		{
+			return -1;
+		}
+		mlen+=LZ_MIN_MATCH;
+		if(offset==0||offset>op||mlen>cap-op)
+		{
+			return -1;
+		}
+		if(offset>=mlen)
+		{
+			memcpy(out+op,out+op-offset,mlen);
+			op+=mlen;
+		}
+		else
+		{
+			//the match runs into itself, repeating the last offset bytes
+			int k;
+			for(k=0;k<mlen;k++,op++)
+			{
+				out[op]=out[op-offset];
+			}
+		}
+	}
+	return op;
+}
+
+void* pack_alloc()
+{
+	//room for a cluster, followed by room for it compressed; aligned like block_alloc
+	void* buf;
+	if(posix_memalign(&buf,SCRATCH_ALIGN,2*PACK_BLOCKS*fs.block_size)!=0)
+	{
+		return NULL;
+	}
+	return buf;
+}
+
+void pack_note(inode* node, int from, int to)
+{
+	//logical blocks from up to to of a file were written, the next file_pack compresses them
+	if(!(node->flags&SFS_FL_COMPRESS)||to<=from)
+	{
+		return;
+	}
+	int slot=node->node_num-1;
+	int lo=from/PACK_BLOCKS;
+	int hi=(to+PACK_BLOCKS-1)/PACK_BLOCKS;
+	pthread_mutex_lock(&bmap_lock);
+	block_map* m=&(bmaps[slot]);
+	if(m->opens>0)
+	{
+		if(m->pack_hi<=m->pack_lo)
+		{
+			m->pack_lo=lo;
+			m->pack_hi=hi;
+		}
+		else
+		{
+			m->pack_lo=(lo<m->pack_lo) ? lo : m->pack_lo;
+			m->pack_hi=(hi>m->pack_hi) ? hi : m->pack_hi;
+		}
+	}
+	pthread_mutex_unlock(&bmap_lock);
+}
+
+int cluster_read(inode* node, int c, char* buf)
+{
+	//decompress cluster c of a file, which has to be packed, into the start of buf from
+	//pack_alloc.  -EIO when what is on disk doesn't make sense
+	int n=PACK_BLOCKS;
+	int first=c*n;
+	char* packed=buf+n*fs.block_size;
+	int j;
+	for(j=0;j<n;j++)
+	{
+		int p=(first+j<SINGLE_STRT) ? node->direct[first+j] : bmap_get(node,first+j);
+		int pblock,index;
+		if(p==-2&&locate_block(node,first+j,0,&pblock,&index)==0)
+		{
+			//not open, no decoded map to ask
+			p=get_pointer(node,pblock,index);
+		}
+		if(!IS_PACKED(p))
+		{
+			return -EIO;
+		}
+		if(PACKED_BLOCK(p)==0)
+		{
+			break;
+		}
+		if(fs_block_read(PACKED_BLOCK(p),packed+j*fs.block_size)<0)
+		{
+			return -EIO;
+		}
+	}
+	pack_header head;
+	memcpy(&head,packed,sizeof(head));
+	if(j==0||head.raw!=(unsigned int)(n*fs.block_size)||head.length>j*fs.block_size-sizeof(head)||
+		lz_decompress(packed+sizeof(head),head.length,buf,n*fs.block_size)!=n*fs.block_size)
+	{
+		log_msg("\ncompressed cluster %d of inode %d is damaged\n",c,node->node_num);
+		return -EIO;
+	}
+	STAT_ADD(stats.pack_reads,1);
+	return 0;
+}
+
+int cluster_unpack(inode* node, int lblock)
+{
+	//give the packed cluster holding logical block lblock its blocks back, uncompressed, so
+	//they can be written.  The next file_pack compresses it again if the file still wants it
+	int n=PACK_BLOCKS;
+	int first=lblock-lblock%n;
+	int old[MAX_PACK_BLOCKS],to[MAX_PACK_BLOCKS];
+	int pblock,index,j;
+	char* buf=pack_alloc();
+	if(buf==NULL)
+	{
+		return -ENOMEM;
+	}
+	int retstat=cluster_read(node,first/n,buf);
+	for(j=0;j<n&&retstat==0;j++)
+	{
+		to[j]=find_direct(j>0 ? to[j-1]+1 : alloc_goal(node,first));
+		if(to[j]==-1)
+		{
+			retstat=-ENOSPC;
+			break;
+		}
+		fs_block_write(to[j],buf+j*fs.block_size);
+	}
+	free(buf);
+	if(retstat<0)
+	{
+		while(--j>=0)
+		{
+			free_direct(to[j]);
+		}
+		return retstat;
+	}
+	for(j=0;j<n;j++)
+	{
+		locate_block(node,first+j,0,&pblock,&index);
+		old[j]=get_pointer(node,pblock,index);
+		if(old[j]<-1||set_pointer(node,first+j,pblock,index,to[j])<0)
+		{
+			//an indirect block of the cluster is damaged: it stays packed, with the pointers
+			//changed so far put back
+			while(--j>=0)
+			{
+				locate_block(node,first+j,0,&pblock,&index);
+				set_pointer(node,first+j,pblock,index,old[j]);
+			}
+			for(j=0;j<n;j++)
+			{
+				free_direct(to[j]);
+			}
+			return -EIO;
+		}
+	}
+	if(first<SINGLE_STRT)
+	{
+		//the inode on disk has to point at the new blocks before the old ones are freed
+		write_inode(node->node_num-1,node);
+	}
+	for(j=0;j<n;j++)
+	{
+		if(PACKED_BLOCK(old[j])!=0)
+		{
+			free_direct(PACKED_BLOCK(old[j]));
+		}
+	}
+	pack_note(node,first,first+n);
+	STAT_ADD(stats.unpacks,1);
+	return 0;
+}
+
+/*
+ * Translate logical block lblock of a file into the disk block holding it.
+ * Returns -1 when the block is a hole, and a packed pointer when it is in a
+ * compressed cluster.  With alloc set the data block, and any indirect
+ * blocks on the way to it, are allocated instead; fresh is then set if the
+ * data block is new.  A data block shared with other files is copied first,
+ * and a compressed cluster is unpacked, so the one returned can be written.  Pointers kept in the
+ * inode itself are only changed in node, so the caller has to write the
+ * inode back.
+ */
+int map_block(inode* node, int lblock, int alloc, int* fresh)
+{
+	int pblock,index;
+	if(lblock>=SINGLE_STRT&&lblock<MAX_BLOCKS)
+	{
+		int cached=bmap_get(node,lblock);
+		if(!alloc&&cached!=-2)
+		{
+			return cached;
+		}
+		if(alloc&&cached>=0&&!IS_PACKED(cached)&&block_refs(cached)==1)
+		{
+			//already there and only this file's, nothing to change
+			return cached;
+		}
+	}
+	int retstat=locate_block(node,lblock,alloc,&pblock,&index);
+	if(retstat<0)
+	{
+		return retstat;
+	}
+	int from=get_pointer(node,pblock,index);
+	if(!alloc||from<-1)
+	{
+		return from;
+	}
+	if(IS_PACKED(from))
+	{
+		retstat=cluster_unpack(node,lblock);
+		if(retstat<0)
+		{
+			return retstat;
+		}
+		from=get_pointer(node,pblock,index);
+	}
+	if(from==-1)
+	{
+		from=find_direct(alloc_goal(node,lblock));
+		if(from==-1)
+		{
+			return -ENOSPC;
+		}
+		retstat=set_pointer(node,lblock,pblock,index,from);
+		if(retstat<0)
+		{
+			free_direct(from);
+			return retstat;
+		}
+		*fresh=1;
+		return from;
+	}
+	int refs=block_refs(from);
+	if(refs<0)
+	{
+		return refs;
+	}
+	if(refs>1)
+	{
+		//copy on write
+		int to=cow_block(from,alloc_goal(node,lblock));
+		if(to<0)
+		{
+			return to;
+		}
+		retstat=set_pointer(node,lblock,pblock,index,to);
+		if(retstat<0)
+		{
+			free_direct(to);
+			return retstat;
+		}
+		if(pblock==-1)
+		{
+			//the inode on disk has to point at the copy before the shared block loses a reference
+			write_inode(node->node_num-1,node);
+		}
+		//drop this file's reference to the shared one
+		free_direct(from);
+		from=to;
+	}
+	return from;
+}
+
+int cluster_pack(int slot, inode* node, int c, char* buf)
+{
+	//compress cluster c of a file into fewer blocks, if it is all there, only this file's and
+	//compresses well enough to save a block.  buf is from pack_alloc.  Returns whether it did
+	int n=PACK_BLOCKS;
+	int bs=fs.block_size;
+	int first=c*n;
+	int from[MAX_PACK_BLOCKS],to[MAX_PACK_BLOCKS];
+	int pblock,index,j;
+	if((size_t)(first+n)*bs>node->size)
+	{
+		//runs past the end of the file, which may still grow into it
+		return 0;
+	}
+	for(j=0;j<n;j++)
+	{
+		from[j]=map_block(node,first+j,0,NULL);
+		if(from[j]<0||IS_PACKED(from[j])||block_refs(from[j])!=1)
+		{
+			return 0;
+		}
+	}
+	for(j=0;j<n;j++)
+	{
+		if(fs_block_read(from[j],buf+j*bs)<0)
+		{
+			//damaged, not to be hidden under a new checksum
+			return 0;
+		}
+	}
+	char* packed=buf+n*bs;
+	pack_header head;
+	int len=lz_compress(buf,n*bs,packed+sizeof(head),(n-1)*bs-sizeof(head));
+	if(len<0)
+	{
+		STAT_ADD(stats.pack_raw,1);
+		return 0;
+	}
+	head.length=len;
+	head.raw=n*bs;
+	memcpy(packed,&head,sizeof(head));
+	int m=(sizeof(head)+len+bs-1)/bs;
+	memset(packed+sizeof(head)+len,0,m*bs-sizeof(head)-len);
+	for(j=0;j<m;j++)
+	{
+		to[j]=find_direct(j>0 ? to[j-1]+1 : from[0]);
+		if(to[j]==-1)
+		{
+			while(--j>=0)
+			{
+				free_direct(to[j]);
+			}
+			return 0;
+		}
+		fs_block_write(to[j],packed+j*bs);
+	}
+	if(!(node->flags&SFS_FL_PACKED))
+	{
+		//file_read_buf has to know before there is anything packed to read
+		node->flags|=SFS_FL_PACKED;
+		write_inode(slot,node);
+	}
+	for(j=0;j<n;j++)
+	{
+		locate_block(node,first+j,0,&pblock,&index);
+		if(set_pointer(node,first+j,pblock,index,(j<m) ? (to[j]|PACKED_BIT) : PACKED_BIT)<0)
+		{
+			//an indirect block of the cluster is damaged, it is left as it was
+			while(--j>=0)
+			{
+				locate_block(node,first+j,0,&pblock,&index);
+				set_pointer(node,first+j,pblock,index,from[j]);
+			}
+			for(j=0;j<m;j++)
+			{
+				free_direct(to[j]);
+			}
+			return 0;
+		}
+	}
+	if(first<SINGLE_STRT)
+	{
+		write_inode(slot,node);
+	}
+	for(j=0;j<n;j++)
+	{
+		free_direct(from[j]);
+	}
+	STAT_ADD(stats.packs,1);
+	STAT_ADD(stats.pack_saved,n-m);
+	return 1;
+}
+
+/*
+ * Compress the clusters of the file in slot written since the last call,
+ * when it has SFS_FL_COMPRESS.  Writes always go to uncompressed blocks
+ * (map_block unpacks a compressed cluster first), so this is where the
+ * file gets compressed: when it is flushed, synced or released.  The
+ * compressed blocks are written and pointed at before the ones they
+ * replace are freed, so a crash can leak blocks but not lose data.
+ * Flush comes without the kernel's lock on the file, so writes through
+ * another handle are kept out with file_lock like for file_defrag.
+ */
+void file_pack(int slot)
+{
+	pthread_mutex_lock(&bmap_lock);
+	int lo=bmaps[slot].pack_lo;
+	int hi=bmaps[slot].pack_hi;
+	bmaps[slot].pack_lo=0;
+	bmaps[slot].pack_hi=0;
+	pthread_mutex_unlock(&bmap_lock);
+	inode node;
+	if(hi<=lo||file_seize(slot,&node)<0)
+	{
+		return;
+	}
+	char* buf=(node.flags&SFS_FL_COMPRESS) ? pack_alloc() : NULL;
+	if(buf==NULL)
+	{
+		file_unhold(slot,0);
+		return;
+	}
+	int c,packed=0;
+	for(c=lo;c<hi;c++)
+	{
+		packed+=cluster_pack(slot,&node,c,buf);
+	}
+	free(buf);
+	file_unhold(slot,packed>0);
+	log_msg("\ncompressed %d of clusters %d to %d of inode %d\n",packed,lo,hi-1,node.node_num);
+}
+
+int peek_pointer(inode* node, int lblock, char* block_buff, int* loaded, int* run)
+{
+	//pointer to logical block lblock without allocating anything.  The indirect block is read
+	//into block_buff unless *loaded says it is there already; when it is missing, *run is the
+	//number of blocks from lblock on that are holes because of it, and when it is damaged
+	//the number that come back -EIO
+	*run=1;
+	if(lblock<SINGLE_STRT)
+	{
+		return node->direct[lblock];
+	}
+	int pblock,rel;
+	if(lblock<DOUBLE_STRT)
+	{
+		rel=lblock-SINGLE_STRT;
+		pblock=node->single_indirect[rel/PTRS_PER_BLK];
+	}
+	else
+	{
+		rel=lblock-DOUBLE_STRT;
+		pblock=-1;
+		if(node->double_indirect!=-1)
+		{
+			pblock=read_entry(node->double_indirect,rel/PTRS_PER_BLK);
+		}
+	}
+	if(pblock<-1)
+	{
+		return pblock;
+	}
+	if(pblock==-1)
+	{
+		*run=PTRS_PER_BLK-rel%PTRS_PER_BLK;
+		return -1;
+	}
+	if(pblock!=*loaded)
+	{
+		if(fs_block_read(pblock,block_buff)<0)
+		{
+			//-EIO for the pointers of a damaged indirect block
+			*loaded=-1;
+			*run=PTRS_PER_BLK-rel%PTRS_PER_BLK;
+			return -EIO;
+		}
+		*loaded=pblock;
+	}
+	return ((int*)block_buff)[rel%PTRS_PER_BLK];
+}
+
+/*
+ * SEEK_DATA / SEEK_HOLE straight from the block map.  Ranges behind a
+ * missing indirect block are skipped whole, and each indirect block is
+ * read at most once.  Blocks past the end of the file count as a hole.
+ */
+off_t seek_data_hole(inode* node, off_t offset, int whence)
+{
+	if(offset<0||offset>=(off_t)node->size)
+	{
+		return -ENXIO;
+	}
+	int want_data=(whence==SEEK_DATA);
+	int end=(node->size+fs.block_size-1)/fs.block_size;
+	int lblock=offset/fs.block_size;
+	int loaded=-1; //disk block currently held in block_buff
+	char* block_buff=block_get();
+	while(lblock<end)
+	{
+		int run;
+		//no indirect block means the rest of its range is a hole
+		int present=(peek_pointer(node,lblock,block_buff,&loaded,&run)!=-1);
+		if(present==want_data)
+		{
+			break;
+		}
+		lblock+=run;
+	}
+	block_put(block_buff);
+	if(lblock>=end)
+	{
+		//no more data, only the implicit hole at the end of the file
+		return want_data ? -ENXIO : (off_t)node->size;
+	}
+	off_t found=(off_t)lblock*fs.block_size;
+	return found>offset ? found : offset;
+}
+
+int file_lookup(const char* name, inode* node)
+{
+	//fill node with the inode of the file called name and return its slot, or -ENOENT.
+	//-EIO if it isn't found but one of the inodes that might have been it is damaged
+	int i;
+	int retstat=-ENOENT;
+	unsigned int hash=name_hash(name);
+	char* block_buff=block_get();
+	for(i=0;i<NUM_NODES;i++)
+	{
+		//only inodes whose name hashes the same need to be read
+		if(fs.name_hash[i]==hash)
+		{
+			if(get_inode(i,node,block_buff)<0)
+			{
+				retstat=-EIO;
+				continue;
+			}
+			//files with no links left are only kept around until the kernel forgets them
+			if(node->link_count>0&&strcmp(node->name,name)==0)
+			{
+				block_put(block_buff);
+				return i;
+			}
+		}
+	}
+	block_put(block_buff);
+	return retstat;
+}
+
+int find_file(const char* path, inode* node)
+{
+	//everything lives in the root, so a path is just "/name"
+	return file_lookup(&(path[1]),node);
+}
+
+void stat_root(struct stat* statbuf)
+{
+	//get root info stored in sb
+	superblock sb;
+	char* block_buff=block_get();
+	fs_block_read(0,block_buff);
+	memcpy(&sb,block_buff,sizeof(superblock));
+	block_put(block_buff);
+	memset(statbuf,0,sizeof(struct stat));
+	statbuf->st_ino=FUSE_ROOT_ID;
+	statbuf->st_uid=getuid();
+	statbuf->st_gid=getgid();
+	statbuf->st_mode=S_IFDIR|S_IRWXU|S_IRWXG|S_IRWXO;
+	statbuf->st_nlink=1;
+	statbuf->st_size=0; //maybe whole size of the filesystem
+	statbuf->st_blocks=0; //maybe all blocks in use
+	statbuf->st_atime=sb.access;
+	statbuf->st_mtime=sb.modify;
+	statbuf->st_ctime=sb.change;
+}
+
+void stat_inode(int slot, inode* node, struct stat* statbuf)
+{
+	memset(statbuf,0,sizeof(struct stat));
+	statbuf->st_ino=SLOT_INO(slot);
+	statbuf->st_uid=getuid();
+	statbuf->st_gid=getgid();
+	statbuf->st_blksize=(blksize_t)fs.block_size;
+	statbuf->st_mode=(S_IFREG|S_IRWXU|S_IRWXG|S_IRWXO);
+	statbuf->st_nlink=node->link_count;
+	statbuf->st_size=node->size;
+	//st_blocks counts 512 byte units, but whole disk blocks get used
+	blkcnt_t num_blocks=(node->size+fs.block_size-1)/fs.block_size;
+	statbuf->st_blocks=num_blocks*(fs.block_size/512);
+	statbuf->st_atime=node->access;
+	statbuf->st_mtime=node->modify;
+	statbuf->st_ctime=node->change;
+}
+
+int file_create(const char* name, inode* node)
+{
+	//make an empty file called name, fill node with it and return its slot.  With names_lock
+	//held, so that nobody else takes the name or the slot in the meantime
+	if(strcmp(name,STATS_NAME)==0)
+	{
+		return -EEXIST;
+	}
+	if(strlen(name)>=sizeof(node->name))
+	{
+		//file name too long
+		log_msg("\nfile name too long\n");
+		return -E2BIG;
+	}
+	superblock sb;
+	char* block_buff=block_get();
+	fs_block_read(0,block_buff);
+	memcpy(&sb,block_buff,sizeof(superblock));
+	block_put(block_buff);
+	if(sb.num_files==NUM_NODES)
+	{
+		//fs is full
+		log_msg("\nfs is full\n");
+		return -ENOSPC;
+	}
+	//check to see if there is a file of the same name
+	int found=file_lookup(name,node);
+	if(found!=-ENOENT)
+	{
+		log_msg("\nfile already exists\n");
+		return (found>=0) ? -EEXIST : found;
+	}
+	int i,pos=0;
+	for(i=0;i<NUM_NODES;i++)
+	{
+		//find empty inode
+		if(sb.node_list[i]=='0')
+		{
+			sb.node_list[i]='1';
+			pos=i;
+			break;
+		}
+	}
+	//initialize new inode
+	memset(node,0,sizeof(inode));
+	node->node_num=pos+1;
+	log_msg("\ncreate inode number %d\n",pos+1);
+	node->mode=(S_IFREG|S_IRWXU|S_IRWXG|S_IRWXO);
+	node->link_count=1;
+	node->size=0;
+	node->access=(long)time(NULL);
+	node->modify=node->access;
+	node->change=node->access;
+	for(i=0;i<NUM_DIRECT;i++)
+	{
+		node->direct[i]=-1;
+	}
+	for(i=0;i<NUM_SINGLE;i++)
+	{
+		node->single_indirect[i]=-1;
+	}
+	node->double_indirect=-1;
+	strcpy(node->name,name);
+	node->fh=0;
+	node->flags=sfs_opts.compress ? SFS_FL_COMPRESS : 0;
+	sb.num_files=sb.num_files+1;
+	write_inode(pos,node);
+	fs.name_hash[pos]=name_hash(name);
+	block_buff=block_get();
+	fs_block_read(0,block_buff);
+	memcpy(block_buff,&sb,sizeof(superblock));
+	fs_block_write(0,block_buff);
+	block_put(block_buff);
+	return pos;
+}
+
+void free_pointer(int block)
+{
+	//drop what a block pointer holds, if anything
+	if(IS_PACKED(block))
+	{
+		block=(PACKED_BLOCK(block)!=0) ? PACKED_BLOCK(block) : -1;
+	}
+	if(block!=-1)
+	{
+		free_direct(block);
+	}
+}
+
+void file_free(int slot, inode* node)
+{
+	//give back the inode in slot and every disk block the file holds.  With names_lock held,
+	//other than while mounting and unmounting
+	int i;
+	superblock sb;
+	char* block_buff=block_get();
+	fs_block_read(0,block_buff);
+	memcpy(&sb,block_buff,sizeof(superblock));
+	sb.node_list[slot]='0';
+	fs.name_hash[slot]=0;
+	bmap_forget(slot);
+	pthread_mutex_lock(&dnodes_lock);
+	dnodes[slot].dirty=0;
+	pthread_mutex_unlock(&dnodes_lock);
+	//mark all data disk blocks associated with the file as free
+	//direct blocks
+	for(i=0;i<NUM_DIRECT;i++)
+	{
+		free_pointer(node->direct[i]);
+	}
+	//single indirect blocks
+	indir_data indir; //metadata struct for all indirect blocks
+	int* i_block=block_get(); //indirect block
+	pthread_mutex_lock(&indir_lock);
+	//when the map of indirect blocks is damaged the file's stay taken, for sfs_fsck to give back
+	int indir_ok=(fs_block_read(INDIR_DATA,block_buff)>=0);
+	memcpy(&indir,block_buff,sizeof(indir_data));
+	for(i=0;i<NUM_SINGLE;i++)
+	{
+		int block=node->single_indirect[i];
+		if(block!=-1)
+		{
+			//mark as free in indir block metadata
+			indir.indir_blocks[block-IBLK_STRT]='0';
+			if(fs_block_read(block,i_block)<0)
+			{
+				//damaged, leave its blocks to sfs_fsck rather than free what might be someone else's
+				continue;
+			}
+			//go to that indir block and mark all of it's blocks as free in thier metadata
+			int j;
+			for(j=0;j<PTRS_PER_BLK;j++)
+			{
+				free_pointer(i_block[j]);
+			}
+		}
+
+	}
+	//double indirect block
+	if(node->double_indirect!=-1)
+	{
+		indir.d_indir_block='0';
+		int* d_block=block_get();
+		int damaged=(fs_block_read(DIBLK,d_block)<0);
+		for(i=0;i<PTRS_PER_BLK&&!damaged;i++)
+		{
+			int block=d_block[i];
+			if(block!=-1)
+			{
+				//go to that indirect block
+				indir.indir_blocks[block-IBLK_STRT]='0';
+				if(fs_block_read(block,i_block)<0)
+				{
+					continue;
+				}
+				int j;
+				for(j=0;j<PTRS_PER_BLK;j++)
+				{
+					free_pointer(i_block[j]);
+				}
+			}
+		}
+		block_put(d_block);
+	}
+	block_put(i_block);
+	if(indir_ok&&fs_block_read(INDIR_DATA,block_buff)>=0)
+	{
+		memcpy(block_buff,&indir,sizeof(indir_data));
+		fs_block_write(INDIR_DATA,block_buff);
+	}
+	pthread_mutex_unlock(&indir_lock);
+	sb.num_files=sb.num_files-1;
+	fs_block_read(0,block_buff);
+	memcpy(block_buff,&sb,sizeof(superblock));
+	fs_block_write(0,block_buff);
+	block_put(block_buff);
+}
+
+int file_read(int slot, inode* node, char* buf, size_t size, off_t offset)
+{
+	//read up to size bytes at offset, returns the number read
+	node->access=time(NULL);
+	mark_inode(slot,node,DIRTY_TIMES);
+	//nothing to read at or past the end of the file
+	if(offset<0||offset>=(off_t)node->size)
+	{
+		log_msg("\nread past end of file\n");
+		return 0;
+	}
+	if(offset+size>node->size)
+	{
+		size=node->size-offset;
+	}
+	char* block_buff=block_get();
+	char* pack_buff=NULL; //the last compressed cluster read, decompressed
+	int unpacked=-1;
+	int retstat=0;
+	size_t count=0;
+	block_batch batch;
+	batch_begin(&batch,size,0);
+	while(count<size)
+	{
+		int start_block=(offset+count)/fs.block_size;
+		int start_index=(offset+count)%fs.block_size;
+		size_t len=fs.block_size-start_index;
+		if(len>size-count)
+		{
+			len=size-count;
+		}
+		int from=map_block(node,start_block,0,NULL);
+		log_msg("\nreading from block %d\n",from);
+		if(from<-1)
+		{
+			retstat=from;
+			break;
+		}
+		if(from==-1)
+		{
+			//hole in a sparse file, reads as zeros without touching the disk
+			memset(&(buf[count]),0,len);
+		}
+		else if(IS_PACKED(from))
+		{
+			if(start_block/PACK_BLOCKS!=unpacked)
+			{
+				if(pack_buff==NULL&&(pack_buff=pack_alloc())==NULL)
+				{
+					retstat=-ENOMEM;
+					break;
+				}
+				retstat=cluster_read(node,start_block/PACK_BLOCKS,pack_buff);
+				if(retstat<0)
+				{
+					break;
+				}
+				unpacked=start_block/PACK_BLOCKS;
+			}
+			memcpy(&(buf[count]),&(pack_buff[(start_block%PACK_BLOCKS)*fs.block_size+start_index]),len);
+		}
+		else if(batch.ios!=NULL)
+		{
+			batch_add(&batch,from,&(buf[count]),start_index,len);
+		}
+		else
+		{
+			if(fs_block_read(from,block_buff)<0)
+			{
+				retstat=-EIO;
+				break;
+			}
+			memcpy(&(buf[count]),&(block_buff[start_index]),len);
+		}
+		count+=len;
+	}
+	char* failed=batch_end(&batch);
+	if(failed!=NULL)
+	{
+		//what was read up to the damaged block
+		count=failed-buf;
+		retstat=-EIO;
+	}
+	block_put(block_buff);
+	free(pack_buff);
+	log_msg("\ncount is %d\n",count);
+	return (count>0||retstat==0) ? (int)count : retstat;
+}
+
+int dedup_write(inode* node, int lblock, unsigned long long hash, const char* data)
+{
+	//point logical block lblock at a block already holding data, fingerprinted as hash, instead
+	//of writing it.  Returns 1 if that worked, 0 if the data has to be written after all
+	int found=dedup_find(hash);
+	if(found<DISK_STRT||found>=DISK_END)
+	{
+		return 0;
+	}
+	int pblock,index;
+	if(locate_block(node,lblock,1,&pblock,&index)<0)
+	{
+		return 0;
+	}
+	int old=get_pointer(node,pblock,index);
+	if(old==found||old<-1||IS_PACKED(old))
+	{
+		//written in place, or map_block has the cluster to unpack (or fails)
+		return 0;
+	}
+	int retstat=dedup_ref(found,data);
+	if(retstat<0)
+	{
+		if(retstat==-ENOENT)
+		{
+			STAT_ADD(stats.dedup_stale,1);
+		}
+		return 0;
+	}
+	if(set_pointer(node,lblock,pblock,index,found)<0)
+	{
+		//map_block fails on the damaged indirect block the same way
+		free_direct(found);
+		return 0;
+	}
+	if(old!=-1)
+	{
+		if(pblock==-1)
+		{
+			//the inode on disk has to stop pointing at the old block before it can be reused
+			write_inode(node->node_num-1,node);
+		}
+		free_direct(old);
+	}
+	STAT_ADD(stats.dedup_shared,1);
+	return 1;
+}
+
+int file_write(int slot, inode* node, const char* buf, size_t size, off_t offset)
+{
+	//write size bytes at offset, returns the number written or an error if none were
+	int retstat=0;
+	if(offset<0||offset+(off_t)size>(off_t)MAX_BLOCKS*fs.block_size)
+	{
+		log_msg("\nwrite past the largest file\n");
+		return -EFBIG;
+	}
+	node->modify=time(NULL);
+	char* block_buff=block_get();
+	size_t count=0;
+	block_batch batch;
+	//dedup has to write each block before the next one can be matched against it
+	batch_begin(&batch,(dedup_index==NULL) ? size : 0,1);
+	while(count<size)
+	{
+		int start_block=(offset+count)/fs.block_size;
+		int start_index=(offset+count)%fs.block_size;
+		size_t len=fs.block_size-start_index;
+		if(len>size-count)
+		{
+			len=size-count;
+		}
+		unsigned long long hash=0;
+		int whole=(len==(size_t)fs.block_size&&dedup_index!=NULL);
+		if(whole)
+		{
+			STAT_ADD(stats.dedup_hashed,1);
+			hash=block_hash(&(buf[count]));
+			if(dedup_write(node,start_block,hash,&(buf[count])))
+			{
+				count+=len;
+				continue;
+			}
+		}
+		//find block to write to, allocating only the blocks actually written
+		int fresh=0;
+		int to=map_block(node,start_block,1,&fresh);
+		if(to<0)
+		{
+			log_msg("\ncould not map block %d\n",start_block);
+			retstat=to;
+			break;
+		}
+		log_msg("\nwriting to block %d\n",to);
+		if(batch.ios!=NULL&&len==(size_t)fs.block_size)
+		{
+			batch_add(&batch,to,(char*)&(buf[count]),0,len);
+			count+=len;
+			continue;
+		}
+		if(fresh)
+		{
+			//new block, don't leave whatever was on disk around the write
+			memset(block_buff,0,fs.block_size);
+		}
+		else if(len<fs.block_size)
+		{
+			//partial block, keep the rest of it
+			if(fs_block_read(to,block_buff)<0)
+			{
+				retstat=-EIO;
+				break;
+			}
+		}
+		memcpy(&(block_buff[start_index]),&(buf[count]),len);
+		fs_block_write(to,block_buff);
+		if(whole)
+		{
+			dedup_add(hash,to);
+		}
+		count+=len;
+	}
+	batch_end(&batch);
+	block_put(block_buff);
+	if(offset+count>node->size)
+	{
+		//writing past the end, anything skipped over stays a hole
+		node->size=offset+count;
+	}
+	pack_note(node,offset/fs.block_size,(offset+count+fs.block_size-1)/fs.block_size);
+	mark_inode(slot,node,DIRTY_SIZE);
+	if(count>0||retstat==0)
+	{
+		retstat=count;
+	}
+	return retstat;
+}
+
+void free_bufvec(struct fuse_bufvec* bufv)
+{
+	//free a buffer from file_read_buf, like fuse does once it is sent
+	size_t i;
+	for(i=0;i<bufv->count;i++)
+	{
+		free(bufv->buf[i].mem);
+	}
+	free(bufv);
+}
+
+int file_read_buf(int slot, inode* node, struct fuse_bufvec** bufp, size_t size, off_t offset)
+{
+	//describe up to size bytes at offset as a buffer for fuse, see sfs_read_buf
+	int retstat=0;
+	if(fs.direct||(node->flags&SFS_FL_PACKED)||sfs_opts.verify==VERIFY_FULL)
+	{
+		//with O_DIRECT fuse can't be pointed at pieces of blocks, compressed ones have to be
+		//decompressed and checked ones checked, they go through memory
+		struct fuse_bufvec* bufv=malloc(sizeof(struct fuse_bufvec));
+		*bufv=FUSE_BUFVEC_INIT(size);
+		bufv->buf[0].mem=malloc(size>0 ? size : 1);
+		retstat=file_read(slot,node,bufv->buf[0].mem,size,offset);
+		if(retstat<0)
+		{
+			free_bufvec(bufv);
+			return retstat;
+		}
+		bufv->buf[0].size=retstat;
+		*bufp=bufv;
+		return 0;
+	}
+	node->access=time(NULL);
+	mark_inode(slot,node,DIRTY_TIMES);
+	if(offset<0||offset>=(off_t)node->size)
+	{
+		size=0;
+	}
+	else if(offset+size>node->size)
+	{
+		size=node->size-offset;
+	}
+	//at most one buffer per block touched
+	size_t max_bufs=size/fs.block_size+2;
+	struct fuse_bufvec* bufv=malloc(sizeof(struct fuse_bufvec)+max_bufs*sizeof(struct fuse_buf));
+	if(bufv==NULL)
+	{
+		return -ENOMEM;
+	}
+	*bufv=FUSE_BUFVEC_INIT(0);
+	bufv->count=0;
+	size_t count=0;
+	while(count<size)
+	{
+		int start_block=(offset+count)/fs.block_size;
+		int start_index=(offset+count)%fs.block_size;
+		size_t len=fs.block_size-start_index;
+		if(len>size-count)
+		{
+			len=size-count;
+		}
+		int from=map_block(node,start_block,0,NULL);
+		if(from<-1)
+		{
+			retstat=from;
+			break;
+		}
+		off_t pos=0;
+		int fd=-1;
+		if(from!=-1)
+		{
+			fd=block_fd(from,&pos);
+			pos+=start_index;
+		}
+		struct fuse_buf* last=(bufv->count>0) ? &(bufv->buf[bufv->count-1]) : NULL;
+		if(from==-1&&last!=NULL&&!(last->flags&FUSE_BUF_IS_FD))
+		{
+			//hole right after a hole
+			last->size+=len;
+		}
+		else if(from!=-1&&last!=NULL&&(last->flags&FUSE_BUF_IS_FD)&&last->fd==fd&&last->pos+(off_t)last->size==pos)
+		{
+			//next block on disk right after the last one, on the same member
+			last->size+=len;
+		}
+		else
+		{
+			struct fuse_buf* next=&(bufv->buf[bufv->count++]);
+			next->size=len;
+			next->mem=NULL;
+			next->fd=-1;
+			next->pos=0;
+			next->flags=0;
+			if(from!=-1)
+			{
+				next->flags=FUSE_BUF_IS_FD|FUSE_BUF_FD_SEEK;
+				next->fd=fd;
+				next->pos=pos;
+			}
+		}
+		count+=len;
+	}
+	//now that their sizes are known, back the holes with zeroed memory
+	size_t i;
+	for(i=0;i<bufv->count;i++)
+	{
+		if(!(bufv->buf[i].flags&FUSE_BUF_IS_FD))
+		{
+			bufv->buf[i].mem=calloc(1,bufv->buf[i].size);
+			if(bufv->buf[i].mem==NULL)
+			{
+				retstat=-ENOMEM;
+			}
+		}
+	}
+	if(retstat<0)
+	{
+		free_bufvec(bufv);
+		return retstat;
+	}
+	if(bufv->count==0)
+	{
+		//nothing to read, hand back one empty buffer
+		bufv->count=1;
+	}
+	*bufp=bufv;
+	log_msg("\nread_buf made %d buffers\n",bufv->count);
+	return retstat;
+}
+
+int file_write_buf(int slot, inode* node, struct fuse_bufvec* buf, off_t offset)
+{
+	//write the contents of buf at offset, see sfs_write_buf
+	int retstat=0;
+	size_t size=fuse_buf_size(buf);
+	if(fs.direct||dedup_index!=NULL||sfs_opts.verify==VERIFY_FULL)
+	{
+		//see file_read_buf, and dedup has to see the data to fingerprint it
+		struct fuse_bufvec mem=FUSE_BUFVEC_INIT(size);
+		mem.buf[0].mem=malloc(size>0 ? size : 1);
+		ssize_t got=fuse_buf_copy(&mem,buf,0);
+		retstat=(got<0) ? (int)got : file_write(slot,node,mem.buf[0].mem,got,offset);
+		free(mem.buf[0].mem);
+		return retstat;
+	}
+	if(offset<0||offset+(off_t)size>(off_t)MAX_BLOCKS*fs.block_size)
+	{
+		log_msg("\nwrite past the largest file\n");
+		return -EFBIG;
+	}
+	node->modify=time(NULL);
+	size_t max_bufs=size/fs.block_size+2;
+	struct fuse_bufvec* dst=malloc(sizeof(struct fuse_bufvec)+max_bufs*sizeof(struct fuse_buf));
+	int* fresh_blocks=malloc(max_bufs*sizeof(int)); //logical blocks allocated by this write
+	char* zero_buff=block_get();
+	if(dst==NULL||fresh_blocks==NULL||zero_buff==NULL)
+	{
+		free(dst);
+		free(fresh_blocks);
+		block_put(zero_buff);
+		return -ENOMEM;
+	}
+	memset(zero_buff,0,fs.block_size);
+	*dst=FUSE_BUFVEC_INIT(0);
+	dst->count=0;
+	size_t mapped=0;
+	int num_fresh=0;
+	while(mapped<size)
+	{
+		int start_block=(offset+mapped)/fs.block_size;
+		int start_index=(offset+mapped)%fs.block_size;
+		size_t len=fs.block_size-start_index;
+		if(len>size-mapped)
+		{
+			len=size-mapped;
+		}
+		int fresh=0;
+		int to=map_block(node,start_block,1,&fresh);
+		if(to<0)
+		{
+			log_msg("\ncould not map block %d\n",start_block);
+			retstat=to;
+			break;
+		}
+		if(fresh)
+		{
+			fresh_blocks[num_fresh++]=start_block;
+		}
+		if(fresh&&len<fs.block_size)
+		{
+			//new block only partly written, don't leave whatever was on disk around the write
+			fs_block_write(to,zero_buff);
+		}
+		csum_forget(to);
+		off_t pos;
+		int fd=block_fd(to,&pos);
+		pos+=start_index;
+		struct fuse_buf* last=(dst->count>0) ? &(dst->buf[dst->count-1]) : NULL;
+		if(last!=NULL&&last->fd==fd&&last->pos+(off_t)last->size==pos)
+		{
+			last->size+=len;
+		}
+		else
+		{
+			struct fuse_buf* next=&(dst->buf[dst->count++]);
+			next->size=len;
+			next->flags=FUSE_BUF_IS_FD|FUSE_BUF_FD_SEEK;
+			next->mem=NULL;
+			next->fd=fd;
+			next->pos=pos;
+		}
+		mapped+=len;
+	}
+	ssize_t count=0;
+	if(mapped>0)
+	{
+		count=fuse_buf_copy(dst,buf,0);
+	}
+	free(dst);
+	if(count<0)
+	{
+		retstat=count;
+		count=0;
+	}
+	if((size_t)count<mapped)
+	{
+		//the copy came up short: the new blocks it never got to go back, so none stay past the
+		//end of the file, and the rest of the one it stopped in is zeroed unless it already was
+		off_t written=offset+count;
+		int i;
+		for(i=0;i<num_fresh;i++)
+		{
+			off_t start=(off_t)fresh_blocks[i]*fs.block_size;
+			int to=map_block(node,fresh_blocks[i],0,NULL);
+			if(to<0)
+			{
+				continue;
+			}
+			if(start>=written)
+			{
+				int pblock,index;
+				locate_block(node,fresh_blocks[i],0,&pblock,&index);
+				if(set_pointer(node,fresh_blocks[i],pblock,index,-1)==0)
+				{
+					free_direct(to);
+				}
+			}
+			else if(written<start+fs.block_size&&start>=offset&&start+fs.block_size<=offset+(off_t)size&&
+				fs_block_read(to,zero_buff)>=0)
+			{
+				memset(zero_buff+(written-start),0,start+fs.block_size-written);
+				fs_block_write(to,zero_buff);
+			}
+		}
+	}
+	free(fresh_blocks);
+	block_put(zero_buff);
+	if(offset+count>node->size)
+	{
+		//writing past the end, anything skipped over stays a hole
+		node->size=offset+count;
+	}
+	pack_note(node,offset/fs.block_size,(offset+count+fs.block_size-1)/fs.block_size);
+	mark_inode(slot,node,DIRTY_SIZE);
+	if(count>0||retstat==0)
+	{
+		retstat=count;
+	}
+	return retstat;
+}
+
+int copy_bytes(int dst_slot, inode* dst, int src_slot, inode* src, off_t src_off, size_t len, off_t dst_off)
+{
+	//plain copy through a buffer, for whatever can't be shared
+	char* buf=block_get();
+	size_t done=0;
+	int retstat=0;
+	while(done<len)
+	{
+		size_t chunk=(len-done<(size_t)fs.block_size) ? len-done : (size_t)fs.block_size;
+		retstat=file_read(src_slot,src,buf,chunk,src_off+done);
+		if(retstat<=0)
+		{
+			break;
+		}
+		retstat=file_write(dst_slot,dst,buf,retstat,dst_off+done);
+		if(retstat<=0)
+		{
+			break;
+		}
+		done+=retstat;
+	}
+	block_put(buf);
+	return (done>0||retstat>=0) ? (int)done : retstat;
+}
+
+int share_block(inode* dst, int dlblock, inode* src, int slblock)
+{
+	//point logical block dlblock of dst at the data block behind slblock of src
+	int pblock,index;
+	int from=map_block(src,slblock,0,NULL);
+	if(from<-1)
+	{
+		return from;
+	}
+	if(IS_PACKED(from))
+	{
+		//compressed blocks aren't shared, copied like blocks shared too many times
+		return -EMLINK;
+	}
+	if(from!=-1)
+	{
+		int retstat=ref_direct(from);
+		if(retstat<0)
+		{
+			return retstat;
+		}
+	}
+	int retstat=locate_block(dst,dlblock,from!=-1,&pblock,&index);
+	if(retstat==-1)
+	{
+		//already a hole, and so is the source
+		return 0;
+	}
+	if(retstat<0)
+	{
+		if(from!=-1)
+		{
+			free_direct(from);
+		}
+		return retstat;
+	}
+	int old=get_pointer(dst,pblock,index);
+	if(old<-1)
+	{
+		if(from!=-1)
+		{
+			free_direct(from);
+		}
+		return old;
+	}
+	if(IS_PACKED(old))
+	{
+		//the rest of its cluster stays, uncompressed
+		retstat=cluster_unpack(dst,dlblock);
+		if(retstat<0)
+		{
+			if(from!=-1)
+			{
+				free_direct(from);
+			}
+			return retstat;
+		}
+		old=get_pointer(dst,pblock,index);
+	}
+	retstat=set_pointer(dst,dlblock,pblock,index,from);
+	if(retstat<0)
+	{
+		if(from!=-1)
+		{
+			free_direct(from);
+		}
+		return retstat;
+	}
+	if(old!=-1)
+	{
+		free_direct(old);
+	}
+	return 0;
+}
+
+/*
+ * Copy len bytes at src_off of src into dst at dst_off, copy_file_range
+ * style.  Whole blocks are shared instead of copied when both offsets sit
+ * at the same place within a block, so does the last partial block when
+ * the copy runs to the end of both files.  With strict set (a reflink
+ * clone) nothing gets copied, everything has to line up or it fails with
+ * EINVAL.  Returns the number of bytes copied.  The files can be the same
+ * one, as long as the ranges don't overlap.
+ */
+int file_copy_range(int dst_slot, inode* dst, int src_slot, inode* src, off_t src_off, size_t len, off_t dst_off, int strict)
+{
+	if(src_off<0||dst_off<0)
+	{
+		return -EINVAL;
+	}
+	if(src_off>=(off_t)src->size)
+	{
+		return 0;
+	}
+	if(len==0||src_off+len>src->size)
+	{
+		//to the end of the source
+		len=src->size-src_off;
+	}
+	if(dst_off+(off_t)len>(off_t)MAX_BLOCKS*fs.block_size)
+	{
+		return -EFBIG;
+	}
+	if(src_slot==dst_slot&&src_off<dst_off+(off_t)len&&dst_off<src_off+(off_t)len)
+	{
+		return -EINVAL;
+	}
+	off_t bs=fs.block_size;
+	off_t src_end=src_off+len;
+	//the last partial block can be shared if nothing past the end of the copy could show through
+	int tail_shares=(src_end==(off_t)src->size&&dst_off+(off_t)len>=(off_t)dst->size);
+	if(strict&&(src_off%bs!=0||dst_off%bs!=0||(src_end%bs!=0&&!tail_shares)))
+	{
+		return -EINVAL;
+	}
+	if((src_off-dst_off)%bs!=0)
+	{
+		//no block lines up
+		return copy_bytes(dst_slot,dst,src_slot,src,src_off,len,dst_off);
+	}
+	size_t done=0;
+	int retstat=0;
+	//partial first block
+	if(src_off%bs!=0)
+	{
+		size_t head=bs-src_off%bs;
+		if(head>len)
+		{
+			head=len;
+		}
+		retstat=copy_bytes(dst_slot,dst,src_slot,src,src_off,head,dst_off);
+		if(retstat<(int)head)
+		{
+			return retstat;
+		}
+		done=head;
+	}
+	//whole blocks, and the tail if it can go along
+	off_t share_end=tail_shares ? src_end : src_end-src_end%bs;
+	while(src_off+(off_t)done<share_end)
+	{
+		retstat=share_block(dst,(dst_off+done)/bs,src,(src_off+done)/bs);
+		if(retstat==-EMLINK)
+		{
+			//shared too many times already, this one gets copied
+			size_t chunk=(share_end-(src_off+done)<bs) ? share_end-(src_off+done) : bs;
+			retstat=copy_bytes(dst_slot,dst,src_slot,src,src_off+done,chunk,dst_off+done);
+			if(retstat<(int)chunk)
+			{
+				break;
+			}
+			done+=chunk;
+			continue;
+		}
+		if(retstat<0)
+		{
+			break;
+		}
+		done+=(share_end-(src_off+(off_t)done)<bs) ? share_end-(src_off+done) : bs;
+		if(dst_off+done>dst->size)
+		{
+			dst->size=dst_off+done;
+		}
+	}
+	//partial last block
+	if(retstat>=0&&done<len)
+	{
+		retstat=copy_bytes(dst_slot,dst,src_slot,src,src_off+done,len-done,dst_off+done);
+		if(retstat>0)
+		{
+			done+=retstat;
+		}
+	}
+	dst->modify=time(NULL);
+	write_inode(dst_slot,dst);
+	if(done>0||retstat>=0)
+	{
+		return done;
+	}
+	return retstat;
+}
+
+int file_extents(inode* node, int* blocks, int* first)
+{
+	//count the data blocks of a file, and the runs of consecutive disk blocks they make up.
+	//first is where the first one is, -1 when there are none
+	int end=(node->size+fs.block_size-1)/fs.block_size;
+	int lblock=0,extents=0,last=-2,loaded=-1;
+	char* block_buff=block_get();
+	*blocks=0;
+	*first=-1;
+	while(lblock<end)
+	{
+		int run;
+		int p=peek_pointer(node,lblock,block_buff,&loaded,&run);
+		if(IS_PACKED(p))
+		{
+			//a compressed cluster only has blocks for its first few pointers
+			p=(PACKED_BLOCK(p)!=0) ? PACKED_BLOCK(p) : -1;
+		}
+		if(p>=0)
+		{
+			if(*first==-1)
+			{
+				*first=p;
+			}
+			if(p!=last+1)
+			{
+				extents++;
+			}
+			last=p;
+			(*blocks)++;
+		}
+		lblock+=run;
+	}
+	block_put(block_buff);
+	return extents;
+}
+
+/*
+ * Move the data blocks of a file into one run of free blocks, the first
+ * run big enough.  With compact set a file already in one piece is moved
+ * too when there is room for it lower down, which packs the used blocks
+ * at the start of the data region and leaves the free ones in one run at
+ * the end.  Blocks shared with other files, and compressed ones, stay
+ * where they are.  Each
+ * block is copied and its new pointer written before the old one is
+ * freed, so a crash can leak a block but never lose one.  Reads and
+ * writes of the file wait on file_lock meanwhile, and node is read again
+ * once it is held.  Returns the number of blocks moved.
+ */
+int file_defrag(int slot, inode* node, int compact)
+{
+	int blocks,first,len,free_blocks,free_extents;
+	if(file_seize(slot,node)<0)
+	{
+		return 0;
+	}
+	int extents=file_extents(node,&blocks,&first);
+	if(blocks==0||(extents<=1&&!compact))
+	{
+		file_unhold(slot,0);
+		return 0;
+	}
+	int to=free_run(blocks,&len,&free_blocks,&free_extents);
+	if(len<blocks||(extents<=1&&to>first))
+	{
+		//no room for it in one piece, or already where compacting would put it
+		file_unhold(slot,0);
+		return 0;
+	}
+	int end=(node->size+fs.block_size-1)/fs.block_size;
+	int lblock=0,moved=0,loaded=-1;
+	char* block_buff=block_get();
+	char* data=block_get();
+	while(lblock<end)
+	{
+		int run;
+		int from=peek_pointer(node,lblock,block_buff,&loaded,&run);
+		if(from>=0&&!IS_PACKED(from)&&block_refs(from)==1)
+		{
+			int pblock,index;
+			if(claim_direct(to)<0)
+			{
+				//taken by a write since free_run looked, what was moved stays moved
+				log_msg("\nblock %d of the run taken while moving inode %d\n",to,node->node_num);
+				break;
+			}
+			locate_block(node,lblock,0,&pblock,&index);
+			int moving=(fs_block_read(from,data)>=0);
+			if(moving)
+			{
+				fs_block_write(to,data);
+				csum_copy(from,to);
+				moving=(set_pointer(node,lblock,pblock,index,to)==0);
+			}
+			if(!moving)
+			{
+				//the block or its indirect block is damaged, it stays where it is
+				log_msg("\nlogical block %d of inode %d is damaged, not moving it\n",lblock,node->node_num);
+				free_direct(to);
+				break;
+			}
+			if(pblock==-1)
+			{
+				write_inode(slot,node);
+			}
+			else if(pblock==loaded)
+			{
+				((int*)block_buff)[index]=to;
+			}
+			free_direct(from);
+			to++;
+			moved++;
+		}
+		lblock+=run;
+	}
+	block_put(data);
+	block_put(block_buff);
+	file_unhold(slot,moved>0);
+	log_msg("\nmoved %d of %d blocks of inode %d, which were in %d pieces\n",moved,blocks,node->node_num,extents);
+	return moved;
+}
+
+void frag_report(inode* node, struct sfs_frag_report* report)
+{
+	int blocks,first,len,free_blocks,free_extents;
+	report->file_extents=file_extents(node,&blocks,&first);
+	report->file_blocks=blocks;
+	free_run(INT_MAX,&len,&free_blocks,&free_extents);
+	report->free_blocks=free_blocks;
+	report->free_extents=free_extents;
+	report->largest_free=len;
+}
+
+int ioctl_hold(int slot, inode* node, unsigned int cmd, unsigned long seen)
+{
+	//file_hold for an ioctl on the file in slot, but SFS_IOC_DEFRAG locks each file it
+	//moves itself
+	return (cmd==SFS_IOC_DEFRAG) ? slot : file_hold(slot,node,seen);
+}
+
+void ioctl_unhold(int slot, unsigned int cmd)
+{
+	if(cmd!=SFS_IOC_DEFRAG)
+	{
+		file_unhold(slot,0);
+	}
+}
+
+int file_ioctl(int slot, inode* node, unsigned int cmd, void* data)
+{
+	//run one of the commands in sfs_ioctl.h, data is its _IOC_SIZE(cmd) byte argument
+	if(cmd==SFS_IOC_SEEK_DATA||cmd==SFS_IOC_SEEK_HOLE)
+	{
+		off_t* offset=(off_t*)data;
+		off_t found=seek_data_hole(node,*offset,cmd==SFS_IOC_SEEK_DATA ? SEEK_DATA : SEEK_HOLE);
+		if(found<0)
+		{
+			return found;
+		}
+		*offset=found;
+		return 0;
+	}
+	if(cmd==SFS_IOC_CLONE_RANGE||cmd==SFS_IOC_COPY_RANGE)
+	{
+		struct sfs_clone_range* range=(struct sfs_clone_range*)data;
+		range->src_name[sizeof(range->src_name)-1]='\0';
+		//a name or a path from the root of the mount both do
+		const char* name=(range->src_name[0]=='/') ? &(range->src_name[1]) : range->src_name;
+		inode src;
+		unsigned long seen=file_seen();
+		int src_slot=file_lookup(name,&src);
+		if(src_slot<0)
+		{
+			return src_slot;
+		}
+		//the same file has to go through the same inode, which the caller holds already
+		inode* from=(src_slot==slot) ? node : &src;
+		if(src_slot!=slot&&(src_slot=file_hold(src_slot,&src,seen))<0)
+		{
+			return src_slot;
+		}
+		int retstat=file_copy_range(slot,node,src_slot,from,range->src_offset,range->src_length,range->dest_offset,cmd==SFS_IOC_CLONE_RANGE);
+		if(src_slot!=slot)
+		{
+			file_unhold(src_slot,0);
+		}
+		if(retstat<0)
+		{
+			return retstat;
+		}
+		range->src_length=retstat;
+		return 0;
+	}
+	if(cmd==SFS_IOC_FRAG_REPORT||cmd==SFS_IOC_DEFRAG)
+	{
+		struct sfs_frag_report* report=(struct sfs_frag_report*)data;
+		if(cmd==SFS_IOC_DEFRAG)
+		{
+			int compact=((report->flags&SFS_DEFRAG_COMPACT)!=0);
+			report->moved=0;
+			if(report->flags&SFS_DEFRAG_ALL)
+			{
+				int i;
+				inode other;
+				for(i=0;i<NUM_NODES;i++)
+				{
+					//the file the ioctl is on has to go through its own inode, free slots are
+					//skipped by file_defrag
+					report->moved+=file_defrag(i,(i==slot) ? node : &other,compact);
+				}
+			}
+			else
+			{
+				report->moved=file_defrag(slot,node,compact);
+			}
+		}
+		frag_report(node,report);
+		return 0;
+	}
+	if(cmd==SFS_IOC_GET_FLAGS)
+	{
+		*(int32_t*)data=node->flags;
+		return 0;
+	}
+	if(cmd==SFS_IOC_SET_FLAGS)
+	{
+		int was=node->flags;
+		node->flags=(node->flags&~SFS_FL_COMPRESS)|(*(int32_t*)data&SFS_FL_COMPRESS);
+		if(node->flags!=was)
+		{
+			write_inode(slot,node);
+			//what is there already gets compressed along with what is written next
+			pack_note(node,0,(node->size+fs.block_size-1)/fs.block_size);
+		}
+		return 0;
+	}
+	log_msg("\nunknown ioctl\n");
+	return -ENOTTY;
+}
+
+void check_fs(superblock* sb)
+{
+	//not unmounted cleanly: rebuild the indexes from what is actually on disk, and
+	//clean up after whatever was going on at the time
+	int i,j;
+	inode node;
+	char* block_buff=block_get();
+	log_msg("\nnot unmounted cleanly, checking\n");
+	memset(fs.name_hash,0,sizeof(fs.name_hash));
+	sb->num_files=0;
+	for(i=0;i<NUM_NODES;i++)
+	{
+		if(sb->node_list[i]=='1')
+		{
+			sb->num_files++;
+			fs_block_read(i+NODE_STRT,block_buff);
+			memcpy(&node,block_buff,sizeof(inode));
+			fs.name_hash[i]=name_hash(node.name);
+		}
+	}
+	for(i=0;i<NUM_MDATA;i++)
+	{
+		fs.mdata_used[i]=0;
+		fs.mdata_shared[i]=0;
+		fs_block_read(i+MDATA_STRT,block_buff);
+		for(j=0;j<fs.block_size;j++)
+		{
+			int refs=MAP_REFS(block_buff[j]);
+			if(refs>0)
+			{
+				fs.mdata_used[i]++;
+			}
+			if(refs>1)
+			{
+				fs.mdata_shared[i]=1;
+			}
+		}
+	}
+	block_put(block_buff);
+	//the counts in sb are used by file_free, so it has to be on disk first
+	block_buff=block_get();
+	memset(block_buff,0,fs.block_size);
+	memcpy(block_buff,sb,sizeof(superblock));
+	fs_block_write(0,block_buff);
+	block_put(block_buff);
+	//files unlinked while the kernel still held them are only freed on forget, so anything
+	//left over from the last mount has no users anymore
+	for(i=0;i<NUM_NODES;i++)
+	{
+		if(read_inode(i,&node)>=0&&node.link_count==0)
+		{
+			log_msg("\nfreeing unlinked inode number %d\n",node.node_num);
+			file_free(i,&node);
+		}
+	}
+	//file_free changed sb on disk
+	block_buff=block_get();
+	fs_block_read(0,block_buff);
+	memcpy(sb,block_buff,sizeof(superblock));
+	block_put(block_buff);
+}
+
+void direct_io_start()
+{
+	//switch the disk files over to O_DIRECT, if the filesystems they are on and the block size
+	//let us.  It is all or nothing, read_buf and write_buf only need to know about fs.direct
+	int flags[MAX_MEMBERS];
+	int i;
+	for(i=0;i<fs.members;i++)
+	{
+		flags[i]=fcntl(fs.fds[i],F_GETFL);
+		if(fcntl(fs.fds[i],F_SETFL,flags[i]|O_DIRECT)<0)
+		{
+			log_msg("\nno O_DIRECT for disk file %d, going through the page cache\n",i);
+			break;
+		}
+		//blocks have to be whole sectors of the device under it, which only shows on the first read
+		char* block_buff=block_get();
+		int failed=(pread(fs.fds[i],block_buff,fs.block_size,0)<0) ? errno : 0;
+		block_put(block_buff);
+		if(failed)
+		{
+			log_msg("\n%d byte blocks don't work with O_DIRECT on disk file %d (%s), going through the page cache\n",fs.block_size,i,strerror(failed));
+			fcntl(fs.fds[i],F_SETFL,flags[i]);
+			break;
+		}
+	}
+	if(i<fs.members)
+	{
+		while(--i>=0)
+		{
+			fcntl(fs.fds[i],F_SETFL,flags[i]);
+		}
+		return;
+	}
+	fs.direct=1;
+	log_msg("\ndisk file opened with O_DIRECT\n");
+}
+
+void open_members(const char* diskfiles)
+{
+	//the disk file argument is a comma separated list of the members of a striped volume,
+	//usually just the one
+	char names[PATH_MAX];
+	char* save;
+	char* name;
+	strncpy(names,diskfiles,sizeof(names)-1);
+	names[sizeof(names)-1]='\0';
+	fs.members=0;
+	for(name=strtok_r(names,",",&save);name!=NULL;name=strtok_r(NULL,",",&save))
+	{
+		if(fs.members==MAX_MEMBERS)
+		{
+			log_msg("\nmore than %d disk files, exiting failure\n",MAX_MEMBERS);
+			exit(EXIT_FAILURE);
+		}
+		fs.fds[fs.members]=open(name,O_CREAT|O_RDWR,S_IRUSR|S_IWUSR);
+		if(fs.fds[fs.members]<0)
+		{
+			log_msg("\ncould not open disk file %s, exiting failure\n",name);
+			exit(EXIT_FAILURE);
+		}
+		fs.members++;
+	}
+	if(fs.members==0)
+	{
+		log_msg("\nno disk file, exiting failure\n");
+		exit(EXIT_FAILURE);
+	}
+	fs.fd=fs.fds[0];
+}
+
+void dedup_load(superblock* sb)
+{
+	//set up the dedup index, from what the last unmount saved if it was clean.  The saved
+	//blocks are freed whenever there are any, also when sfs_fsck -y cleared the clean flag
+	//since; the mount writes the superblock without them, so a crash from here on just
+	//loses the index
+	if(sfs_opts.dedup)
+	{
+		unsigned int slots=1;
+		while(slots<(unsigned int)(DISK_END-DISK_STRT)&&slots<DEDUP_MAX_SLOTS)
+		{
+			slots<<=1;
+		}
+		dedup_index=calloc(slots,sizeof(dedup_entry));
+		dedup_mask=slots-1;
+		if(dedup_index==NULL)
+		{
+			log_msg("\nno memory for the dedup index, not deduplicating\n");
+		}
+	}
+	if(sb->dedup_entries<=0)
+	{
+		sb->dedup_start=0;
+		sb->dedup_entries=0;
+		return;
+	}
+	int load=sb->clean&&dedup_index!=NULL;
+	int blocks=(sb->dedup_entries+DEDUP_PER_BLK-1)/DEDUP_PER_BLK;
+	int i,j,left=sb->dedup_entries;
+	dedup_entry* saved=block_get();
+	for(i=0;i<blocks;i++)
+	{
+		int block=sb->dedup_start+i;
+		if(block<DISK_STRT||block>=DISK_END)
+		{
+			break;
+		}
+		if(load&&fs_block_read(block,saved)>=0)
+		{
+			for(j=0;j<DEDUP_PER_BLK&&j<left;j++)
+			{
+				if(saved[j].block>=DISK_STRT&&saved[j].block<DISK_END)
+				{
+					dedup_add(saved[j].hash,saved[j].block);
+				}
+			}
+		}
+		left-=DEDUP_PER_BLK;
+		free_direct(block);
+	}
+	block_put(saved);
+	log_msg("\n%d dedup index entries %s\n",sb->dedup_entries,load ? "loaded" : "dropped");
+	sb->dedup_start=0;
+	sb->dedup_entries=0;
+}
+
+void dedup_save(superblock* sb)
+{
+	//write the dedup index to the first run of free blocks that holds it, or as much of it as
+	//fits in the longest one
+	if(dedup_index==NULL)
+	{
+		return;
+	}
+	unsigned int i,n=0;
+	for(i=0;i<=dedup_mask;i++)
+	{
+		if(dedup_index[i].block!=0)
+		{
+			dedup_index[n++]=dedup_index[i];
+		}
+	}
+	int want=(n+DEDUP_PER_BLK-1)/DEDUP_PER_BLK;
+	int len,free_blocks,free_extents;
+	int start=(want>0) ? free_run(want,&len,&free_blocks,&free_extents) : -1;
+	if(start!=-1)
+	{
+		if(len>want)
+		{
+			len=want;
+		}
+		if(n>(unsigned int)len*DEDUP_PER_BLK)
+		{
+			n=len*DEDUP_PER_BLK;
+		}
+		dedup_entry* block_buff=block_get();
+		int b;
+		for(b=0;b<len;b++)
+		{
+			memset(block_buff,0,fs.block_size);
+			int count=(n-b*DEDUP_PER_BLK<(unsigned int)DEDUP_PER_BLK) ? n-b*DEDUP_PER_BLK : DEDUP_PER_BLK;
+			memcpy(block_buff,&(dedup_index[b*DEDUP_PER_BLK]),count*sizeof(dedup_entry));
+			if(claim_direct(start+b)<0)
+			{
+				//the blocks claimed so far hold the start of the index
+				n=b*DEDUP_PER_BLK;
+				break;
+			}
+			fs_block_write(start+b,block_buff);
+		}
+		block_put(block_buff);
+		sb->dedup_start=(n>0) ? start : 0;
+		sb->dedup_entries=n;
+		log_msg("\n%u dedup index entries saved from block %d on\n",n,start);
+	}
+	free(dedup_index);
+	dedup_index=NULL;
+}
+
+void csum_load(superblock* sb)
+{
+	//read the checksums back, if the last unmount wrote them.  After a crash, blocks may have
+	//been written without their checksums getting out: the ones before DISK_STRT are few
+	//enough to checksum again from what they hold, data blocks go without until written
+	int i;
+	void* csums;
+	fs.csums=NULL;
+	memset(fs.csum_dirty,0,sizeof(fs.csum_dirty));
+	if(posix_memalign(&csums,SCRATCH_ALIGN,(size_t)NUM_CSUM*fs.block_size)!=0)
+	{
+		log_msg("\nno memory for the checksums, not keeping any\n");
+		return;
+	}
+	if(sb->clean)
+	{
+		for(i=0;i<NUM_CSUM;i++)
+		{
+			fs_block_read(CSUM_STRT+i,(char*)csums+(size_t)i*fs.block_size);
+		}
+		fs.csums=csums;
+		log_msg("\nchecksums loaded\n");
+		return;
+	}
+	memset(csums,0,(size_t)NUM_CSUM*fs.block_size);
+	memset(fs.csum_dirty,1,sizeof(fs.csum_dirty));
+	fs.csums=csums;
+	char* block_buff=block_get();
+	for(i=1;i<CSUM_STRT;i++)
+	{
+		fs_block_read(i,block_buff);
+		csum_set(i,block_buff);
+	}
+	block_put(block_buff);
+	log_msg("\nchecksums of the metadata taken again, data blocks have none until written\n");
+}
+
+void csum_save()
+{
+	//write back the checksum blocks that changed, before the superblock says they can be trusted
+	int i;
+	if(fs.csums==NULL)
+	{
+		return;
+	}
+	for(i=0;i<NUM_CSUM;i++)
+	{
+		if(fs.csum_dirty[i])
+		{
+			fs_block_write(CSUM_STRT+i,(char*)fs.csums+(size_t)i*fs.block_size);
+			fs.csum_dirty[i]=0;
+		}
+	}
+}
+
+void trace_begin()
+{
+	//start recording every call in the file given with -o trace
+	trace_fd=open(sfs_opts.trace,O_CREAT|O_TRUNC|O_WRONLY,S_IRUSR|S_IWUSR);
+	trace_buf=malloc(TRACE_BUF);
+	if(trace_fd<0||trace_buf==NULL)
+	{
+		log_msg("\ncould not open trace file %s, not tracing\n",sfs_opts.trace);
+		if(trace_fd>=0)
+		{
+			close(trace_fd);
+			trace_fd=-1;
+		}
+		free(trace_buf);
+		trace_buf=NULL;
+		return;
+	}
+	struct sfs_trace_header head;
+	memset(&head,0,sizeof(head));
+	head.magic=TRACE_MAGIC;
+	head.version=TRACE_VER;
+	head.lowlevel=sfs_opts.lowlevel;
+	head.block_size=fs.block_size;
+	head.started=time(NULL);
+	memcpy(trace_buf,&head,sizeof(head));
+	trace_len=sizeof(head);
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC,&now);
+	trace_start=ts_ns(&now);
+	log_msg("\ntracing to %s\n",sfs_opts.trace);
+}
+
+void trace_end()
+{
+	pthread_mutex_lock(&trace_lock);
+	if(trace_fd>=0)
+	{
+		trace_flush();
+	}
+	if(trace_fd>=0)
+	{
+		close(trace_fd);
+		trace_fd=-1;
+	}
+	free(trace_buf);
+	trace_buf=NULL;
+	pthread_mutex_unlock(&trace_lock);
+}
+
+double hist_percentile(op_stats* o, double p)
+{
+	//microseconds under which a fraction p of the calls in o finished, to within a bucket
+	unsigned long total=0;
+	int b;
+	for(b=0;b<HIST_BUCKETS;b++)
+	{
+		total+=o->hist[b];
+	}
+	if(total==0)
+	{
+		return 0;
+	}
+	unsigned long want=(unsigned long)(p*total);
+	unsigned long seen=0;
+	for(b=0;b<HIST_BUCKETS-1;b++)
+	{
+		seen+=o->hist[b];
+		if(seen>want)
+		{
+			break;
+		}
+	}
+	return (hist_floor(b+1)-1)/1000.0;
+}
+
+char* stats_text()
+{
+	//what STATS_NAME reads as, made when it is opened
+	size_t size=(NUM_OPS+10)*160;
+	char* text=malloc(size);
+	if(text==NULL)
+	{
+		return NULL;
+	}
+	fs_stats snap;
+	memcpy(&snap,&stats,sizeof(fs_stats));
+	int len=snprintf(text,size,"%-10s %10s %8s %9s %9s %9s %9s %9s %9s %8s %8s\n",
+		"op","calls","errors","total ms","avg us","p50 us","p90 us","p99 us","max us","rd/call","wr/call");
+	unsigned long reads=0;
+	unsigned long writes=0;
+	int i;
+	for(i=0;i<NUM_OPS;i++)
+	{
+		op_stats* o=&(snap.ops[i]);
+		unsigned long calls=(o->calls>0) ? o->calls : 1;
+		len+=snprintf(text+len,size-len,"%-10s %10lu %8lu %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f %8.2f %8.2f\n",
+			op_names[i],o->calls,o->errors,o->ns/1e6,o->ns/1e3/calls,hist_percentile(o,0.5),hist_percentile(o,0.9),
+			hist_percentile(o,0.99),o->max_ns/1e3,(double)o->reads/calls,(double)o->writes/calls);
+		reads+=o->reads;
+		writes+=o->writes;
+	}
+	unsigned long scans=(snap.alloc_scans>0) ? snap.alloc_scans : 1;
+	unsigned long bmaps=snap.bmap_hits+snap.bmap_misses;
+	unsigned long dnodes=snap.dnode_hits+snap.dnode_misses;
+	len+=snprintf(text+len,size-len,"\nblocks read %lu, written %lu\n",reads,writes);
+	len+=snprintf(text+len,size-len,"allocator: %lu scans, %.2f groups and %.1f map entries per scan, at most %llu\n",
+		snap.alloc_scans,(double)snap.alloc_groups/scans,(double)snap.alloc_entries/scans,snap.alloc_max);
+	len+=snprintf(text+len,size-len,"block map cache: %lu hits, %lu misses, %.1f%% hit\n",
+		snap.bmap_hits,snap.bmap_misses,(bmaps>0) ? 100.0*snap.bmap_hits/bmaps : 0.0);
+	len+=snprintf(text+len,size-len,"held back inodes: %lu hits, %lu misses, %.1f%% hit\n",
+		snap.dnode_hits,snap.dnode_misses,(dnodes>0) ? 100.0*snap.dnode_hits/dnodes : 0.0);
+	len+=snprintf(text+len,size-len,"compression: %lu clusters saving %lu blocks, %lu left alone, %lu decompressed, %lu unpacked\n",
+		snap.packs,snap.pack_saved,snap.pack_raw,snap.pack_reads,snap.unpacks);
+	len+=snprintf(text+len,size-len,"dedup: %lu whole blocks written, %lu shared with a block holding the same data, %lu stale index entries\n",
+		snap.dedup_hashed,snap.dedup_shared,snap.dedup_stale);
+	len+=snprintf(text+len,size-len,"checksums: %s verified on read, %lu mismatches, computed with %s\n",
+		verify_names[sfs_opts.verify],snap.csum_errors,csum_name);
+	return text;
+}
+
+void stats_reset()
+{
+	//counts kept by calls still running may straddle the reset, close enough
+	memset(&stats,0,sizeof(fs_stats));
+	log_msg("\nstatistics reset\n");
+}
+
+void stat_stats(struct stat* statbuf)
+{
+	//STATS_NAME looks empty, it is opened with direct_io so it gets read all the same
+	memset(statbuf,0,sizeof(struct stat));
+	statbuf->st_ino=STATS_INO;
+	statbuf->st_uid=getuid();
+	statbuf->st_gid=getgid();
+	statbuf->st_mode=S_IFREG|S_IRUSR|S_IRGRP|S_IROTH;
+	statbuf->st_nlink=1;
+	statbuf->st_atime=time(NULL);
+	statbuf->st_mtime=statbuf->st_atime;
+	statbuf->st_ctime=statbuf->st_atime;
+}
+
+int stats_open(struct fuse_file_info* fi)
+{
+	if((fi->flags&O_ACCMODE)!=O_RDONLY)
+	{
+		return -EACCES;
+	}
+	char* text=stats_text();
+	if(text==NULL)
+	{
+		return -ENOMEM;
+	}
+	fi->fh=(uintptr_t)text;
+	fi->direct_io=1;
+	return 0;
+}
+
+size_t stats_part(struct fuse_file_info* fi, size_t size, off_t offset, const char** part)
+{
+	//up to size bytes at offset of the text made when STATS_NAME was opened
+	const char* text=(const char*)(uintptr_t)fi->fh;
+	size_t len=strlen(text);
+	*part=text;
+	if(offset<0||offset>=(off_t)len)
+	{
+		return 0;
+	}
+	*part=text+offset;
+	return (size<len-offset) ? size : len-offset;
+}
+
+void stats_release(struct fuse_file_info* fi)
+{
+	free((char*)(uintptr_t)fi->fh);
+}
+
+/**
+ * Initialize filesystem
+ *
+ * The return value will passed in the private_data field of
+ * fuse_context to all file operations and as a parameter to the
+ * destroy() method.
+ *
+ * Introduced in version 2.3
+ * Changed in version 2.6
+ */
+void *sfs_init(struct fuse_conn_info *conn)
+{
+    //fprintf(stderr, "in sfs_init\n");
+    log_msg("\nsfs_init()\n");
+    
+    open_members(sfs_data->diskfile);
+    superblock sblock;
+    //the superblock sits at the very start of the disk file, so it can be read before the block size is known
+    int check=pread(fs.fd,&sblock,sizeof(superblock),0);
+    if(check<=0)
+    {
+	    //fs is not inited, so init it
+	    //only the superblock gets written, the metadata blocks read as all free until first used
+	    int i;
+	    log_msg("\nfs file not inited\n");
+	    fs.block_size=sfs_opts.block_size;
+	    fs.stripe_width=sfs_opts.stripe_width;
+	    if(fs.stripe_width<1)
+	    {
+		    fs.stripe_width=DEF_STRIPE_WIDTH;
+	    }
+	    memset(&sblock,0,sizeof(superblock));
+	    sblock.verify=VER;
+	    sblock.num_files=0;
+	    sblock.access=(long)time(NULL);
+	    sblock.change=sblock.access;
+	    sblock.modify=sblock.access;
+	    sblock.mode=S_IRWXU;
+	    sblock.block_size=fs.block_size;
+	    sblock.stripe_members=fs.members;
+	    sblock.stripe_width=fs.stripe_width;
+	    sblock.clean=1; //nothing to check, all the summaries are zero
+	    for(i=0;i<NUM_NODES;i++)
+	    {
+		    sblock.node_list[i]='0';
+	    }
+
+	    log_msg("\nfinished initing fs with %d byte blocks over %d disk files\n",fs.block_size,fs.members);
+    }
+    else
+    {
+    	//see if it is actually our fs
+	if(check<(int)sizeof(superblock)||sblock.verify!=VER)
+	{
+		log_msg("\nnot our fs, exiting failure\n");
+		exit(EXIT_FAILURE);
+	}
+	if(sblock.block_size<MIN_BLOCK_SIZE||sblock.block_size>MAX_BLOCK_SIZE||(sblock.block_size&(sblock.block_size-1))!=0)
+	{
+		log_msg("\nbad block size %d, exiting failure\n",sblock.block_size);
+		exit(EXIT_FAILURE);
+	}
+	if(sblock.stripe_members!=fs.members||sblock.stripe_width<1)
+	{
+		log_msg("\nfs is striped over %d disk files, %d given, exiting failure\n",sblock.stripe_members,fs.members);
+		exit(EXIT_FAILURE);
+	}
+	//otherwise it's fine
+	fs.block_size=sblock.block_size;
+	fs.stripe_width=sblock.stripe_width;
+	log_msg("\nsuccesfully opened fs file with %d byte blocks\n",fs.block_size);
+    }
+    fs.direct=0;
+    if(sfs_opts.o_direct)
+    {
+	    direct_io_start();
+    }
+    if(sfs_opts.trace!=NULL)
+    {
+	    trace_begin();
+    }
+    pool_start();
+    memset(dnodes,0,sizeof(dnodes));
+    int i;
+    for(i=0;i<NUM_MDATA;i++)
+    {
+	    pthread_mutex_init(&(group_lock[i]),NULL);
+    }
+    for(i=0;i<NUM_NODES;i++)
+    {
+	    pthread_rwlock_init(&(file_lock[i]),NULL);
+    }
+    csum_name=crc32c_init();
+    log_msg("\nchecksums computed with %s\n",csum_name);
+    csum_load(&sblock);
+    if(sblock.clean)
+    {
+	    //unmounted cleanly, the indexes can be taken straight from the summaries
+	    memcpy(fs.mdata_used,sblock.mdata_used,sizeof(fs.mdata_used));
+	    memcpy(fs.mdata_shared,sblock.mdata_shared,sizeof(fs.mdata_shared));
+	    memcpy(fs.name_hash,sblock.name_hash,sizeof(fs.name_hash));
+	    log_msg("\nclean, indexes loaded from the superblock\n");
+    }
+    else
+    {
+	    check_fs(&sblock);
+    }
+    dedup_load(&sblock);
+    //nothing has been handed to the kernel yet
+    memset(nlookup,0,sizeof(nlookup));
+    memset(kview,0,sizeof(kview));
+    //until sfs_destroy writes the summaries back, they can't be trusted.  That has to be on
+    //disk before anything changes them, or a crash could leave them looking clean and stale
+    sblock.clean=0;
+    char* block_buff=block_get();
+    memset(block_buff,0,fs.block_size);
+    memcpy(block_buff,&sblock,sizeof(superblock));
+    fs_block_write(0,block_buff);
+    block_put(block_buff);
+    if(sync_members()<0)
+    {
+	    log_msg("\ncould not sync the cleared clean flag, exiting failure\n");
+	    exit(EXIT_FAILURE);
+    }
+    
+    //file data can be spliced between /dev/fuse and the disk file, see sfs_read_buf and sfs_write_buf
+    conn->want|=conn->capable&(FUSE_CAP_SPLICE_READ|FUSE_CAP_SPLICE_WRITE|FUSE_CAP_SPLICE_MOVE);
+
+    if(!sfs_opts.lowlevel)
+    {
+	    //log.c finds the log file through the fuse context, which the low-level api doesn't have
+	    log_conn(conn);
+    }
+    //log_fuse_context(fuse_get_context());
+
+    return sfs_data;
+}
+
+/**
+ * Clean up filesystem
+ *
+ * Called on filesystem exit.
+ *
+ * Introduced in version 2.3
+ */
+void sfs_destroy(void *userdata)
+{
+	//everything but held back inodes gets written as it happens, only those and the summaries are left
+    log_msg("\nsfs_destroy(userdata=0x%08x)\n", userdata);
+    int i;
+    inode node;
+    for(i=0;i<NUM_NODES;i++)
+    {
+	    flush_inode(i,DIRTY_TIMES);
+    }
+    for(i=0;i<NUM_NODES;i++)
+    {
+	    //unlinked files the kernel never got to forget
+	    if(read_inode(i,&node)>=0&&node.link_count==0)
+	    {
+		    file_free(i,&node);
+	    }
+    }
+    superblock sb;
+    char* block_buff=block_get();
+    fs_block_read(0,block_buff);
+    memcpy(&sb,block_buff,sizeof(superblock));
+    //takes blocks, so before the summaries
+    dedup_save(&sb);
+    csum_save();
+    memcpy(sb.mdata_used,fs.mdata_used,sizeof(sb.mdata_used));
+    memcpy(sb.mdata_shared,fs.mdata_shared,sizeof(sb.mdata_shared));
+    memcpy(sb.name_hash,fs.name_hash,sizeof(sb.name_hash));
+    //the checksums, the dedup index and everything else have to be on disk before the
+    //superblock says they can be trusted, or a crash in between leaves it vouching for old ones
+    if(sync_members()==0)
+    {
+	    sb.clean=1;
+    }
+    else
+    {
+	    log_msg("\ncould not sync before marking the fs clean, the next mount checks it\n");
+    }
+    memcpy(block_buff,&sb,sizeof(superblock));
+    fs_block_write(0,block_buff);
+    block_put(block_buff);
+    trace_end();
+    sync_members();
+    pool_stop();
+    for(i=0;i<fs.members;i++)
+    {
+	    close(fs.fds[i]);
+    }
+    fs.members=0;
+    fs.fd=-1;
+    free(fs.csums);
+    fs.csums=NULL;
+}
+
+/** Get file attributes.
+ *
+ * Similar to stat().  The 'st_dev' and 'st_blksize' fields are
+ * ignored.  The 'st_ino' field is ignored except if the 'use_ino'
+ * mount option is given.
+ */
+int sfs_getattr(const char *path, struct stat *statbuf)
+{
+    int retstat = 0;
+    log_msg("\nsfs_getattr(path=\"%s\", statbuf=0x%08x)\n",path, statbuf);
+    if(strcmp(path,"/")==0)
+    {
+	    stat_root(statbuf);
+	    log_msg("\nfinished getattr for root\n");
+	    return retstat;
+    }
+    if(strcmp(path,STATS_PATH)==0)
+    {
+	    stat_stats(statbuf);
+	    return retstat;
+    }
+    inode node;
+    int slot=find_file(path,&node);
+    if(slot<0)
+    {
+	    log_msg("\ncould not find file to getattr\n");
+	    return slot;
+    }
+    //fill stat
+    log_msg("\nreading data from inode number %d\n",node.node_num);
+    stat_inode(slot,&node,statbuf);
+
+    log_msg("\ngetattr finished\n");
+    return retstat;
+}
+
+/**
+ * Create and open a file
+ *
+ * If the file does not exist, first create it with the specified
+ * mode, and then open it.
+ *
+ * If this method is not implemented or under Linux kernel
+ * versions earlier than 2.6.15, the mknod() and open() methods
+ * will be called instead.
+ *
+ * Introduced in version 2.5
+ */
+int sfs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+    int retstat = 0;
+    log_msg("\nsfs_create(path=\"%s\", mode=0%03o, fi=0x%08x)\n",path, mode, fi);
+    inode node;
+    pthread_mutex_lock(&names_lock);
+    int slot=file_create(&(path[1]),&node);
+    pthread_mutex_unlock(&names_lock);
+    if(slot<0)
+    {
+	    retstat=slot;
+    }
+    else
+    {
+	    fi->fh=bmap_open(slot);
+    }
+
+    log_msg("\nsfs_create finished\n");
+    return retstat;
+}
+
+/** Remove a file */
+int sfs_unlink(const char *path)
+{
+    int retstat = 0;
+    log_msg("sfs_unlink(path=\"%s\")\n", path);
+    
+    inode node;
+    pthread_mutex_lock(&names_lock);
+    int slot=find_file(path,&node);
+    if(slot<0)
+    {
+	    pthread_mutex_unlock(&names_lock);
+	    log_msg("\ndid not find file\n");
+	    return slot;
+    }
+    file_free(slot,&node);
+    pthread_mutex_unlock(&names_lock);
+
+    log_msg("\nsfs_unlink finished\n");
+    return retstat;
+}
+
+/** File open operation
+ *
+ * No creation, or truncation flags (O_CREAT, O_EXCL, O_TRUNC)
+ * will be passed to open().  Open should check if the operation
+ * is permitted for the given flags.  Optionally open may also
+ * return an arbitrary filehandle in the fuse_file_info structure,
+ * which will be passed to all file operations.
+ *
+ * Changed in version 2.2
+ */
+int sfs_open(const char *path, struct fuse_file_info *fi)
+{
+    int retstat = 0;
+    log_msg("\nsfs_open(path\"%s\", fi=0x%08x)\n",path, fi);
+    if(strcmp(path,STATS_PATH)==0)
+    {
+	    return stats_open(fi);
+    }
+
+    inode node;
+    //check for existance of file
+    int slot=find_file(path,&node);
+    if(slot<0)
+    {
+	    log_msg("\ndid not find file\n");
+	    retstat=slot;
+	    return retstat;
+    }
+    //check permissions of file
+    //files have all permissions
+/*
+    mode_t permission=node.mode;
+    if(permission^S_IRUSR==0||permission^S_IWUSR==0)
+    {
+	retstat=-1;
+	log_msg("\nfailed open on permissions\n");
+	return retstat;
+    }
+*/
+    fi->fh=bmap_open(slot);
+
+    log_msg("\nopened file\n");
+    return retstat;
+}
+
+/** Release an open file
+ *
+ * Release is called when there are no more references to an open
+ * file: all file descriptors are closed and all memory mappings
+ * are unmapped.
+ *
+ * For every open() call there will be exactly one release() call
+ * with the same flags and file descriptor.  It is possible to
+ * have a file opened more than once, in which case only the last
+ * release will mean, that no more reads/writes will happen on the
+ * file.  The return value of release is ignored.
+ *
+ * Changed in version 2.2
+ */
+int sfs_release(const char *path, struct fuse_file_info *fi)
+{
+    int retstat = 0;
+    log_msg("\nsfs_release(path=\"%s\", fi=0x%08x)\n",path, fi);
+    if(strcmp(path,STATS_PATH)==0)
+    {
+	    stats_release(fi);
+	    return retstat;
+    }
+    //the path may be unlinked by now, the slot came with the open
+    int slot=fh_slot(fi->fh);
+    if(slot<0)
+    {
+	    log_msg("\nthe file was freed while open\n");
+	    return retstat;
+    }
+    file_pack(slot);
+    flush_inode(slot,DIRTY_TIMES);
+    bmap_release(fi->fh);
+    log_msg("\nrelease finished\n");
+    return retstat;
+}
+
+/** Possibly flush cached data
+ *
+ * BIG NOTE: This is not equivalent to fsync().  It's not a
+ * request to sync dirty data.
+ *
+ * Flush is called on each close() of a file descriptor.  So if a
+ * filesystem wants to return write errors in close() and the file
+ * has cached dirty data, this is a good place to write back data
+ * and return any errors.  Since many applications ignore close()
+ * errors this is not always useful.
+ *
+ * NOTE: The flush() method may be called more than once for each
+ * open().  This happens if more than one file descriptor refers
+ * to an opened file due to dup(), dup2() or fork() calls.  It is
+ * not possible to determine if a flush is final, so each flush
+ * should be treated equally.  Multiple write-flush sequences are
+ * relatively rare, so this shouldn't be a problem.
+ *
+ * Changed in version 2.2
+ */
+int sfs_flush(const char *path, struct fuse_file_info *fi)
+{
+    int retstat = 0;
+    log_msg("\nsfs_flush(path=\"%s\", fi=0x%08x)\n",path, fi);
+    if(strcmp(path,STATS_PATH)==0)
+    {
+	    return retstat;
+    }
+    //compress what was written, and write the inode changes held back by mark_inode
+    int slot=fh_slot(fi->fh);
+    if(slot>=0)
+    {
+	    file_pack(slot);
+	    flush_inode(slot,DIRTY_TIMES);
+    }
+    return retstat;
+}
+
+/** Synchronize file contents
+ *
+ * If the datasync parameter is non-zero, then only the user data
+ * should be flushed, not the meta data.
+ *
+ * Changed in version 2.2
+ */
+int sfs_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    int retstat = 0;
+    log_msg("\nsfs_fsync(path=\"%s\", datasync=%d, fi=0x%08x)\n",path, datasync, fi);
+    if(strcmp(path,STATS_PATH)==0)
+    {
+	    return retstat;
+    }
+    int slot=fh_slot(fi->fh);
+    if(slot<0)
+    {
+	    return slot;
+    }
+    file_pack(slot);
+    retstat=file_sync(slot,datasync);
+    log_msg("\nfsync finished\n");
+    return retstat;
+}
+
+/** Read data from an open file
+ *
+ * Read should return exactly the number of bytes requested except
+ * on EOF or error, otherwise the rest of the data will be
+ * substituted with zeroes.  An exception to this is when the
+ * 'direct_io' mount option is specified, in which case the return
+ * value of the read system call will reflect the return value of
+ * this operation.
+ *
+ * Changed in version 2.2
+ */
+int sfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    int retstat = 0;
+    log_msg("\nsfs_read(path=\"%s\", buf=0x%08x, size=%d, offset=%lld, fi=0x%08x)\n",path, buf, size, offset, fi);
+    if(strcmp(path,STATS_PATH)==0)
+    {
+	    const char* part;
+	    size=stats_part(fi,size,offset,&part);
+	    memcpy(buf,part,size);
+	    return size;
+    }
+    inode node;
+    unsigned long seen=file_seen();
+    int slot=file_hold(find_file(path,&node),&node,seen);
+    if(slot<0)
+    {
+	    log_msg("\ndid not find file\n");
+	    return slot;
+    }
+    retstat=file_read(slot,&node,buf,size,offset);
+    file_unhold(slot,0);
+    log_msg("\nread finished\n");
+    return retstat;
+}
+
+/** Write data to an open file
+ *
+ * Write should return exactly the number of bytes requested
+ * except on error.  An exception to this is when the 'direct_io'
+ * mount option is specified (see read operation).
+ *
+ * Changed in version 2.2
+ */
+int sfs_write(const char *path, const char *buf, size_t size, off_t offset,struct fuse_file_info *fi)
+{
+    int retstat = 0;
+    log_msg("\nsfs_write(path=\"%s\", buf=0x%08x, size=%d, offset=%lld, fi=0x%08x)\n",path, buf, size, offset, fi);
+
+    //check if file exists
+    inode node;
+    unsigned long seen=file_seen();
+    int slot=file_hold(find_file(path,&node),&node,seen);
+    if(slot<0)
+    {
+	    log_msg("\ndid not find file\n");
+	    return slot;
+    }
+    retstat=file_write(slot,&node,buf,size,offset);
+    file_unhold(slot,0);
+    log_msg("\nwrite finished\n");
+    return retstat;
+}
+
+
+/** Store data from an open file in a buffer
+ *
+ * Similar to the read() method, but data is stored and
+ * returned in a generic buffer.
+ *
+ * No actual copying of data has to take place, the source
+ * file descriptor may simply be stored in the buffer for
+ * later data transfer.
+ *
+ * The buffer must be allocated dynamically and stored at the
+ * location pointed to by bufp.  If the buffer contains memory
+ * regions, they too must be allocated using malloc().  The
+ * allocated memory will be freed by the caller.
+ *
+ * Each run of contiguous disk blocks becomes one fd buffer pointing
+ * into the disk file, so fuse can splice it to /dev/fuse without the
+ * data passing through here.  Holes become zeroed memory buffers.
+ *
+ * Introduced in version 2.9
+ */
+int sfs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    int retstat = 0;
+    log_msg("\nsfs_read_buf(path=\"%s\", bufp=0x%08x, size=%d, offset=%lld, fi=0x%08x)\n",path, bufp, size, offset, fi);
+    if(strcmp(path,STATS_PATH)==0)
+    {
+	    const char* part;
+	    size=stats_part(fi,size,offset,&part);
+	    struct fuse_bufvec* bufv=malloc(sizeof(struct fuse_bufvec));
+	    *bufv=FUSE_BUFVEC_INIT(size);
+	    bufv->buf[0].mem=malloc(size>0 ? size : 1);
+	    memcpy(bufv->buf[0].mem,part,size);
+	    *bufp=bufv;
+	    return retstat;
+    }
+    inode node;
+    unsigned long seen=file_seen();
+    int slot=file_hold(find_file(path,&node),&node,seen);
+    if(slot<0)
+    {
+	    log_msg("\ndid not find file\n");
+	    return slot;
+    }
+    retstat=file_read_buf(slot,&node,bufp,size,offset);
+    //fuse reads the blocks after this returns, only sfs_ll_read can keep them from moving
+    //until they are sent
+    file_unhold(slot,0);
+    log_msg("\nread_buf finished\n");
+    return retstat;
+}
+
+/** Write contents of buffer to an open file
+ *
+ * Similar to the write() method, but data is supplied in a
+ * generic buffer.  Use fuse_buf_copy() to transfer data to
+ * the destination.
+ *
+ * The blocks being written are allocated first and described as fd
+ * buffers pointing into the disk file, so fuse_buf_copy() can splice
+ * the data in from /dev/fuse.
+ *
+ * Introduced in version 2.9
+ */
+int sfs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi)
+{
+    int retstat = 0;
+    log_msg("\nsfs_write_buf(path=\"%s\", buf=0x%08x, size=%d, offset=%lld, fi=0x%08x)\n",path, buf, fuse_buf_size(buf), offset, fi);
+    inode node;
+    unsigned long seen=file_seen();
+    int slot=file_hold(find_file(path,&node),&node,seen);
+    if(slot<0)
+    {
+	    log_msg("\ndid not find file\n");
+	    return slot;
+    }
+    retstat=file_write_buf(slot,&node,buf,offset);
+    file_unhold(slot,0);
+    log_msg("\nwrite_buf finished\n");
+    return retstat;
+}
+
+/** Create a directory */
+int sfs_mkdir(const char *path, mode_t mode)
+{
+    int retstat = 0;
+    log_msg("\nsfs_mkdir(path=\"%s\", mode=0%3o)\n",
+	    path, mode);
+   
+    
+    return retstat;
+}
+
+
+/** Remove a directory */
+int sfs_rmdir(const char *path)
+{
+    int retstat = 0;
+    log_msg("sfs_rmdir(path=\"%s\")\n",
+	    path);
+    
+    
+    return retstat;
+}
+
+
+/** Open directory
+ *
+ * This method should check if the open operation is permitted for
+ * this  directory
+ *
+ * Introduced in version 2.3
+ */
+int sfs_opendir(const char *path, struct fuse_file_info *fi)
+{
+    int retstat = 0;
+    log_msg("\nsfs_opendir(path=\"%s\", fi=0x%08x)\n",
+	  path, fi);
+    
+    
+    return retstat;
+}
+
+/** Read directory
+ *
+ * This supersedes the old getdir() interface.  New applications
+ * should use this.
+ *
+ * The filesystem may choose between two modes of operation:
+ *
+ * 1) The readdir implementation ignores the offset parameter, and
+ * passes zero to the filler function's offset.  The filler
+ * function will not return '1' (unless an error happens), so the
+ * whole directory is read in a single readdir operation.  This
+ * works just like the old getdir() method.
+ *
+ * 2) The readdir implementation keeps track of the offsets of the
+ * directory entries.  It uses the offset parameter and always
+ * passes non-zero offset to the filler function.  When the buffer
+ * is full (or an error happens) the filler function will return
+ * '1'.
+ *
+ * Introduced in version 2.3
+ */
+int sfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
+	       struct fuse_file_info *fi)
+{
+    int retstat = 0;
+    
+    superblock sb;
+    char* block_buff = block_get();
+    fs_block_read(0,block_buff);
+    memcpy(&sb,block_buff,sizeof(superblock));
+
+    int i;
+    inode node;
+    for(i=0; i<NUM_NODES; i++)
+    {
+	if(sb.node_list[i] == '1')
+	{
+	    get_inode(i, &node, block_buff);
+	    if(node.link_count == 0)
+	    {
+		//unlinked, only still around for the low-level interface
+		continue;
+	    }
+	    if(filler(buf, node.name, NULL, 0) != 0)
+	    {
+		log_msg("\nBuffer is full!\n");
+		retstat = -ENOMEM;
+		break;
+	    }
+	}
+    }
+    block_put(block_buff);	
+   
+    return retstat;
+}
+
+/** Release directory
+ *
+ * Introduced in version 2.3
+ */
+int sfs_releasedir(const char *path, struct fuse_file_info *fi)
+{
+    int retstat = 0;
+
+    
+    return retstat;
+}
+
+/**
+ * Ioctl
+ *
+ * flags will have FUSE_IOCTL_COMPAT set for 32bit ioctls in
+ * 64bit environment.  The size and direction of data is
+ * determined by _IOC_*() decoding of cmd.  For _IOC_NONE,
+ * data will be NULL, for _IOC_WRITE data is out area, for
+ * _IOC_READ in area and if both are set in/out area.  In all
+ * non-NULL cases, the area is of _IOC_SIZE(cmd) bytes.
+ *
+ * The high-level API has no lseek() hook, so SEEK_DATA and SEEK_HOLE
+ * are answered here (see sfs_ioctl.h).
+ *
+ * Introduced in version 2.8
+ */
+int sfs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi, unsigned int flags, void *data)
+{
+    int retstat = 0;
+    log_msg("\nsfs_ioctl(path=\"%s\", cmd=0x%08x, fi=0x%08x, flags=0x%08x)\n",path, cmd, fi, flags);
+    if(flags&FUSE_IOCTL_COMPAT)
+    {
+	    return -ENOSYS;
+    }
+    if((unsigned int)cmd==SFS_IOC_STATS_RESET)
+    {
+	    stats_reset();
+	    return retstat;
+    }
+    inode node;
+    unsigned long seen=file_seen();
+    int slot=ioctl_hold(find_file(path,&node),&node,(unsigned int)cmd,seen);
+    if(slot<0)
+    {
+	    log_msg("\ndid not find file\n");
+	    return slot;
+    }
+    retstat=file_ioctl(slot,&node,(unsigned int)cmd,data);
+    ioctl_unhold(slot,(unsigned int)cmd);
+    log_msg("\nioctl finished\n");
+    return retstat;
+}
+
+//every handler is called through one of these, so that it shows up in the statistics and the
+//trace.  What is passed to op_start only goes in the trace
+#define TIMED(op, name, ino, offset, size, fi, call) op_timer t; op_start(&t,(name),(ino),(offset),(size),(fi)); int retstat=(call); op_done((op),&t,retstat); return retstat
+
+int timed_getattr(const char *path, struct stat *statbuf)
+{
+	TIMED(OP_GETATTR,path,0,0,0,NULL,sfs_getattr(path,statbuf));
+}
+
+int timed_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+	TIMED(OP_CREATE,path,0,0,mode,fi,sfs_create(path,mode,fi));
+}
+
+int timed_unlink(const char *path)
+{
+	TIMED(OP_UNLINK,path,0,0,0,NULL,sfs_unlink(path));
+}
+
+int timed_open(const char *path, struct fuse_file_info *fi)
+{
+	TIMED(OP_OPEN,path,0,0,fi->flags,fi,sfs_open(path,fi));
+}
+
+int timed_release(const char *path, struct fuse_file_info *fi)
+{
+	TIMED(OP_RELEASE,path,0,0,0,fi,sfs_release(path,fi));
+}
+
+int timed_flush(const char *path, struct fuse_file_info *fi)
+{
+	TIMED(OP_FLUSH,path,0,0,0,fi,sfs_flush(path,fi));
+}
+
+int timed_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+	TIMED(OP_FSYNC,path,0,0,datasync,fi,sfs_fsync(path,datasync,fi));
+}
+
+int timed_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	TIMED(OP_READ,path,0,offset,size,fi,sfs_read(path,buf,size,offset,fi));
+}
+
+int timed_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	TIMED(OP_WRITE,path,0,offset,size,fi,sfs_write(path,buf,size,offset,fi));
+}
+
+int timed_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	TIMED(OP_READ,path,0,offset,size,fi,sfs_read_buf(path,bufp,size,offset,fi));
+}
+
+int timed_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi)
+{
+	TIMED(OP_WRITE,path,0,offset,fuse_buf_size(buf),fi,sfs_write_buf(path,buf,offset,fi));
+}
+
+int timed_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi, unsigned int flags, void *data)
+{
+	TIMED(OP_IOCTL,path,0,0,(unsigned int)cmd,fi,sfs_ioctl(path,cmd,arg,fi,flags,data));
+}
+
+int timed_rmdir(const char *path)
+{
+	TIMED(OP_RMDIR,path,0,0,0,NULL,sfs_rmdir(path));
+}
+
+int timed_mkdir(const char *path, mode_t mode)
+{
+	TIMED(OP_MKDIR,path,0,0,mode,NULL,sfs_mkdir(path,mode));
+}
+
+int timed_opendir(const char *path, struct fuse_file_info *fi)
+{
+	TIMED(OP_OPENDIR,path,0,0,0,fi,sfs_opendir(path,fi));
+}
+
+int timed_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
+{
+	TIMED(OP_READDIR,path,0,offset,0,fi,sfs_readdir(path,buf,filler,offset,fi));
+}
+
+int timed_releasedir(const char *path, struct fuse_file_info *fi)
+{
+	TIMED(OP_RELEASEDIR,path,0,0,0,fi,sfs_releasedir(path,fi));
+}
+
+struct fuse_operations sfs_oper = {
+  .init = sfs_init,
+  .destroy = sfs_destroy,
+
+  .getattr = timed_getattr,
+  .create = timed_create,
+  .unlink = timed_unlink,
+  .open = timed_open,
+  .release = timed_release,
+  .flush = timed_flush,
+  .fsync = timed_fsync,
+  .read = timed_read,
+  .write = timed_write,
+  .read_buf = timed_read_buf,
+  .write_buf = timed_write_buf,
+  .ioctl = timed_ioctl,
+
+  .rmdir = timed_rmdir,
+  .mkdir = timed_mkdir,
+
+  .opendir = timed_opendir,
+  .readdir = timed_readdir,
+  .releasedir = timed_releasedir
+};
+
+///////////////////////////////////////////////////////////
+//
+// Low-level interface, picked with -o lowlevel.  Requests name
+// inodes instead of paths, so nothing has to be looked up by
+// name more than once.  Prototypes and C-style comments come
+// from /usr/include/fuse/fuse_lowlevel.h
+//
+
+int kernel_saw(int slot, inode* node)
+{
+	//record the attributes about to be handed to the kernel, returns 1 if they changed
+	//since it was last handed them without it having done the change itself
+	int changed=0;
+	pthread_mutex_lock(&kview_lock);
+	if(kview[slot].valid&&(kview[slot].modify!=node->modify||kview[slot].size!=node->size))
+	{
+		changed=1;
+		kview[slot].stale=1;
+	}
+	kview[slot].valid=1;
+	kview[slot].modify=node->modify;
+	kview[slot].size=node->size;
+	pthread_mutex_unlock(&kview_lock);
+	return changed;
+}
+
+void kernel_did(int slot, inode* node)
+{
+	//the kernel made this change itself (a write), so its caches already match
+	pthread_mutex_lock(&kview_lock);
+	kview[slot].valid=1;
+	kview[slot].modify=node->modify;
+	kview[slot].size=node->size;
+	pthread_mutex_unlock(&kview_lock);
+}
+
+int kernel_keep_cache(int slot, inode* node)
+{
+	//can an open keep the pages the kernel has cached, like the auto_cache option
+	kernel_saw(slot,node);
+	pthread_mutex_lock(&kview_lock);
+	int keep=!kview[slot].stale;
+	kview[slot].stale=0;
+	pthread_mutex_unlock(&kview_lock);
+	return keep;
+}
+
+void kernel_changed(int slot)
+{
+	//the file changed without the kernel doing it, its cached pages can't be kept
+	pthread_mutex_lock(&kview_lock);
+	kview[slot].stale=1;
+	pthread_mutex_unlock(&kview_lock);
+}
+
+void kernel_inval(int slot)
+{
+	//drop the kernel's cached attributes and pages of the inode in slot.  The kernel may
+	//hold a page locked while it waits on a read only this thread could answer, so this is
+	//left to the next open (see kernel_keep_cache) unless other threads are serving requests
+	if(sfs_chan!=NULL&&sfs_multithreaded)
+	{
+		fuse_lowlevel_notify_inval_inode(sfs_chan,SLOT_INO(slot),0,0);
+		pthread_mutex_lock(&kview_lock);
+		kview[slot].stale=0;
+		pthread_mutex_unlock(&kview_lock);
+	}
+}
+
+void kernel_forget(int slot)
+{
+	//the slot was freed, whatever takes it next starts with nothing cached
+	pthread_mutex_lock(&kview_lock);
+	memset(&(kview[slot]),0,sizeof(kernel_view));
+	pthread_mutex_unlock(&kview_lock);
+}
+
+int ll_slot(fuse_ino_t ino, inode* node)
+{
+	//inode behind a low-level inode number, which may not be the root
+	if(ino==FUSE_ROOT_ID)
+	{
+		return -EISDIR;
+	}
+	return read_inode(INO_SLOT(ino),node);
+}
+
+void ll_entry(int slot, inode* node, struct fuse_entry_param* e)
+{
+	memset(e,0,sizeof(struct fuse_entry_param));
+	e->ino=SLOT_INO(slot);
+	e->generation=1;
+	e->attr_timeout=sfs_opts.attr_timeout;
+	e->entry_timeout=sfs_opts.entry_timeout;
+	stat_inode(slot,node,&(e->attr));
+	scratch_get()->entry_ino=e->ino;
+	pthread_mutex_lock(&nlookup_lock);
+	nlookup[slot]++;
+	pthread_mutex_unlock(&nlookup_lock);
+}
 
-    return SFS_DATA;
+/**
+ * Initialize filesystem
+ *
+ * Called before any other filesystem method
+ */
+void sfs_ll_init(void *userdata, struct fuse_conn_info *conn)
+{
+    sfs_init(conn);
 }
 
 /**
  * Clean up filesystem
  *
- * Called on filesystem exit.
- *
- * Introduced in version 2.3
+ * Called on filesystem exit
  */
-void sfs_destroy(void *userdata)
+void sfs_ll_destroy(void *userdata)
 {
-	//nothing to do
-	//everything gets written as it happens
-    log_msg("\nsfs_destroy(userdata=0x%08x)\n", userdata);
-    disk_close(SFS_DATA->diskfile);
+    sfs_destroy(userdata);
 }
 
-/** Get file attributes.
- *
- * Similar to stat().  The 'st_dev' and 'st_blksize' fields are
- * ignored.  The 'st_ino' field is ignored except if the 'use_ino'
- * mount option is given.
+/**
+ * Look up a directory entry by name and get its attributes.
  */
-int sfs_getattr(const char *path, struct stat *statbuf)
+void sfs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
-    int retstat = 0;
-    char fpath[PATH_MAX];
-    log_msg("\nsfs_getattr(path=\"%s\", statbuf=0x%08x)\n",path, statbuf);
-    superblock sb;
-    char* block_buff=malloc(BLOCK_SIZE);
-    block_read(0,block_buff);
-    memcpy(&sb,block_buff,sizeof(superblock));
-    if(strcmp(path,"/")==0)
+    log_msg("\nsfs_ll_lookup(parent=%lu, name=\"%s\")\n", parent, name);
+    if(parent!=FUSE_ROOT_ID)
     {
-	    //get root info stored in sb
-	    statbuf->st_ino=0;
-	    statbuf->st_uid=getuid();
-	    statbuf->st_gid=getgid();
-	    statbuf->st_mode=S_IFDIR|S_IRWXU|S_IRWXG|S_IRWXO;
-	    statbuf->st_nlink=1;
-	    statbuf->st_size=0; //maybe whole size of the filesystem
-	    statbuf->st_blocks=0; //maybe all blocks in use
-	    statbuf->st_atime=sb.access;
-	    statbuf->st_mtime=sb.modify;
-	    statbuf->st_ctime=sb.change;
-	    free(block_buff);
-	    log_msg("\nfinished getattr for root\n");
-	    return retstat;
+	    fuse_reply_err(req,ENOTDIR);
+	    return;
     }
-    int i;
     inode node;
-    //find the file
-    for(i=0;i<NUM_NODES;i++)
+    struct fuse_entry_param e;
+    if(strcmp(name,STATS_NAME)==0)
     {
-	    if(sb.node_list[i]=='1')
-	    {
-		log_msg("\nfound an inode\n");
-	    	block_read(i+NODE_STRT,block_buff);
-	    	memcpy(&node,block_buff,sizeof(inode));
-	    	if(strcmp(&path[1],node.name)==0)
-	    	{
-		    break;
-	    	}
-	    }
+	    //not counted in nlookup, there is nothing to free when it is forgotten
+	    memset(&e,0,sizeof(struct fuse_entry_param));
+	    e.ino=STATS_INO;
+	    scratch_get()->entry_ino=e.ino;
+	    e.generation=1;
+	    e.entry_timeout=sfs_opts.entry_timeout;
+	    stat_stats(&(e.attr));
+	    fuse_reply_entry(req,&e);
+	    return;
     }
-    if(i==NUM_NODES)
+    int slot=file_lookup(name,&node);
+    if(slot==-ENOENT&&sfs_opts.negative_timeout>0)
     {
-	    log_msg("\ncould not find file to getattr\n");
-		statbuf->st_ino=129;
-		statbuf->st_uid=getuid();
-		statbuf->st_gid=getgid();
-		statbuf->st_mode=(S_IFREG|S_IRWXU|S_IRWXG|S_IRWXO);
-		statbuf->st_nlink=1;
-		statbuf->st_size=0;
-		statbuf->st_blocks=0;
-		statbuf->st_atime=time(NULL);
-		statbuf->st_mtime=time(NULL);
-		statbuf->st_ctime=time(NULL);
-		retstat=-ENOENT;
-
+	    //inode 0 lets the kernel cache that the name doesn't exist, until it creates it
+	    memset(&e,0,sizeof(struct fuse_entry_param));
+	    e.entry_timeout=sfs_opts.negative_timeout;
+	    fuse_reply_entry(req,&e);
+	    return;
     }
-    else
+    if(slot<0)
     {
-	//fill stat
-	log_msg("\nreading data from inode number %d\n",node.node_num);
-	statbuf->st_ino=node.node_num;
-    	statbuf->st_uid=getuid();
-    	statbuf->st_gid=getgid();
-	//statbuf->st_blksize=(blksize_t)512;
-   	statbuf->st_mode=(S_IFREG|S_IRWXU|S_IRWXG|S_IRWXO);
-   	statbuf->st_nlink=node.link_count;
-	statbuf->st_size=node.size;
-	float num_blocks=node.size/512.0;
-	if(num_blocks-(int)num_blocks!=0)
-	{
-		num_blocks++;
-	}
-	statbuf->st_blocks=(blkcnt_t)(num_blocks);
-	statbuf->st_atime=node.access;
-	statbuf->st_mtime=node.modify;
-	statbuf->st_ctime=node.change;
+	    fuse_reply_err(req,-slot);
+	    return;
+    }
+    int changed=kernel_saw(slot,&node);
+    ll_entry(slot,&node,&e);
+    fuse_reply_entry(req,&e);
+    if(changed)
+    {
+	    kernel_inval(slot);
     }
-    free(block_buff);
+}
 
-    log_msg("\ngetattr finished\n");
-    return retstat;
+void ll_forget_one(fuse_ino_t ino, unsigned long count)
+{
+	int slot=INO_SLOT(ino);
+	if(ino==FUSE_ROOT_ID||slot<0||slot>=NUM_NODES)
+	{
+		return;
+	}
+	//the inode may have to be freed
+	pthread_mutex_lock(&names_lock);
+	pthread_mutex_lock(&nlookup_lock);
+	nlookup[slot]-=(count<nlookup[slot]) ? count : nlookup[slot];
+	if(nlookup[slot]==0)
+	{
+		//last reference to a file that was unlinked while still in use
+		inode node;
+		if(read_inode(slot,&node)>=0&&node.link_count==0)
+		{
+			log_msg("\nfreeing unlinked inode number %d\n",node.node_num);
+			file_free(slot,&node);
+		}
+		else
+		{
+			//evicted from the kernel's cache, the inode goes with it
+			flush_inode(slot,DIRTY_TIMES);
+		}
+		kernel_forget(slot);
+	}
+	pthread_mutex_unlock(&nlookup_lock);
+	pthread_mutex_unlock(&names_lock);
 }
 
 /**
- * Create and open a file
- *
- * If the file does not exist, first create it with the specified
- * mode, and then open it.
- *
- * If this method is not implemented or under Linux kernel
- * versions earlier than 2.6.15, the mknod() and open() methods
- * will be called instead.
+ * Forget about an inode
  *
- * Introduced in version 2.5
+ * The nlookup parameter indicates the number of lookups
+ * previously performed on this inode.
  */
-int sfs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+void sfs_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long count)
 {
-    int retstat = 0;
-    log_msg("\nsfs_create(path=\"%s\", mode=0%03o, fi=0x%08x)\n",path, mode, fi);
-    if(strlen(path)>50)
+    log_msg("\nsfs_ll_forget(ino=%lu, nlookup=%lu)\n", ino, count);
+    ll_forget_one(ino,count);
+    fuse_reply_none(req);
+}
+
+/**
+ * Forget about multiple inodes
+ */
+void sfs_ll_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets)
+{
+    size_t i;
+    for(i=0;i<count;i++)
     {
-	    //file name too long
-	    log_msg("\nfile name too long\n");
-	    retstat=-E2BIG;
-	    return retstat;
+	    ll_forget_one(forgets[i].ino,forgets[i].nlookup);
     }
-    superblock sb;
-    char* block_buff=malloc(BLOCK_SIZE);
-    block_read(0,block_buff);
-    memcpy(&sb,block_buff,sizeof(superblock));
-    if(sb.num_files==NUM_NODES)
+    fuse_reply_none(req);
+}
+
+/**
+ * Get file attributes
+ */
+void sfs_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    log_msg("\nsfs_ll_getattr(ino=%lu)\n", ino);
+    struct stat statbuf;
+    if(ino==FUSE_ROOT_ID)
     {
-	    //fs is full
-	    log_msg("\nfs is full\n");
-	    retstat=-ENOSPC;
-	    free(block_buff);
-	    return retstat;
+	    stat_root(&statbuf);
+	    fuse_reply_attr(req,&statbuf,sfs_opts.attr_timeout);
+	    return;
+    }
+    if(ino==STATS_INO)
+    {
+	    stat_stats(&statbuf);
+	    fuse_reply_attr(req,&statbuf,0);
+	    return;
     }
-    int i,pos=0;
     inode node;
-    //check to see if there is a file of the same name
-    for(i=0;i<NUM_NODES;i++)
+    int slot=ll_slot(ino,&node);
+    if(slot<0)
     {
-	if(sb.node_list[i]=='1')
-	{
-		block_read(i+NODE_STRT,block_buff);
-		memcpy(&node,block_buff,sizeof(inode));
-		if(strcmp(node.name,&(path[1]))==0)
-		{
-			log_msg("\nfile already exists\n");
-			free(block_buff);
-			retstat=-EEXIST;
-			return retstat;
-		}
-	}	
+	    fuse_reply_err(req,-slot);
+	    return;
     }
-    for(i=0;i<NUM_NODES;i++)
+    int changed=kernel_saw(slot,&node);
+    stat_inode(slot,&node,&statbuf);
+    fuse_reply_attr(req,&statbuf,sfs_opts.attr_timeout);
+    if(changed)
     {
-	    //find empty inode
-	    if(sb.node_list[i]=='0')
-	    {
-		sb.node_list[i]='1';
-		pos=i;
-		break;
-	    }
+	    kernel_inval(slot);
     }
-    //initialize new inode
-    inode new;
-    new.node_num=pos+1;
-    log_msg("\ncreate inode number %d\n",pos+1);
-    new.mode=(S_IFREG|S_IRWXU|S_IRWXG|S_IRWXO);
-    new.link_count=1;
-    new.size=0;
-    new.access=(long)time(NULL);
-    new.modify=new.access;
-    new.change=new.access;
-    for(i=0;i<32;i++)
-    {
-	    new.direct[i]=-1;
-    }
-    for(i=0;i<64;i++)
-    {
-	    new.single_indirect[i]=-1;
-    }
-    new.double_indirect=-1;
-    strcpy(new.name,&(path[1]));
-    new.fh=0;
-    sb.num_files=sb.num_files+1;
-    memcpy(block_buff,&new,sizeof(inode));
-    block_write(pos+NODE_STRT,block_buff);
-    memcpy(block_buff,&sb,sizeof(superblock));
-    block_write(0,block_buff);
-    free(block_buff);
+}
 
-    log_msg("\nsfs_create finished\n");
-    return retstat;
+/**
+ * Create and open a file
+ */
+void sfs_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi)
+{
+    log_msg("\nsfs_ll_create(parent=%lu, name=\"%s\", mode=0%03o)\n", parent, name, mode);
+    if(parent!=FUSE_ROOT_ID)
+    {
+	    fuse_reply_err(req,ENOTDIR);
+	    return;
+    }
+    inode node;
+    pthread_mutex_lock(&names_lock);
+    int slot=file_create(name,&node);
+    pthread_mutex_unlock(&names_lock);
+    if(slot<0)
+    {
+	    fuse_reply_err(req,-slot);
+	    return;
+    }
+    struct fuse_entry_param e;
+    kernel_did(slot,&node);
+    ll_entry(slot,&node,&e);
+    fi->fh=bmap_open(slot);
+    fuse_reply_create(req,&e,fi);
 }
 
-/** Remove a file */
-int sfs_unlink(const char *path)
+/**
+ * Remove a file
+ *
+ * If the kernel still has the inode looked up, only the name goes
+ * now and the blocks are freed once it is forgotten.
+ */
+void sfs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
-    int retstat = 0;
-    log_msg("sfs_unlink(path=\"%s\")\n", path);
-    
-    int i;
-    superblock sb;
+    log_msg("\nsfs_ll_unlink(parent=%lu, name=\"%s\")\n", parent, name);
+    if(parent!=FUSE_ROOT_ID)
+    {
+	    fuse_reply_err(req,ENOTDIR);
+	    return;
+    }
     inode node;
-    char* block_buff=malloc(BLOCK_SIZE);
-    block_read(0,block_buff);
-    memcpy(&sb,block_buff,sizeof(superblock));
-    //find the file
-    for(i=0;i<NUM_NODES;i++)
+    pthread_mutex_lock(&names_lock);
+    int slot=file_lookup(name,&node);
+    if(slot<0)
     {
-	if(sb.node_list[i]=='1')
-	{
-		block_read(i+NODE_STRT,block_buff);
-		memcpy(&node,block_buff,sizeof(inode));
-		if(strcmp(node.name,&(path[1]))==0)
-		{
-			sb.node_list[i]='0';
-			break;
-		}
-	}
+	    pthread_mutex_unlock(&names_lock);
+	    fuse_reply_err(req,-slot);
+	    return;
     }
-    if(i==NUM_NODES)
+    pthread_mutex_lock(&nlookup_lock);
+    if(nlookup[slot]>0)
     {
-	    log_msg("\ndid not find file\n");
-	    retstat=-ENOENT;
-	    free(block_buff);
-	    return retstat;
+	    node.link_count=0;
+	    node.change=time(NULL);
+	    write_inode(slot,&node);
+	    fs.name_hash[slot]=0;
     }
-    //mark all data disk blocks associated with the file as free
-    //direct blocks
-    data_list metadata;
-    for(i=0;i<32;i++)
+    else
     {
-	    int block=node.direct[i];
-	    if(block!=-1)
-	    {
-	    	block=block-DISK_STRT; //first,second,third,... data block. block=[0,28671]
-	    	int md_block=block/512; //find which of the 56 metadata blocks holds this ones data. md_block=[0,55]
-	    	int md_index=block%512; //find index of this block's data in metadata block. md_index=[0,511]
-	    	block_read(md_block+MDATA_STRT,block_buff); //get metadata block holding info for this data block
-		memcpy(&metadata,block_buff,sizeof(data_list)); 
-		metadata.data[md_index]='0';
-		memcpy(block_buff,&metadata,sizeof(data_list));
-		block_write(md_block+MDATA_STRT,block_buff);
-	    }
-    }	   
-    //single indirect blocks
-    indir_data indir; //metadata struct for all indirect blocks
-    indirect i_block; //indirect block struct 
-    block_read(INDIR_DATA,block_buff);
-    memcpy(&indir,block_buff,sizeof(indir_data));
-    for(i=0;i<64;i++)
-    {
-	    int block=node.single_indirect[i];
-	    if(block!=-1)
+	    file_free(slot,&node);
+	    kernel_forget(slot);
+    }
+    pthread_mutex_unlock(&nlookup_lock);
+    pthread_mutex_unlock(&names_lock);
+    fuse_reply_err(req,0);
+}
+
+/**
+ * Open a file
+ */
+void sfs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    log_msg("\nsfs_ll_open(ino=%lu)\n", ino);
+    if(ino==STATS_INO)
+    {
+	    int retstat=stats_open(fi);
+	    if(retstat<0)
 	    {
-		    //mark as free in indir block metadata
-		    indir.indir_blocks[block-IBLK_STRT]='0';
-		    block_read(block,block_buff);
-		    memcpy(&i_block,block_buff,sizeof(indirect));
-		    //go to that indir block and mark all of it's blocks as free in thier metadata
-		    int j;
-		    for(j=0;j<128;j++)
-		    {
-			    int data_block=i_block.blocks[j];
-			    if(data_block!=-1)
-			    {
-				    data_block=data_block-DISK_STRT;
-				    int md_block=data_block/512;
-				    int md_index=data_block%512;
-				    block_read(md_block+MDATA_STRT,block_buff);
-				    memcpy(&metadata,block_buff,sizeof(data_list));
-				    metadata.data[md_index]='0';
-				    memcpy(block_buff,&metadata,sizeof(data_list));
-				    block_write(md_block+MDATA_STRT,block_buff);
-			    }
-		    }
+		    fuse_reply_err(req,-retstat);
+		    return;
 	    }
-
+	    fuse_reply_open(req,fi);
+	    return;
     }
-    //double indirect block
-    if(node.double_indirect!=-1)
+    inode node;
+    int slot=ll_slot(ino,&node);
+    if(slot<0)
     {
-	indir.d_indir_block=-1;
-	indirect d_block;
-	block_read(DIBLK,block_buff);
-	memcpy(&d_block,block_buff,sizeof(indirect));
-	for(i=0;i<128;i++)
-	{
-		int block=d_block.blocks[i];
-		if(block!=-1)
-		{
-			//go to that indirect block
-			indir.indir_blocks[block-IBLK_STRT]='0';
-			block_read(block,block_buff);
-			memcpy(&i_block,block_buff,sizeof(indirect));
-			int j;
-			for(j=0;j<128;j++)
-			{
-				int data_block=i_block.blocks[j];
-				if(data_block!=-1)
-				{
-					data_block=data_block-DISK_STRT;
-					int md_block=data_block/512;
-					int md_index=data_block%512;
-					block_read(md_block+MDATA_STRT,block_buff);
-					memcpy(&metadata,block_buff,sizeof(data_list));
-					metadata.data[md_index]='0';
-					memcpy(block_buff,&metadata,sizeof(data_list));
-					block_write(md_block+MDATA_STRT,block_buff);
-				}
-			}
-		}
-	}
+	    fuse_reply_err(req,-slot);
+	    return;
     }
-    memcpy(block_buff,&indir,sizeof(indir_data));
-    block_write(INDIR_DATA,block_buff);
-    sb.num_files=sb.num_files-1;
-    memcpy(block_buff,&sb,sizeof(superblock));
-    block_write(0,block_buff);
-    free(block_buff);
+    fi->keep_cache=kernel_keep_cache(slot,&node);
+    fi->fh=bmap_open(slot);
+    fuse_reply_open(req,fi);
+}
 
-    log_msg("\nsfs_unlink finished\n");
-    return retstat;
+/**
+ * Release an open file
+ */
+void sfs_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    if(ino==STATS_INO)
+    {
+	    stats_release(fi);
+	    fuse_reply_err(req,0);
+	    return;
+    }
+    int slot=fh_slot(fi->fh);
+    if(slot>=0)
+    {
+	    file_pack(slot);
+	    flush_inode(slot,DIRTY_TIMES);
+	    bmap_release(fi->fh);
+    }
+    fuse_reply_err(req,0);
 }
 
-/** File open operation
+/**
+ * Flush method
  *
- * No creation, or truncation flags (O_CREAT, O_EXCL, O_TRUNC)
- * will be passed to open().  Open should check if the operation
- * is permitted for the given flags.  Optionally open may also
- * return an arbitrary filehandle in the fuse_file_info structure,
- * which will be passed to all file operations.
+ * This is called on each close() of the opened file.
  *
- * Changed in version 2.2
+ * Since file descriptors can be duplicated (dup, dup2, fork), for
+ * one open call there may be many flush calls.
+ *
+ * Filesystems shouldn't assume that flush will always be called
+ * after some writes, or that if will be called at all.
  */
-int sfs_open(const char *path, struct fuse_file_info *fi)
+void sfs_ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-    int retstat = 0;
-    log_msg("\nsfs_open(path\"%s\", fi=0x%08x)\n",path, fi);
+    int slot=(ino!=STATS_INO) ? fh_slot(fi->fh) : -1;
+    if(slot>=0)
+    {
+	    file_pack(slot);
+	    flush_inode(slot,DIRTY_TIMES);
+    }
+    fuse_reply_err(req,0);
+}
 
-    int i;
-    superblock sb;
+/**
+ * Synchronize file contents
+ *
+ * If the datasync parameter is non-zero, then only the user data
+ * should be flushed, not the meta data.
+ */
+void sfs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi)
+{
+    log_msg("\nsfs_ll_fsync(ino=%lu, datasync=%d)\n", ino, datasync);
+    if(ino==STATS_INO)
+    {
+	    fuse_reply_err(req,0);
+	    return;
+    }
+    int slot=fh_slot(fi->fh);
+    if(slot<0)
+    {
+	    fuse_reply_err(req,-slot);
+	    return;
+    }
+    file_pack(slot);
+    fuse_reply_err(req,-file_sync(slot,datasync));
+}
+
+/**
+ * Read data
+ *
+ * Replies with the buffers from file_read_buf, so runs of disk
+ * blocks get spliced straight from the disk file.
+ */
+void sfs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
+{
+    log_msg("\nsfs_ll_read(ino=%lu, size=%d, offset=%lld)\n", ino, size, off);
+    if(ino==STATS_INO)
+    {
+	    const char* part;
+	    size=stats_part(fi,size,off,&part);
+	    fuse_reply_buf(req,part,size);
+	    return;
+    }
     inode node;
-    char* block_buff=malloc(BLOCK_SIZE);
-    block_read(0,block_buff);
-    memcpy(&sb,block_buff,sizeof(superblock));
-    //check for existance of file
-    for(i=0;i<NUM_NODES;i++)
+    unsigned long seen=file_seen();
+    int slot=file_hold(ll_slot(ino,&node),&node,seen);
+    if(slot<0)
     {
-	if(sb.node_list[i]=='1')
-	{
-		block_read(i+NODE_STRT,block_buff);
-		memcpy(&node,block_buff,sizeof(inode));
-		if(strcmp(node.name,&(path[1]))==0)
-		{
-			break;
-		}
-	}
+	    fuse_reply_err(req,-slot);
+	    return;
     }
-    if(i==NUM_NODES)
+    struct fuse_bufvec* bufv;
+    int retstat=file_read_buf(slot,&node,&bufv,size,off);
+    if(retstat<0)
     {
-	    log_msg("\ndid not find file\n");
-	    retstat=-ENOENT;
-	    free(block_buff);
-	    return retstat;
+	    file_unhold(slot,0);
+	    fuse_reply_err(req,-retstat);
+	    return;
     }
-    //check permissions of file
-    //files have all permissions
-/*
-    mode_t permission=node.mode;
-    if(permission^S_IRUSR==0||permission^S_IWUSR==0)
+    //the blocks are read from the disk file while this sends them, so they can't move yet
+    fuse_reply_data(req,bufv,FUSE_BUF_SPLICE_MOVE);
+    file_unhold(slot,0);
+    free_bufvec(bufv);
+}
+
+/**
+ * Write data
+ */
+void sfs_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t off, struct fuse_file_info *fi)
+{
+    log_msg("\nsfs_ll_write(ino=%lu, size=%d, offset=%lld)\n", ino, size, off);
+    inode node;
+    unsigned long seen=file_seen();
+    int slot=file_hold(ll_slot(ino,&node),&node,seen);
+    if(slot<0)
     {
-	retstat=-1;
-	free(block_buff);
-	log_msg("\nfailed open on permissions\n");
-	return retstat;
+	    fuse_reply_err(req,-slot);
+	    return;
     }
-*/
-    free(block_buff);
+    int retstat=file_write(slot,&node,buf,size,off);
+    file_unhold(slot,0);
+    if(retstat<0)
+    {
+	    fuse_reply_err(req,-retstat);
+	    return;
+    }
+    kernel_did(slot,&node);
+    fuse_reply_write(req,retstat);
+}
 
-    log_msg("\nopened file\n");
-    return retstat;
+/**
+ * Write data made available in a buffer
+ */
+void sfs_ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv, off_t off, struct fuse_file_info *fi)
+{
+    log_msg("\nsfs_ll_write_buf(ino=%lu, size=%d, offset=%lld)\n", ino, fuse_buf_size(bufv), off);
+    inode node;
+    unsigned long seen=file_seen();
+    int slot=file_hold(ll_slot(ino,&node),&node,seen);
+    if(slot<0)
+    {
+	    fuse_reply_err(req,-slot);
+	    return;
+    }
+    int retstat=file_write_buf(slot,&node,bufv,off);
+    file_unhold(slot,0);
+    if(retstat<0)
+    {
+	    fuse_reply_err(req,-retstat);
+	    return;
+    }
+    kernel_did(slot,&node);
+    fuse_reply_write(req,retstat);
 }
 
-/** Release an open file
- *
- * Release is called when there are no more references to an open
- * file: all file descriptors are closed and all memory mappings
- * are unmapped.
- *
- * For every open() call there will be exactly one release() call
- * with the same flags and file descriptor.  It is possible to
- * have a file opened more than once, in which case only the last
- * release will mean, that no more reads/writes will happen on the
- * file.  The return value of release is ignored.
- *
- * Changed in version 2.2
+/**
+ * Open a directory
  */
-int sfs_release(const char *path, struct fuse_file_info *fi)
+void sfs_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-    int retstat = 0;
-    log_msg("\nsfs_release(path=\"%s\", fi=0x%08x)\n",path, fi);
-    //nothing to be done  
-    log_msg("\nrelease finished\n");
-    return retstat;
+    if(ino!=FUSE_ROOT_ID)
+    {
+	    fuse_reply_err(req,ENOTDIR);
+	    return;
+    }
+    fuse_reply_open(req,fi);
 }
 
-/** Read data from an open file
- *
- * Read should return exactly the number of bytes requested except
- * on EOF or error, otherwise the rest of the data will be
- * substituted with zeroes.  An exception to this is when the
- * 'direct_io' mount option is specified, in which case the return
- * value of the read system call will reflect the return value of
- * this operation.
+void ll_add_dirent(fuse_req_t req, char** buf, size_t* size, const char* name, fuse_ino_t ino)
+{
+	//append one entry to a growing directory listing
+	struct stat statbuf;
+	memset(&statbuf,0,sizeof(struct stat));
+	statbuf.st_ino=ino;
+	statbuf.st_mode=(ino==FUSE_ROOT_ID) ? S_IFDIR : S_IFREG;
+	size_t old_size=*size;
+	*size+=fuse_add_direntry(req,NULL,0,name,NULL,0);
+	*buf=realloc(*buf,*size);
+	fuse_add_direntry(req,*buf+old_size,*size-old_size,name,&statbuf,*size);
+}
+
+/**
+ * Read directory
  *
- * Changed in version 2.2
+ * The whole listing is built on every call and the part past off
+ * handed back, the root never holds more than NUM_NODES files.
  */
-int sfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+void sfs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
 {
-    int retstat = 0;
-    log_msg("\nsfs_read(path=\"%s\", buf=0x%08x, size=%d, offset=%lld, fi=0x%08x)\n",path, buf, size, offset, fi);
-    int i;
+    log_msg("\nsfs_ll_readdir(ino=%lu, size=%d, offset=%lld)\n", ino, size, off);
+    if(ino!=FUSE_ROOT_ID)
+    {
+	    fuse_reply_err(req,ENOTDIR);
+	    return;
+    }
+    char* list=NULL;
+    size_t list_size=0;
+    ll_add_dirent(req,&list,&list_size,".",FUSE_ROOT_ID);
+    ll_add_dirent(req,&list,&list_size,"..",FUSE_ROOT_ID);
     superblock sb;
-    inode node;
-    char* block_buff=malloc(BLOCK_SIZE);
-    block_read(0,block_buff);
+    char* block_buff=block_get();
+    fs_block_read(0,block_buff);
     memcpy(&sb,block_buff,sizeof(superblock));
-    //check for existance of file
+    int i;
+    inode node;
     for(i=0;i<NUM_NODES;i++)
     {
 	if(sb.node_list[i]=='1')
 	{
-		block_read(i+NODE_STRT,block_buff);
-		memcpy(&node,block_buff,sizeof(inode));
-		if(strcmp(node.name,&(path[1]))==0)
-		{
-			node.access=time(NULL);
-			memcpy(block_buff,&node,sizeof(inode));
-			block_write(i+NODE_STRT,block_buff);
-			break;
-		}
+	    get_inode(i,&node,block_buff);
+	    if(node.link_count>0)
+	    {
+		ll_add_dirent(req,&list,&list_size,node.name,SLOT_INO(i));
+	    }
 	}
     }
-    if(i==NUM_NODES)
-    {
-	    log_msg("\ndid not find file\n");
-	    retstat=-ENOENT;
-	    free(block_buff);
-	    return retstat;
-    }
-    //read from the inode
-    size_t count=0;
-    int start_block=((int)offset)/BLOCK_SIZE;
-    int start_index=((int)offset)%BLOCK_SIZE;
-    int from;
-    while(1)
-    {
-    	//find block to start reading at
-    	if(start_block>(32+128*64))
-    	{
-		//read from double indirect (block #s 8224-24607)
-		block_read(node.double_indirect,block_buff);
-		indirect indir;
-		memcpy(&indir,block_buff,sizeof(indirect));
-		int indir_index=indir.blocks[(start_block-8224)/128];
-		block_read(indir_index,block_buff);
-		memcpy(&indir,block_buff,sizeof(indirect));
-		from=indir.blocks[(start_block-8224)%128];
-	}
-    	else if(start_block>31)
-    	{
-		//read from single indirects (block #s 32-8223)
-		int indir_index=node.single_indirect[(start_block-32)/128];
-		block_read(indir_index,block_buff);
-		indirect indir;
-		memcpy(&indir,block_buff,sizeof(indirect));
-		from=indir.blocks[(start_block-32)%128];	
-    	}
-    	else
-    	{
-		//read from direct (block #s 0-31)
-		from=node.direct[start_block];
-    	}
-	log_msg("\nreading from block %d\n",from);
-	if(from==-1)
-	{
-		//trying to read further than it owns
-		return -ESPIPE;
-	}
-	block_read(from,block_buff);
-	//read from that block into buffer
-	if(count==0)
-	{
-		log_msg("\nfile size=%d\n",node.size);
-		if(size>node.size&&node.size<=BLOCK_SIZE)
-		{
-			//trying to read more than what is there	
-			memcpy(buf,&(block_buff[start_index]),node.size);
-			count=node.size;
-			log_msg("\ncount is %d\n",count);
-			break;
-		} 
-		else if(size<=BLOCK_SIZE)
-		{
-			//total request is less than a block
-			memcpy(buf,&(block_buff[start_index]),size);
-			count=size;
-			break;
-		}
-		else
-		{
-			//total request is larger than a block
-			memcpy(buf,&(block_buff[start_index]),BLOCK_SIZE-start_index);
-			count+=BLOCK_SIZE-start_index;
-			start_block++;
-		}
-	}
-	else
-	{
-		log_msg("\ntrying to read more\n");
-		if(size>node.size&&(node.size-count)<=BLOCK_SIZE)
-		{
-			log_msg("\n-1\n");
-			//trying to read more than what is there and at the end
-			memcpy(&(buf[count]),block_buff,node.size-count);
-			count+=node.size-count;
-			break;
-		}
-		else if(size-count<=BLOCK_SIZE)
-		{
-			log_msg("\n-3\n");
-			//less than a block to go
-			memcpy(&(buf[count]),block_buff,size-count);
-			count+=(size-count);
-			break;
-		}
-		else
-		{
-			log_msg("\n-3\n");
-			//whole block is requested and more to go
-			memcpy(&(buf[count]),block_buff,BLOCK_SIZE);
-			count+=BLOCK_SIZE;
-			start_block++;
-		}
-	}
-    } 
-    log_msg("\ncount is %d\n",count); 
-    for(;count<size;count++)
+    block_put(block_buff);
+    if(off<(off_t)list_size)
     {
-	//pad if needed
-	buf[count]='\0';
+	    size_t len=list_size-off;
+	    fuse_reply_buf(req,list+off,(len<size) ? len : size);
     }
-    
-    log_msg("\ncount is %d\n",count); 
-    log_msg("\nbuf=%s\n",buf);
-    if(retstat!=-EOF)
+    else
     {
-    	retstat=count;
+	    fuse_reply_buf(req,NULL,0);
     }
-    log_msg("\nread finished\n");
-    return retstat;
+    free(list);
 }
 
-/** Write data to an open file
- *
- * Write should return exactly the number of bytes requested
- * except on error.  An exception to this is when the 'direct_io'
- * mount option is specified (see read operation).
- *
- * Changed in version 2.2
+/**
+ * Release an open directory
  */
-int sfs_write(const char *path, const char *buf, size_t size, off_t offset,struct fuse_file_info *fi)
+void sfs_ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-    int retstat = 0;
-    log_msg("\nsfs_write(path=\"%s\", buf=0x%08x, size=%d, offset=%lld, fi=0x%08x)\n",path, buf, size, offset, fi);
+    fuse_reply_err(req,0);
+}
 
-    //check if file exists
-    int i;
-    superblock sb;
+/**
+ * Ioctl
+ *
+ * Only the restricted form is supported: the kernel has already
+ * copied in _IOC_SIZE(cmd) bytes for _IOC_WRITE commands and will
+ * copy the same amount back out for _IOC_READ ones.
+ */
+void sfs_ll_ioctl(fuse_req_t req, fuse_ino_t ino, int cmd, void *arg, struct fuse_file_info *fi, unsigned flags, const void *in_buf, size_t in_bufsz, size_t out_bufsz)
+{
+    log_msg("\nsfs_ll_ioctl(ino=%lu, cmd=0x%08x, flags=0x%08x)\n", ino, cmd, flags);
+    if(flags&FUSE_IOCTL_COMPAT)
+    {
+	    fuse_reply_err(req,ENOSYS);
+	    return;
+    }
+    if((unsigned int)cmd==SFS_IOC_STATS_RESET)
+    {
+	    stats_reset();
+	    fuse_reply_ioctl(req,0,NULL,0);
+	    return;
+    }
     inode node;
-    char* block_buff=malloc(BLOCK_SIZE);
-    block_read(0,block_buff);
-    memcpy(&sb,block_buff,sizeof(superblock));
-    //check for existance of file
-    for(i=0;i<NUM_NODES;i++)
+    unsigned long seen=file_seen();
+    int slot=ioctl_hold(ll_slot(ino,&node),&node,(unsigned int)cmd,seen);
+    if(slot<0)
     {
-	if(sb.node_list[i]=='1')
-	{
-		block_read(i+NODE_STRT,block_buff);
-		memcpy(&node,block_buff,sizeof(inode));
-		if(strcmp(node.name,&(path[1]))==0)
-		{
-			node.modify=time(NULL);
-			break;
-		}
-	}
+	    fuse_reply_err(req,-slot);
+	    return;
     }
-    if(i==NUM_NODES)
+    size_t size=_IOC_SIZE((unsigned int)cmd);
+    char* data=calloc(1,size+1);
+    memcpy(data,in_buf,(in_bufsz<size) ? in_bufsz : size);
+    int retstat=file_ioctl(slot,&node,(unsigned int)cmd,data);
+    ioctl_unhold(slot,(unsigned int)cmd);
+    if(retstat<0)
     {
-	    log_msg("\ndid not find file\n");
-	    retstat=-ENOENT;
-	    free(block_buff);
-	    return retstat;
+	    fuse_reply_err(req,-retstat);
     }
-    log_msg("\nbuf is %s\n",buf);
-    size_t count=0;
-    int start_block=((int)offset)/BLOCK_SIZE;
-    int start_index=((int)offset)%BLOCK_SIZE;
-    int from;
-    while(count<size)
-    {
-    	//find block to start writing to
-    	if(start_block>(32+128*64))
-    	{
-		//write to double indirect (block #s 8224-24607)
-		if(node.double_indirect==-1)
-		{
-			//find a double indirect
-			node.double_indirect=find_d_indirect();
-			if(node.double_indirect==-1)
-			{
-				//fs is full
-				memcpy(block_buff,&node,sizeof(inode));
-				block_write(i+NODE_STRT,block_buff);
-				return -ENOSPC;
-			}
-		}
-		block_read(node.double_indirect,block_buff);
-		indirect indir;
-		memcpy(&indir,block_buff,sizeof(indirect));
-		int indir_index=indir.blocks[(start_block-8224)/128];
-		if(indir_index==-1)
-		{
-			//find an indirect
-			indir_index=find_indirect();
-			if(indir_index==-1)
-			{
-				//fs is full
-				memcpy(block_buff,&node,sizeof(inode));
-				block_write(i+NODE_STRT,block_buff);
-				return -ENOSPC;
-			}
-			indir.blocks[(start_block-8224)/128]=indir_index;
-			memcpy(block_buff,&indir,sizeof(indirect));
-			block_write(node.double_indirect,block_buff);
-		}
-		block_read(indir_index,block_buff);
-		memcpy(&indir,block_buff,sizeof(indirect));
-		from=indir.blocks[(start_block-8224)%128];
-		if(from==-1)
-		{
-			//try to find free block
-			from=find_direct();
-			if(from==-1)
-			{
-				//fs is full
-				memcpy(block_buff,&node,sizeof(inode));
-				block_write(i+NODE_STRT,block_buff);
-				return -ENOSPC;
-			}
-			indir.blocks[(start_block-32)%128]=from;
-			memcpy(block_buff,&indir,sizeof(indirect));
-			block_write(indir_index,block_buff);	
-		}
-	}
-    	else if(start_block>31)
-    	{
-		//write to single indirects (block #s 32-8223)
-		int indir_index=node.single_indirect[(start_block-32)/128];
-		if(indir_index==-1)
-		{
-			//find an indirect
-			indir_index=find_indirect();
-			if(indir_index==-1)
-			{
-				//fs is full
-				memcpy(block_buff,&node,sizeof(inode));
-				block_write(i+NODE_STRT,block_buff);
-				return -ENOSPC;
-			}
-			node.single_indirect[(start_block-32)/128]=indir_index;
-		}
-		block_read(indir_index,block_buff);
-		indirect indir;
-		memcpy(&indir,block_buff,sizeof(indirect));
-		from=indir.blocks[(start_block-32)%128];	
-		if(from==-1)
-		{
-			//try to find free block
-			from=find_direct();
-			if(from==-1)
-			{
-				//fs is full
-				memcpy(block_buff,&node,sizeof(inode));
-				block_write(i+NODE_STRT,block_buff);
-				return -ENOSPC;
-			}
-			indir.blocks[(start_block-32)%128]=from;
-			memcpy(block_buff,&indir,sizeof(indirect));
-			block_write(indir_index,block_buff);	
-		}
-    	}
-    	else
-    	{
-		//write to directs (block #s 0-31)
-		from=node.direct[start_block];
-		if(from==-1)
-		{
-			//try to find free block
-			from=find_direct();
-			if(from==-1)
-			{
-				//system out of memory
-				memcpy(block_buff,&node,sizeof(inode));
-				block_write(i+NODE_STRT,block_buff);
-				return -ENOSPC;
-			}
-			node.direct[start_block]=from;
-		}
-    	}
-	log_msg("\nwriting to block %d\n",from);
-	block_read(from,block_buff);
-	//write to that block
-	if((size-count)>=BLOCK_SIZE)
-	{
-		//writing at least an entire block
-		memcpy(&(block_buff[start_index]),&(buf[count]),BLOCK_SIZE);
-		count+=BLOCK_SIZE;
-		block_write(from,block_buff);
-	}
-	else
-	{
-		//less than a block to write
-		memcpy(&(block_buff[start_index]),&(buf[count]),size-count);
-		count+=size-count;
-		block_write(from,block_buff);
-		break;
-	}
-	start_index=0;
-	start_block++;
-    }  
-    node.size+=count;
-    memcpy(block_buff,&node,sizeof(inode));
-    block_write(i+NODE_STRT,block_buff);
-    retstat=count;
+    else
+    {
+	    fuse_reply_ioctl(req,retstat,data,(out_bufsz<size) ? out_bufsz : size);
+    }
+    free(data);
+    if((unsigned int)cmd==SFS_IOC_CLONE_RANGE||(unsigned int)cmd==SFS_IOC_COPY_RANGE)
+    {
+	    //blocks were swapped under the file without the kernel writing them
+	    kernel_changed(slot);
+	    kernel_inval(slot);
+    }
+}
 
-    log_msg("\nwrite finished\n");
-    return retstat;
+//same for the low-level handlers, which reply themselves and so never fail as far as these know
+#define TIMED_LL(op, name, ino, offset, size, fi, call) op_timer t; op_start(&t,(name),(ino),(offset),(size),(fi)); call; op_done((op),&t,0)
+
+void timed_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	TIMED_LL(OP_LOOKUP,name,0,0,0,NULL,sfs_ll_lookup(req,parent,name));
 }
 
+void timed_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long count)
+{
+	TIMED_LL(OP_FORGET,NULL,ino,0,count,NULL,sfs_ll_forget(req,ino,count));
+}
 
-/** Create a directory */
-int sfs_mkdir(const char *path, mode_t mode)
+void timed_ll_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets)
 {
-    int retstat = 0;
-    log_msg("\nsfs_mkdir(path=\"%s\", mode=0%3o)\n",
-	    path, mode);
-   
-    
-    return retstat;
+	TIMED_LL(OP_FORGET,NULL,0,0,count,NULL,sfs_ll_forget_multi(req,count,forgets));
 }
 
+void timed_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	TIMED_LL(OP_GETATTR,NULL,ino,0,0,NULL,sfs_ll_getattr(req,ino,fi));
+}
 
-/** Remove a directory */
-int sfs_rmdir(const char *path)
+void timed_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi)
 {
-    int retstat = 0;
-    log_msg("sfs_rmdir(path=\"%s\")\n",
-	    path);
-    
-    
-    return retstat;
+	TIMED_LL(OP_CREATE,name,0,0,mode,fi,sfs_ll_create(req,parent,name,mode,fi));
 }
 
+void timed_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	TIMED_LL(OP_UNLINK,name,0,0,0,NULL,sfs_ll_unlink(req,parent,name));
+}
 
-/** Open directory
- *
- * This method should check if the open operation is permitted for
- * this  directory
- *
- * Introduced in version 2.3
- */
-int sfs_opendir(const char *path, struct fuse_file_info *fi)
+void timed_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-    int retstat = 0;
-    log_msg("\nsfs_opendir(path=\"%s\", fi=0x%08x)\n",
-	  path, fi);
-    
-    
-    return retstat;
+	TIMED_LL(OP_OPEN,NULL,ino,0,fi->flags,fi,sfs_ll_open(req,ino,fi));
 }
 
-/** Read directory
- *
- * This supersedes the old getdir() interface.  New applications
- * should use this.
- *
- * The filesystem may choose between two modes of operation:
- *
- * 1) The readdir implementation ignores the offset parameter, and
- * passes zero to the filler function's offset.  The filler
- * function will not return '1' (unless an error happens), so the
- * whole directory is read in a single readdir operation.  This
- * works just like the old getdir() method.
- *
- * 2) The readdir implementation keeps track of the offsets of the
- * directory entries.  It uses the offset parameter and always
- * passes non-zero offset to the filler function.  When the buffer
- * is full (or an error happens) the filler function will return
- * '1'.
- *
- * Introduced in version 2.3
- */
-int sfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
-	       struct fuse_file_info *fi)
+void timed_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-    int retstat = 0;
-    
-    superblock sb;
-    char* block_buff = malloc(BLOCK_SIZE);
-    block_read(0,block_buff);
-    memcpy(&sb,block_buff,sizeof(superblock));
+	TIMED_LL(OP_RELEASE,NULL,ino,0,0,fi,sfs_ll_release(req,ino,fi));
+}
 
-    int i;
-    inode node;
-    for(i=0; i<NUM_NODES; i++)
-    {
-	if(sb.node_list[i] == '1')
-	{
-	    block_read(i+NODE_STRT, block_buff);
-	    memcpy(&node, block_buff, sizeof(inode));
-	    if(filler(buf, node.name, NULL, 0) != 0)
-	    {
-		log_msg("\nBuffer is full!\n");
-		return -ENOMEM;
-	    }
-	}
-    }
-    free(block_buff);	
-   
-    return retstat;
+void timed_ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	TIMED_LL(OP_FLUSH,NULL,ino,0,0,fi,sfs_ll_flush(req,ino,fi));
 }
 
-/** Release directory
- *
- * Introduced in version 2.3
- */
-int sfs_releasedir(const char *path, struct fuse_file_info *fi)
+void timed_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi)
 {
-    int retstat = 0;
+	TIMED_LL(OP_FSYNC,NULL,ino,0,datasync,fi,sfs_ll_fsync(req,ino,datasync,fi));
+}
 
-    
-    return retstat;
+void timed_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
+{
+	TIMED_LL(OP_READ,NULL,ino,off,size,fi,sfs_ll_read(req,ino,size,off,fi));
 }
 
-struct fuse_operations sfs_oper = {
-  .init = sfs_init,
-  .destroy = sfs_destroy,
+void timed_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t off, struct fuse_file_info *fi)
+{
+	TIMED_LL(OP_WRITE,NULL,ino,off,size,fi,sfs_ll_write(req,ino,buf,size,off,fi));
+}
+
+void timed_ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv, off_t off, struct fuse_file_info *fi)
+{
+	TIMED_LL(OP_WRITE,NULL,ino,off,fuse_buf_size(bufv),fi,sfs_ll_write_buf(req,ino,bufv,off,fi));
+}
+
+void timed_ll_ioctl(fuse_req_t req, fuse_ino_t ino, int cmd, void *arg, struct fuse_file_info *fi, unsigned flags, const void *in_buf, size_t in_bufsz, size_t out_bufsz)
+{
+	TIMED_LL(OP_IOCTL,NULL,ino,0,(unsigned int)cmd,fi,sfs_ll_ioctl(req,ino,cmd,arg,fi,flags,in_buf,in_bufsz,out_bufsz));
+}
+
+void timed_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	TIMED_LL(OP_OPENDIR,NULL,ino,0,0,fi,sfs_ll_opendir(req,ino,fi));
+}
+
+void timed_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
+{
+	TIMED_LL(OP_READDIR,NULL,ino,off,size,fi,sfs_ll_readdir(req,ino,size,off,fi));
+}
+
+void timed_ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	TIMED_LL(OP_RELEASEDIR,NULL,ino,0,0,fi,sfs_ll_releasedir(req,ino,fi));
+}
 
-  .getattr = sfs_getattr,
-  .create = sfs_create,
-  .unlink = sfs_unlink,
-  .open = sfs_open,
-  .release = sfs_release,
-  .read = sfs_read,
-  .write = sfs_write,
+struct fuse_lowlevel_ops sfs_ll_oper = {
+  .init = sfs_ll_init,
+  .destroy = sfs_ll_destroy,
 
-  .rmdir = sfs_rmdir,
-  .mkdir = sfs_mkdir,
+  .lookup = timed_ll_lookup,
+  .forget = timed_ll_forget,
+  .forget_multi = timed_ll_forget_multi,
+  .getattr = timed_ll_getattr,
+  .create = timed_ll_create,
+  .unlink = timed_ll_unlink,
+  .open = timed_ll_open,
+  .release = timed_ll_release,
+  .flush = timed_ll_flush,
+  .fsync = timed_ll_fsync,
+  .read = timed_ll_read,
+  .write = timed_ll_write,
+  .write_buf = timed_ll_write_buf,
+  .ioctl = timed_ll_ioctl,
 
-  .opendir = sfs_opendir,
-  .readdir = sfs_readdir,
-  .releasedir = sfs_releasedir
+  .opendir = timed_ll_opendir,
+  .readdir = timed_ll_readdir,
+  .releasedir = timed_ll_releasedir
 };
 
+int sfs_ll_main(struct fuse_args *args)
+{
+    //what fuse_main does, but with a low-level session
+    char *mountpoint;
+    int multithreaded, foreground;
+    int err = -1;
+    struct fuse_chan *ch;
+
+    if (fuse_parse_cmdline(args, &mountpoint, &multithreaded, &foreground) == -1)
+	return 1;
+    if ((ch = fuse_mount(mountpoint, args)) != NULL) {
+	struct fuse_session *se = fuse_lowlevel_new(args, &sfs_ll_oper, sizeof(sfs_ll_oper), sfs_data);
+	if (se != NULL) {
+	    if (fuse_set_signal_handlers(se) != -1) {
+		fuse_session_add_chan(se, ch);
+		sfs_chan = ch;
+		sfs_multithreaded = multithreaded;
+		fuse_daemonize(foreground);
+		err = multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+		fuse_remove_signal_handlers(se);
+		sfs_chan = NULL;
+		fuse_session_remove_chan(ch);
+	    }
+	    fuse_session_destroy(se);
+	}
+	fuse_unmount(mountpoint, ch);
+    }
+    free(mountpoint);
+
+    return err ? 1 : 0;
+}
+
 void sfs_usage()
 {
     fprintf(stderr, "usage:  sfs [FUSE and mount options] diskFile mountPoint\n");
+    fprintf(stderr, "sfs options:\n");
+    fprintf(stderr, "    -o block_size=N    block size used when formatting a new diskFile\n");
+    fprintf(stderr, "                       (power of two, %d to %d, default %d)\n", MIN_BLOCK_SIZE, MAX_BLOCK_SIZE, DEF_BLOCK_SIZE);
+    fprintf(stderr, "    -o lowlevel        use the low-level inode api instead of paths\n");
+    fprintf(stderr, "    -o entry_timeout=T, attr_timeout=T, negative_timeout=T\n");
+    fprintf(stderr, "                       seconds the kernel may cache names, attributes and\n");
+    fprintf(stderr, "                       missing names (default %g)\n", DEF_TIMEOUT);
+    fprintf(stderr, "    -o o_direct        read and write diskFile with O_DIRECT, so blocks aren't\n");
+    fprintf(stderr, "                       cached by the host as well as by the kernel for sfs\n");
+    fprintf(stderr, "    -o stripe_width=N  blocks in a row on each disk file when formatting a volume\n");
+    fprintf(stderr, "                       striped over several (default %d)\n", DEF_STRIPE_WIDTH);
+    fprintf(stderr, "    -o trace=FILE      record every call in FILE (give a full path), for sfs_replay\n");
+    fprintf(stderr, "    -o compress        compress new files when they are flushed, %d KB (but at\n", PACK_BYTES/1024);
+    fprintf(stderr, "                       least 4 blocks) at a time; SFS_IOC_SET_FLAGS does it\n");
+    fprintf(stderr, "                       for single files\n");
+    fprintf(stderr, "    -o dedup           keep a fingerprint of every whole block written, and share\n");
+    fprintf(stderr, "                       the block holding the same data instead of writing another\n");
+    fprintf(stderr, "    -o verify=MODE     check blocks against their CRC32C when they are read: none,\n");
+    fprintf(stderr, "                       meta (inodes, indirect blocks and allocation maps, the\n");
+    fprintf(stderr, "                       default) or full (file data as well); checksums are\n");
+    fprintf(stderr, "                       saved at unmount, a crash drops those of file data\n");
+    fprintf(stderr, "diskFile can be a comma separated list of up to %d files to stripe over, given\n", MAX_MEMBERS);
+    fprintf(stderr, "in the same order every time\n");
+    fprintf(stderr, "/.sfs_stats in the mount reads as per-operation call counts, latencies and\n");
+    fprintf(stderr, "block I/O, it doesn't show up in listings\n");
     abort();
 }
 
+#ifndef SFS_NO_MAIN
 int main(int argc, char *argv[])
 {
     int fuse_stat;
-    struct sfs_state *sfs_data;
     
     // sanity checking on the command line
     if ((argc < 3) || (argv[argc-2][0] == '-') || (argv[argc-1][0] == '-'))
@@ -1162,12 +5915,38 @@ int main(int argc, char *argv[])
     argv[argc-1] = NULL;
     argc--;
     
+    // Pull out our own options, the rest goes to fuse
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    if (fuse_opt_parse(&args, &sfs_opts, sfs_opt_spec, NULL) == -1)
+	sfs_usage();
+    if ((sfs_opts.block_size < MIN_BLOCK_SIZE) || (sfs_opts.block_size > MAX_BLOCK_SIZE) ||
+	((sfs_opts.block_size & (sfs_opts.block_size - 1)) != 0)) {
+	fprintf(stderr, "bad block_size %d\n", sfs_opts.block_size);
+	sfs_usage();
+    }
+    if (!sfs_opts.lowlevel) {
+	// the high-level library does the same caching itself when asked to, auto_cache keeps
+	// cached pages across opens as long as the modify time and size haven't changed
+	char cache_opts[256];
+	snprintf(cache_opts, sizeof(cache_opts), "-oentry_timeout=%g,attr_timeout=%g,negative_timeout=%g,auto_cache",
+		 sfs_opts.entry_timeout, sfs_opts.attr_timeout, sfs_opts.negative_timeout);
+	fuse_opt_add_arg(&args, cache_opts);
+    }
+    
     sfs_data->logfile = log_open();
     
     // turn over control to fuse
-    fprintf(stderr, "about to call fuse_main, %s \n", sfs_data->diskfile);
-    fuse_stat = fuse_main(argc, argv, &sfs_oper, sfs_data);
-    fprintf(stderr, "fuse_main returned %d\n", fuse_stat);
+    if (sfs_opts.lowlevel) {
+	fprintf(stderr, "about to call sfs_ll_main, %s \n", sfs_data->diskfile);
+	fuse_stat = sfs_ll_main(&args);
+	fprintf(stderr, "sfs_ll_main returned %d\n", fuse_stat);
+    } else {
+	fprintf(stderr, "about to call fuse_main, %s \n", sfs_data->diskfile);
+	fuse_stat = fuse_main(args.argc, args.argv, &sfs_oper, sfs_data);
+	fprintf(stderr, "fuse_main returned %d\n", fuse_stat);
+    }
+    fuse_opt_free_args(&args);
     
     return fuse_stat;
 }
+#endif
@@ -0,0 +1,462 @@
+/*
+  Simple File System
+
+  Benchmark of the filesystem itself, without a mount.  sfs.c is built
+  into it (with SFS_NO_MAIN, so that it leaves its own main out) and the
+  handlers in sfs_oper are called directly on a scratch disk file, so
+  neither fuse nor the kernel add anything to what gets measured.
+
+  Scenarios, picked with -s as a comma separated list (default all):
+
+    meta   rounds of creating, stat-ing and unlinking a directory full of files
+    seq    writing a file from start to end and reading it back, at several
+           request sizes
+    rand   writing and reading a written file at random places, at several
+           request sizes
+    dir    listing a directory full of files
+
+  For every step it prints the operations per second, latency percentiles
+  in microseconds and the disk blocks read and written per operation
+  (counted by fs_block_read and fs_block_write, so the splice paths of
+  read_buf and write_buf aren't covered).
+
+  usage: sfs_bench [-b block_size] [-f file_MB] [-n ops] [-d] [-v verify] [-s scenarios] [diskFile]
+
+  Without a diskFile a temporary one is made and removed at the end.  A
+  diskFile that is given is overwritten; it can be a comma separated list
+  like the mount takes.
+
+  build: gcc -O2 -pthread -o sfs_bench sfs_bench.c `pkg-config fuse --cflags --libs`
+  with params.h, block.h and log.h on the include path.
+
+*/
+
+#define SFS_NO_MAIN
+#include "sfs.c"
+
+#include <time.h>
+
+#define NUM_META 100 //files created in each round of meta, and listed by dir
+#define MAX_SIZES 3
+
+int io_sizes[MAX_SIZES]={4096,65536,1048576}; //request sizes of seq and rand
+
+struct bench_options
+{
+	int ops; //operations timed in each step of meta, rand and dir
+	long file_size; //bytes in the file seq and rand work on
+	const char* scenarios;
+};
+
+struct bench_options bench_opts={10000,64L<<20,"meta,seq,rand,dir"};
+
+typedef struct _step
+{
+	//what one step of a scenario took, possibly over several turns
+	const char* name;
+	double* lat; //seconds each operation took
+	int nlat;
+	int max_lat;
+	double elapsed;
+	unsigned long reads; //disk blocks read
+	unsigned long writes;
+	double started; //when the current turn started
+	unsigned long reads_at;
+	unsigned long writes_at;
+} step;
+
+step* cur; //the step being timed, NULL while setting things up
+
+char* io_buff;
+
+void log_conn(struct fuse_conn_info* conn)
+{
+	//log.c finds the log file through the fuse context, and there is none here
+}
+
+double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (double)ts.tv_sec+(double)ts.tv_nsec/1e9;
+}
+
+void bench_fail(const char* what, int err)
+{
+	fprintf(stderr,"sfs_bench: %s failed in %s: %s\n",what,(cur!=NULL) ? cur->name : "setup",strerror(-err));
+	exit(EXIT_FAILURE);
+}
+
+//run one handler call, timing it when in a step; any error ends the benchmark
+#define OP(call) do { double t0=now(); int r=(call); if(cur!=NULL&&cur->nlat<cur->max_lat) { cur->lat[cur->nlat++]=now()-t0; } if(r<0) { bench_fail(#call,r); } } while(0)
+
+void step_init(step* s, const char* name, int max_lat)
+{
+	memset(s,0,sizeof(step));
+	s->name=strdup(name);
+	s->max_lat=max_lat;
+	s->lat=malloc(max_lat*sizeof(double));
+	if(s->name==NULL||s->lat==NULL)
+	{
+		perror("sfs_bench");
+		exit(EXIT_FAILURE);
+	}
+}
+
+void step_resume(step* s)
+{
+	cur=s;
+	s->reads_at=blocks_read;
+	s->writes_at=blocks_written;
+	s->started=now();
+}
+
+void step_pause(step* s)
+{
+	s->elapsed+=now()-s->started;
+	s->reads+=blocks_read-s->reads_at;
+	s->writes+=blocks_written-s->writes_at;
+	cur=NULL;
+}
+
+int cmp_double(const void* a, const void* b)
+{
+	double x=*(const double*)a;
+	double y=*(const double*)b;
+	return (x>y)-(x<y);
+}
+
+double percentile(step* s, double p)
+{
+	int i=(int)(p*s->nlat);
+	if(i>=s->nlat)
+	{
+		i=s->nlat-1;
+	}
+	return s->lat[i]*1e6;
+}
+
+void step_report(step* s)
+{
+	if(s->nlat>0)
+	{
+		qsort(s->lat,s->nlat,sizeof(double),cmp_double);
+		printf("%-16s %8d %11.0f %8.1f %8.1f %8.1f %9.1f %9.1f %7.2f %7.2f\n",s->name,s->nlat,s->nlat/s->elapsed,
+			percentile(s,0.5),percentile(s,0.9),percentile(s,0.99),percentile(s,0.999),s->lat[s->nlat-1]*1e6,
+			(double)s->reads/s->nlat,(double)s->writes/s->nlat);
+	}
+	free((char*)s->name);
+	free(s->lat);
+}
+
+void bench_meta()
+{
+	char names[NUM_META][16];
+	struct fuse_file_info fi;
+	struct stat statbuf;
+	int rounds=(bench_opts.ops+NUM_META-1)/NUM_META;
+	step creates;
+	step getattrs;
+	step unlinks;
+	int i;
+	int j;
+	for(i=0;i<NUM_META;i++)
+	{
+		sprintf(names[i],"/meta%d",i);
+	}
+	step_init(&creates,"create",rounds*NUM_META);
+	step_init(&getattrs,"getattr",rounds*NUM_META);
+	step_init(&unlinks,"unlink",rounds*NUM_META);
+	for(j=0;j<rounds;j++)
+	{
+		step_resume(&creates);
+		for(i=0;i<NUM_META;i++)
+		{
+			memset(&fi,0,sizeof(fi));
+			OP(sfs_oper.create(names[i],S_IFREG|0644,&fi)+sfs_oper.release(names[i],&fi));
+		}
+		step_pause(&creates);
+		step_resume(&getattrs);
+		for(i=0;i<NUM_META;i++)
+		{
+			OP(sfs_oper.getattr(names[i],&statbuf));
+		}
+		step_pause(&getattrs);
+		step_resume(&unlinks);
+		for(i=0;i<NUM_META;i++)
+		{
+			OP(sfs_oper.unlink(names[i]));
+		}
+		step_pause(&unlinks);
+	}
+	step_report(&creates);
+	step_report(&getattrs);
+	step_report(&unlinks);
+}
+
+void write_all(const char* path, int size, struct fuse_file_info* fi)
+{
+	//fill the file up to file_size with requests of size bytes
+	long offset;
+	for(offset=0;offset<bench_opts.file_size;offset+=size)
+	{
+		OP(sfs_oper.write(path,io_buff,size,offset,fi));
+	}
+}
+
+void bench_seq()
+{
+	const char* path="/seq";
+	struct fuse_file_info fi;
+	char name[32];
+	step writes;
+	step reads;
+	int i;
+	for(i=0;i<MAX_SIZES;i++)
+	{
+		int size=io_sizes[i];
+		int ops=bench_opts.file_size/size;
+		long offset;
+		memset(&fi,0,sizeof(fi));
+		OP(sfs_oper.create(path,S_IFREG|0644,&fi));
+		sprintf(name,"seq write %dk",size/1024);
+		step_init(&writes,name,ops);
+		step_resume(&writes);
+		write_all(path,size,&fi);
+		step_pause(&writes);
+		sprintf(name,"seq read %dk",size/1024);
+		step_init(&reads,name,ops);
+		step_resume(&reads);
+		for(offset=0;offset<bench_opts.file_size;offset+=size)
+		{
+			OP(sfs_oper.read(path,io_buff,size,offset,&fi));
+		}
+		step_pause(&reads);
+		OP(sfs_oper.release(path,&fi));
+		OP(sfs_oper.unlink(path));
+		step_report(&writes);
+		step_report(&reads);
+	}
+}
+
+void bench_rand()
+{
+	const char* path="/rand";
+	struct fuse_file_info fi;
+	char name[32];
+	step writes;
+	step reads;
+	unsigned int seed=1;
+	int i;
+	int j;
+	memset(&fi,0,sizeof(fi));
+	OP(sfs_oper.create(path,S_IFREG|0644,&fi));
+	write_all(path,io_sizes[MAX_SIZES-1],&fi);
+	for(i=0;i<MAX_SIZES;i++)
+	{
+		int size=io_sizes[i];
+		long places=bench_opts.file_size/size;
+		//big requests move a lot more data each, don't let them run for ages
+		int ops=bench_opts.ops/(size/io_sizes[0]);
+		if(ops<16)
+		{
+			ops=16;
+		}
+		sprintf(name,"rand write %dk",size/1024);
+		step_init(&writes,name,ops);
+		step_resume(&writes);
+		for(j=0;j<ops;j++)
+		{
+			OP(sfs_oper.write(path,io_buff,size,(off_t)(rand_r(&seed)%places)*size,&fi));
+		}
+		step_pause(&writes);
+		sprintf(name,"rand read %dk",size/1024);
+		step_init(&reads,name,ops);
+		step_resume(&reads);
+		for(j=0;j<ops;j++)
+		{
+			OP(sfs_oper.read(path,io_buff,size,(off_t)(rand_r(&seed)%places)*size,&fi));
+		}
+		step_pause(&reads);
+		step_report(&writes);
+		step_report(&reads);
+	}
+	OP(sfs_oper.release(path,&fi));
+	OP(sfs_oper.unlink(path));
+}
+
+int dir_names;
+
+int count_names(void* buf, const char* name, const struct stat* stbuf, off_t off)
+{
+	dir_names++;
+	return 0;
+}
+
+void bench_dir()
+{
+	char names[NUM_META][16];
+	struct fuse_file_info fi;
+	step listing;
+	int i;
+	for(i=0;i<NUM_META;i++)
+	{
+		sprintf(names[i],"/dir%d",i);
+		memset(&fi,0,sizeof(fi));
+		OP(sfs_oper.create(names[i],S_IFREG|0644,&fi)+sfs_oper.release(names[i],&fi));
+	}
+	step_init(&listing,"readdir",bench_opts.ops);
+	step_resume(&listing);
+	for(i=0;i<bench_opts.ops;i++)
+	{
+		memset(&fi,0,sizeof(fi));
+		dir_names=0;
+		OP(sfs_oper.opendir("/",&fi)+sfs_oper.readdir("/",NULL,count_names,0,&fi)+sfs_oper.releasedir("/",&fi));
+		if(dir_names!=NUM_META)
+		{
+			fprintf(stderr,"sfs_bench: readdir found %d files, not %d\n",dir_names,NUM_META);
+			exit(EXIT_FAILURE);
+		}
+	}
+	step_pause(&listing);
+	step_report(&listing);
+	for(i=0;i<NUM_META;i++)
+	{
+		OP(sfs_oper.unlink(names[i]));
+	}
+}
+
+int picked(const char* scenario)
+{
+	//is scenario in the -s list
+	size_t len=strlen(scenario);
+	const char* s=bench_opts.scenarios;
+	while(s!=NULL)
+	{
+		if(strncmp(s,scenario,len)==0&&(s[len]==','||s[len]=='\0'))
+		{
+			return 1;
+		}
+		s=strchr(s,',');
+		if(s!=NULL)
+		{
+			s++;
+		}
+	}
+	return 0;
+}
+
+void sfs_bench_usage()
+{
+	fprintf(stderr, "usage:  sfs_bench [-b block_size] [-f file_MB] [-n ops] [-d] [-v verify] [-s scenarios] [diskFile]\n");
+	fprintf(stderr, "    -b block_size  block size to format with (default %d)\n", DEF_BLOCK_SIZE);
+	fprintf(stderr, "    -f file_MB     size of the file seq and rand work on (default %ld)\n", bench_opts.file_size>>20);
+	fprintf(stderr, "    -n ops         operations timed in each meta, rand and dir step (default %d)\n", bench_opts.ops);
+	fprintf(stderr, "    -d             read and write the disk file with O_DIRECT\n");
+	fprintf(stderr, "    -v verify      blocks checked against their checksums, none, meta (default) or full\n");
+	fprintf(stderr, "    -s scenarios   comma separated list of meta, seq, rand and dir (default all)\n");
+	fprintf(stderr, "diskFile is overwritten, without one a temporary file is used\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	int opt;
+	while((opt=getopt(argc,argv,"b:f:n:dv:s:"))!=-1)
+	{
+		switch(opt)
+		{
+			case 'b': sfs_opts.block_size=atoi(optarg); break;
+			case 'f': bench_opts.file_size=atol(optarg)<<20; break;
+			case 'n': bench_opts.ops=atoi(optarg); break;
+			case 'd': sfs_opts.o_direct=1; break;
+			case 'v':
+				sfs_opts.verify=(strcmp(optarg,"none")==0) ? VERIFY_NONE : (strcmp(optarg,"full")==0) ? VERIFY_FULL : VERIFY_META;
+				break;
+			case 's': bench_opts.scenarios=optarg; break;
+			default: sfs_bench_usage();
+		}
+	}
+	if(optind<argc-1||bench_opts.ops<1||bench_opts.file_size<io_sizes[MAX_SIZES-1]||
+		sfs_opts.block_size<MIN_BLOCK_SIZE||sfs_opts.block_size>MAX_BLOCK_SIZE||(sfs_opts.block_size&(sfs_opts.block_size-1))!=0)
+	{
+		sfs_bench_usage();
+	}
+
+	//a fresh disk file, so that every run starts from the same place
+	char tmp_name[]="/tmp/sfs_bench.XXXXXX";
+	char* diskfile=tmp_name;
+	if(optind==argc-1)
+	{
+		diskfile=argv[optind];
+		char* names=strdup(diskfile);
+		char* save;
+		char* name;
+		for(name=strtok_r(names,",",&save);name!=NULL;name=strtok_r(NULL,",",&save))
+		{
+			if(truncate(name,0)<0&&errno!=ENOENT)
+			{
+				perror(name);
+				return EXIT_FAILURE;
+			}
+		}
+		free(names);
+	}
+	else
+	{
+		int fd=mkstemp(tmp_name);
+		if(fd<0)
+		{
+			perror(tmp_name);
+			return EXIT_FAILURE;
+		}
+		close(fd);
+	}
+
+	sfs_data=calloc(1,sizeof(struct sfs_state));
+	io_buff=malloc(io_sizes[MAX_SIZES-1]);
+	if(sfs_data==NULL||io_buff==NULL)
+	{
+		perror("sfs_bench");
+		return EXIT_FAILURE;
+	}
+	sfs_data->diskfile=diskfile;
+	sfs_data->logfile=fopen("/dev/null","w");
+	//data that doesn't look like a hole or like anything else written
+	unsigned int seed=42;
+	int i;
+	for(i=0;i<io_sizes[MAX_SIZES-1];i++)
+	{
+		io_buff[i]=(char)rand_r(&seed);
+	}
+
+	struct fuse_conn_info conn;
+	memset(&conn,0,sizeof(conn));
+	sfs_oper.init(&conn);
+	printf("%d byte blocks, %ld MB file, %d ops\n",fs.block_size,bench_opts.file_size>>20,bench_opts.ops);
+	printf("%-16s %8s %11s %8s %8s %8s %9s %9s %7s %7s\n","step","ops","ops/s","p50 us","p90 us","p99 us","p99.9 us","max us","rd/op","wr/op");
+	if(picked("meta"))
+	{
+		bench_meta();
+	}
+	if(picked("seq"))
+	{
+		bench_seq();
+	}
+	if(picked("rand"))
+	{
+		bench_rand();
+	}
+	if(picked("dir"))
+	{
+		bench_dir();
+	}
+	sfs_oper.destroy(sfs_data);
+
+	if(diskfile==tmp_name)
+	{
+		unlink(tmp_name);
+	}
+	free(io_buff);
+	return 0;
+}
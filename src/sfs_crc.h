@@ -0,0 +1,231 @@
+/*
+  Simple File System
+
+  CRC32C (Castagnoli), the checksum kept for every block, shared by the
+  filesystem and sfs_fsck.  Computed with the crc32 instruction where the
+  cpu has one (SSE4.2 on x86-64, the CRC extension on ARMv8), and from
+  tables eight bytes at a time (slicing by 8) otherwise.  One crc32 takes
+  three cycles but a new one can start every cycle, so the instruction
+  version works on three CRC_STRIDE byte pieces at once and puts their
+  CRCs together with crc32c_shift.  crc32c_init picks one and has to be
+  called before anything else here is used.
+
+*/
+
+#ifndef _SFS_CRC_H_
+#define _SFS_CRC_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define CRC32C_POLY 0x82f63b78 //reflected
+#define CRC_STRIDE 256 //bytes in each of the pieces worked on at once, a power of two
+
+static uint32_t crc32c_table[8][256];
+static uint32_t crc32c_stride[4][256]; //crc32c_shift by CRC_STRIDE zero bytes, a byte at a time
+
+static uint32_t gf2_times(const uint32_t* mat, uint32_t vec)
+{
+	//multiply vec by the 32x32 bit matrix mat, over GF(2)
+	uint32_t sum=0;
+	for(;vec!=0;vec>>=1,mat++)
+	{
+		if(vec&1)
+		{
+			sum^=*mat;
+		}
+	}
+	return sum;
+}
+
+static void gf2_square(uint32_t* square, const uint32_t* mat)
+{
+	int n;
+	for(n=0;n<32;n++)
+	{
+		square[n]=gf2_times(mat,mat[n]);
+	}
+}
+
+static void crc32c_zeros(uint32_t zeros[4][256], size_t len)
+{
+	//tables for what appending len zero bytes, a power of two of them, does to a crc: start
+	//from the operator for one zero bit and square it until it covers len bytes
+	uint32_t op[2][32];
+	int n,cur=0;
+	op[0][0]=CRC32C_POLY;
+	for(n=1;n<32;n++)
+	{
+		op[0][n]=1u<<(n-1);
+	}
+	for(len*=8;len>1;len>>=1,cur^=1)
+	{
+		gf2_square(op[cur^1],op[cur]);
+	}
+	for(n=0;n<256;n++)
+	{
+		zeros[0][n]=gf2_times(op[cur],n);
+		zeros[1][n]=gf2_times(op[cur],n<<8);
+		zeros[2][n]=gf2_times(op[cur],n<<16);
+		zeros[3][n]=gf2_times(op[cur],(uint32_t)n<<24);
+	}
+}
+
+static inline uint32_t crc32c_shift(uint32_t crc)
+{
+	//crc of what crc was for, followed by CRC_STRIDE zero bytes.  The crc of a||b is then
+	//crc32c_shift(crc of a) ^ crc of b started from 0, when b is CRC_STRIDE bytes
+	return crc32c_stride[0][crc&0xff]^crc32c_stride[1][(crc>>8)&0xff]^crc32c_stride[2][(crc>>16)&0xff]^crc32c_stride[3][crc>>24];
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const char* buf, size_t len)
+{
+	//eight table lookups per eight bytes, little endian words
+	const unsigned char* p=(const unsigned char*)buf;
+	for(;len>=8;len-=8,p+=8)
+	{
+		uint32_t lo=crc^((uint32_t)p[0]|(uint32_t)p[1]<<8|(uint32_t)p[2]<<16|(uint32_t)p[3]<<24);
+		crc=crc32c_table[7][lo&0xff]^crc32c_table[6][(lo>>8)&0xff]^crc32c_table[5][(lo>>16)&0xff]^crc32c_table[4][lo>>24]^
+			crc32c_table[3][p[4]]^crc32c_table[2][p[5]]^crc32c_table[1][p[6]]^crc32c_table[0][p[7]];
+	}
+	for(;len>0;len--,p++)
+	{
+		crc=crc32c_table[0][(crc^*p)&0xff]^(crc>>8);
+	}
+	return crc;
+}
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const char* buf, size_t len)
+{
+	uint64_t c0=crc,c1,c2,w0,w1,w2;
+	for(;len>=3*CRC_STRIDE;len-=3*CRC_STRIDE,buf+=2*CRC_STRIDE)
+	{
+		const char* end=buf+CRC_STRIDE;
+		c1=0;
+		c2=0;
+		for(;buf<end;buf+=8)
+		{
+			memcpy(&w0,buf,8);
+			memcpy(&w1,buf+CRC_STRIDE,8);
+			memcpy(&w2,buf+2*CRC_STRIDE,8);
+			c0=_mm_crc32_u64(c0,w0);
+			c1=_mm_crc32_u64(c1,w1);
+			c2=_mm_crc32_u64(c2,w2);
+		}
+		c0=crc32c_shift((uint32_t)c0)^c1;
+		c0=crc32c_shift((uint32_t)c0)^c2;
+	}
+	for(;len>=8;len-=8,buf+=8)
+	{
+		memcpy(&w0,buf,8);
+		c0=_mm_crc32_u64(c0,w0);
+	}
+	crc=(uint32_t)c0;
+	for(;len>0;len--,buf++)
+	{
+		crc=_mm_crc32_u8(crc,(unsigned char)*buf);
+	}
+	return crc;
+}
+
+#define CRC32C_HW() __builtin_cpu_supports("sse4.2")
+#define CRC32C_HW_NAME "sse4.2"
+
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+
+__attribute__((target("+crc")))
+static uint32_t crc32c_hw(uint32_t crc, const char* buf, size_t len)
+{
+	uint32_t c1,c2;
+	uint64_t w0,w1,w2;
+	for(;len>=3*CRC_STRIDE;len-=3*CRC_STRIDE,buf+=2*CRC_STRIDE)
+	{
+		const char* end=buf+CRC_STRIDE;
+		c1=0;
+		c2=0;
+		for(;buf<end;buf+=8)
+		{
+			memcpy(&w0,buf,8);
+			memcpy(&w1,buf+CRC_STRIDE,8);
+			memcpy(&w2,buf+2*CRC_STRIDE,8);
+			crc=__crc32cd(crc,w0);
+			c1=__crc32cd(c1,w1);
+			c2=__crc32cd(c2,w2);
+		}
+		crc=crc32c_shift(crc)^c1;
+		crc=crc32c_shift(crc)^c2;
+	}
+	for(;len>=8;len-=8,buf+=8)
+	{
+		memcpy(&w0,buf,8);
+		crc=__crc32cd(crc,w0);
+	}
+	for(;len>0;len--,buf++)
+	{
+		crc=__crc32cb(crc,(unsigned char)*buf);
+	}
+	return crc;
+}
+
+#define CRC32C_HW() ((getauxval(AT_HWCAP)&HWCAP_CRC32)!=0)
+#define CRC32C_HW_NAME "armv8 crc"
+
+#else
+#define CRC32C_HW() 0
+#define CRC32C_HW_NAME "none"
+#define crc32c_hw crc32c_sw
+#endif
+
+static uint32_t (*crc32c_fn)(uint32_t, const char*, size_t)=crc32c_sw;
+
+//returns the name of what computes it, for the log
+static const char* crc32c_init()
+{
+	int i,j;
+	for(i=0;i<256;i++)
+	{
+		uint32_t crc=i;
+		for(j=0;j<8;j++)
+		{
+			crc=(crc&1) ? (crc>>1)^CRC32C_POLY : crc>>1;
+		}
+		crc32c_table[0][i]=crc;
+	}
+	for(i=0;i<256;i++)
+	{
+		for(j=1;j<8;j++)
+		{
+			crc32c_table[j][i]=crc32c_table[0][crc32c_table[j-1][i]&0xff]^(crc32c_table[j-1][i]>>8);
+		}
+	}
+	crc32c_zeros(crc32c_stride,CRC_STRIDE);
+	if(CRC32C_HW())
+	{
+		crc32c_fn=crc32c_hw;
+		return CRC32C_HW_NAME;
+	}
+	crc32c_fn=crc32c_sw;
+	return "tables";
+}
+
+static inline uint32_t crc32c(const void* buf, size_t len)
+{
+	return ~crc32c_fn(~(uint32_t)0,(const char*)buf,len);
+}
+
+//checksum kept for a block, never 0 so that 0 can mean none is known
+static inline uint32_t block_csum(const void* buf, size_t len)
+{
+	uint32_t crc=crc32c(buf,len);
+	return (crc!=0) ? crc : 1;
+}
+
+#endif
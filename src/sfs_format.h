@@ -0,0 +1,167 @@
+/*
+  Simple File System
+
+  On-disk format, shared by the filesystem and sfs_fsck.  The macros
+  that depend on the block size use fs.block_size, which every program
+  including this keeps for the disk file it has open.
+
+*/
+
+#ifndef _SFS_FORMAT_H_
+#define _SFS_FORMAT_H_
+
+#include <sys/types.h>
+
+// ---------------------------------------------------------------------------------------------------------------------------------
+// |superBlock (1)| Inodes (128)| Indirect Blocks (192)| Double I. Blocks (1)| data block metadata (56) | indirect metadata (1) |
+// | checksums (228) | data blocks ...
+// ---------------------------------------------------------------------------------------------------------------------------------
+// units in () are meassured in disk blocks, whose size is picked when the disk file is formatted
+// and kept in the superblock.  Only the end of the data region depends on it: each data block
+// metadata block holds one entry per byte, so it covers block_size data blocks.
+// Only the superblock is written when formatting: metadata that was never written reads as
+// zeros, and counts as free.
+
+#define NUM_NODES 128
+#define NODE_STRT 1
+#define IBLK_STRT 129
+#define DIBLK 321
+#define MDATA_STRT 322
+#define NUM_MDATA 56
+#define INDIR_DATA 378
+#define CSUM_STRT 379
+#define NUM_CSUM 228
+#define DISK_STRT 607
+#define DISK_END (DISK_STRT+NUM_MDATA*fs.block_size)
+#define VER 994
+
+#define MIN_BLOCK_SIZE 1024
+#define MAX_BLOCK_SIZE 65536
+#define DEF_BLOCK_SIZE 4096
+
+#define MAX_MEMBERS 16 //disk files a volume can be striped over
+#define DEF_STRIPE_WIDTH 16 //blocks in a row on one member
+
+#define NUM_DIRECT 32 //direct pointers in an inode
+#define NUM_SINGLE 64 //single indirect pointers in an inode
+#define PTRS_PER_BLK (fs.block_size/(int)sizeof(int)) //block pointers held by one indirect block
+#define SINGLE_STRT NUM_DIRECT //first logical block mapped by single indirects
+#define DOUBLE_STRT (SINGLE_STRT+NUM_SINGLE*PTRS_PER_BLK) //first logical block mapped by the double indirect
+#define MAX_BLOCKS (DOUBLE_STRT+PTRS_PER_BLK*PTRS_PER_BLK) //largest file, in blocks
+#define CSUM_PER_BLK (fs.block_size/(int)sizeof(unsigned int)) //checksums held by one checksum block
+#define HAS_CSUM(b) ((b)>0&&((b)<CSUM_STRT||(b)>=DISK_STRT)&&(b)<DISK_END)
+
+typedef struct _inode
+{
+	int node_num;
+	mode_t mode;
+	int link_count;
+	size_t size;
+	long access;
+	long modify;
+	long change;
+	int direct[32];
+	int single_indirect[64];
+	int double_indirect;
+	char name[50];
+	int fh; //place to start from in the file
+	int flags; //SFS_FL_* from sfs_ioctl.h
+} inode;
+
+typedef struct _indir_data
+{
+	char indir_blocks[192]; //is the indirect block used or not
+	char d_indir_block; //is the one double indirect block used or not
+} indir_data;
+
+//indirect blocks are read as an array of PTRS_PER_BLK block numbers, -1 for none.
+//data block metadata blocks are read as an array of block_size chars, '1' for used
+//and '0' (or anything below '1') for free (could have made this more efficient with bit-wise
+//operations, but less mistakes this way).  Data blocks can be shared between files, the
+//char then counts the pointers to the block: '2' for two, and so on up to MAX_REFS.
+//indir_data uses '1' for used and anything else for free.
+//checksum blocks are read as an array of CSUM_PER_BLK CRC32Cs (see sfs_crc.h), one for every block
+//of the disk from block 0 to DISK_END, 0 when none is known.  The superblock and the checksum blocks
+//themselves have none.  4 checksum blocks per data block metadata block, and 4 more for the blocks
+//before DISK_STRT, cover any block size.  They are written at unmount, and only trusted when the
+//superblock says it was clean.
+
+#define MAP_REFS(c) ((unsigned char)(c)>='1' ? (unsigned char)(c)-'0' : 0) //pointers to a data block
+#define MAX_REFS (255-'0')
+
+//a file's data can be compressed a cluster at a time: the PACK_BLOCKS logical blocks from a
+//multiple of PACK_BLOCKS on are kept in fewer data blocks, the first of which starts with a
+//pack_header.  The pointers of the first logical blocks of the cluster point at those data
+//blocks in order with PACKED_BIT set, the pointers of the rest are PACKED_BIT alone.  Data
+//blocks holding compressed clusters are never shared
+#define PACK_BYTES 65536 //bytes in a cluster, but never less than 4 blocks
+#define PACK_BLOCKS ((fs.block_size<PACK_BYTES/4) ? PACK_BYTES/fs.block_size : 4)
+#define MAX_PACK_BLOCKS (PACK_BYTES/MIN_BLOCK_SIZE)
+#define PACKED_BIT 0x40000000
+#define IS_PACKED(p) ((p)>=0&&((p)&PACKED_BIT)!=0)
+#define PACKED_BLOCK(p) ((p)&~PACKED_BIT) //data block behind a packed pointer, 0 for none
+
+typedef struct _pack_header
+{
+	unsigned int length; //bytes of compressed data after the header
+	unsigned int raw; //bytes they come out as, the whole cluster
+} pack_header;
+
+//with -o dedup the filesystem keeps an index from the fingerprint of whole blocks written to the
+//block holding them.  At unmount it is saved in a run of data blocks from dedup_start on,
+//DEDUP_PER_BLK entries to a block, which stay marked used until the next mount reads them back
+//and frees them.  Entries can be stale, the block is always compared before it is shared
+typedef struct _dedup_entry
+{
+	unsigned long long hash;
+	int block; //0 for an empty slot
+	int unused;
+} dedup_entry;
+
+#define DEDUP_PER_BLK (fs.block_size/(int)sizeof(dedup_entry))
+
+typedef struct _super_block
+{
+	//info for root stored in superblock
+	mode_t mode;
+	size_t size;
+	long access;
+	long modify;
+	long change;
+	int verify; //is this our filesystem?
+	int num_files; //number of current files
+	char node_list[NUM_NODES]; //bit-vector to keep track of unsued inode blocks
+	int block_size; //bytes per disk block
+	int stripe_members; //disk files the volume is striped over, see stripe_locate
+	int stripe_width; //blocks in a row on each of them
+	int clean; //unmounted cleanly, the summaries below can be trusted
+	//summaries of the in-memory indexes in fs_info, only written at unmount
+	int mdata_used[NUM_MDATA];
+	unsigned int name_hash[NUM_NODES];
+	char mdata_shared[NUM_MDATA];
+	int dedup_start; //first data block of the saved dedup index, see dedup_entry
+	int dedup_entries; //entries saved in it, 0 for none
+} superblock;
+
+//a volume can be made of several disk files: the blocks are dealt out to them in turn, width
+//blocks at a time, so block 0 (and the superblock with it) is at the start of the first one.
+//Returns the member holding block, and in mblock the block number within that member
+static inline int stripe_locate(int block, int members, int width, off_t* mblock)
+{
+	int unit=block/width;
+	*mblock=(off_t)(unit/members)*width+block%width;
+	return unit%members;
+}
+
+//hash kept for each inode in the name_hash summary, FNV-1a, never 0 so that 0 can mean an empty slot
+static inline unsigned int name_hash(const char* name)
+{
+	unsigned int hash=2166136261u;
+	for(;*name!='\0';name++)
+	{
+		hash=(hash^(unsigned char)*name)*16777619u;
+	}
+	return (hash!=0) ? hash : 1;
+}
+
+#endif
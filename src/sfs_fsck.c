@@ -0,0 +1,802 @@
+/*
+  Simple File System
+
+  Offline checker for an sfs disk file, run while it is not mounted.
+
+  All the metadata (superblock, inodes, indirect blocks and the used
+  block maps) sits in the first DISK_STRT blocks, so it is read in one
+  go and checked in memory; file data is only read with -c.  Inodes are walked
+  by several threads, in two passes: the first one claims every indirect
+  block an inode points at for the lowest numbered inode pointing at it,
+  the second one finds the pointers that lost (indirect blocks claimed
+  twice) or point outside their region, and counts the pointers to each
+  data block, which may be shared.  What is left is compared against the
+  used block maps to find leaked blocks, blocks in use but marked free
+  and wrong reference counts.
+
+  With -y the problems get repaired: bad and doubly claimed pointers
+  are cleared, leftover unlinked inodes are freed and the maps are made
+  to match the inodes.  Only the blocks that changed are written back,
+  and the clean flag is cleared so the next mount rebuilds its indexes.
+
+  Blocks that don't match their checksum are reported, when the last
+  unmount was clean and so wrote the checksums.  For metadata blocks
+  repairing means taking the checksum again (the next mount does, as
+  the clean flag is cleared), damaged data blocks can't be repaired.
+
+  usage: sfs_fsck [-n|-y] [-c] [-j threads] diskFile[,diskFile...]
+
+  A volume striped over several disk files is given as the same comma
+  separated list it is mounted with.
+
+  Exits with 0 if nothing was wrong, 1 if everything wrong got repaired,
+  4 if problems are left and 8 if the disk file couldn't be checked.
+
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#include "sfs_crc.h"
+#include "sfs_format.h"
+
+#define NUM_IBLK (DIBLK-IBLK_STRT+1) //indirect pool plus the double indirect block
+#define NUM_DATA (NUM_MDATA*fs.block_size) //data blocks covered by the metadata blocks
+#define UNCLAIMED INT_MAX
+#define MAX_THREADS 64
+
+typedef struct _fs_info
+{
+	//the disk file being checked
+	int fd; //the first member, which holds the superblock
+	int block_size;
+	int members; //disk files the volume is striped over
+	int stripe_width;
+	int fds[MAX_MEMBERS];
+} fs_info;
+
+fs_info fs={.fd=-1};
+
+char* meta; //blocks 0 to DISK_STRT-1 of the disk file
+char* dirty; //which of those need writing back
+superblock sb;
+indir_data indir;
+
+int* data_refs; //pointers to each data block
+int iblk_owner[NUM_IBLK]; //lowest slot pointing at each indirect block
+
+int repair=0;
+int read_data=0; //read the data blocks in use and check them against their checksums too
+int problems=0;
+int repaired=0;
+pthread_mutex_t report_lock=PTHREAD_MUTEX_INITIALIZER;
+
+char* block(int n)
+{
+	return meta+(size_t)n*fs.block_size;
+}
+
+void report(int fixed, const char* format, ...)
+{
+	//one problem found, fixed if it was repaired
+	va_list ap;
+	pthread_mutex_lock(&report_lock);
+	problems++;
+	repaired+=fixed;
+	va_start(ap,format);
+	vprintf(format,ap);
+	va_end(ap);
+	printf(fixed ? ", fixed\n" : "\n");
+	pthread_mutex_unlock(&report_lock);
+}
+
+void claim(int* owner, int slot)
+{
+	//keep the lowest slot, so the outcome doesn't depend on thread timing
+	int cur=__atomic_load_n(owner,__ATOMIC_RELAXED);
+	while(slot<cur&&!__atomic_compare_exchange_n(owner,&cur,slot,0,__ATOMIC_RELAXED,__ATOMIC_RELAXED))
+	{
+	}
+}
+
+int is_data(int p)
+{
+	return p>=DISK_STRT&&p<DISK_END;
+}
+
+int is_iblk(int p)
+{
+	return p>=IBLK_STRT&&p<DIBLK;
+}
+
+int walked(int slot)
+{
+	//is the inode in slot in use, leftover unlinked inodes only count when not repairing
+	inode* node=(inode*)block(slot+NODE_STRT);
+	return sb.node_list[slot]=='1'&&(node->link_count>0||!repair);
+}
+
+////////////////////////////////////////////////////////////
+//
+// pass 1: claim the indirect blocks, data blocks can be shared
+
+void claim_indirect(int p, int slot)
+{
+	if(is_iblk(p))
+	{
+		claim(&(iblk_owner[p-IBLK_STRT]),slot);
+	}
+}
+
+void claim_inode(int slot)
+{
+	inode* node=(inode*)block(slot+NODE_STRT);
+	int j;
+	for(j=0;j<NUM_SINGLE;j++)
+	{
+		claim_indirect(node->single_indirect[j],slot);
+	}
+	if(node->double_indirect==DIBLK)
+	{
+		claim(&(iblk_owner[DIBLK-IBLK_STRT]),slot);
+		int* ptrs=(int*)block(DIBLK);
+		for(j=0;j<PTRS_PER_BLK;j++)
+		{
+			claim_indirect(ptrs[j],slot);
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// pass 2: check the pointers against what was claimed and count
+// the data block pointers.  Only indirect blocks the inode won get
+// looked into, so each block is only ever changed by one thread.
+
+void clear(int* ptr, int container)
+{
+	*ptr=-1;
+	dirty[container]=1;
+}
+
+void check_data(int* ptr, int container, int slot, const char* what, int index)
+{
+	int p=*ptr;
+	if(IS_PACKED(p))
+	{
+		//in a compressed cluster, possibly without a block of its own
+		p=(PACKED_BLOCK(p)!=0) ? PACKED_BLOCK(p) : -1;
+	}
+	if(p==-1)
+	{
+		return;
+	}
+	if(is_data(p))
+	{
+		__atomic_fetch_add(&(data_refs[p-DISK_STRT]),1,__ATOMIC_RELAXED);
+		return;
+	}
+	report(repair,"inode %d: %s %d points at block %d, outside the data region",slot+1,what,index,p);
+	if(repair)
+	{
+		clear(ptr,container);
+	}
+}
+
+int check_indirect(int* ptr, int container, int slot, const char* what, int index)
+{
+	//returns 1 if the indirect block pointed at belongs to this inode
+	int p=*ptr;
+	if(p==-1)
+	{
+		return 0;
+	}
+	if(!is_iblk(p))
+	{
+		report(repair,"inode %d: %s %d points at block %d, outside the indirect blocks",slot+1,what,index,p);
+	}
+	else if(iblk_owner[p-IBLK_STRT]!=slot)
+	{
+		report(repair,"inode %d: %s %d points at indirect block %d, already used by inode %d",slot+1,what,index,p,iblk_owner[p-IBLK_STRT]+1);
+	}
+	else
+	{
+		return 1;
+	}
+	if(repair)
+	{
+		clear(ptr,container);
+	}
+	return 0;
+}
+
+void check_single(int p, int slot)
+{
+	int* ptrs=(int*)block(p);
+	int k;
+	for(k=0;k<PTRS_PER_BLK;k++)
+	{
+		check_data(&(ptrs[k]),p,slot,"indirect block entry",k);
+	}
+}
+
+void check_inode(int slot)
+{
+	inode* node=(inode*)block(slot+NODE_STRT);
+	int home=slot+NODE_STRT;
+	int j;
+	if(memchr(node->name,'\0',sizeof(node->name))==NULL)
+	{
+		report(repair,"inode %d: name not terminated",slot+1);
+		if(repair)
+		{
+			node->name[sizeof(node->name)-1]='\0';
+			dirty[home]=1;
+		}
+	}
+	if(node->size>(size_t)MAX_BLOCKS*fs.block_size)
+	{
+		report(repair,"inode %d: size %zu is past the largest file",slot+1,node->size);
+		if(repair)
+		{
+			node->size=(size_t)MAX_BLOCKS*fs.block_size;
+			dirty[home]=1;
+		}
+	}
+	for(j=0;j<NUM_DIRECT;j++)
+	{
+		check_data(&(node->direct[j]),home,slot,"direct pointer",j);
+	}
+	for(j=0;j<NUM_SINGLE;j++)
+	{
+		if(check_indirect(&(node->single_indirect[j]),home,slot,"single indirect pointer",j))
+		{
+			check_single(node->single_indirect[j],slot);
+		}
+	}
+	if(node->double_indirect==-1)
+	{
+		return;
+	}
+	if(node->double_indirect!=DIBLK)
+	{
+		report(repair,"inode %d: double indirect pointer is %d, not %d",slot+1,node->double_indirect,DIBLK);
+	}
+	else if(iblk_owner[DIBLK-IBLK_STRT]!=slot)
+	{
+		report(repair,"inode %d: double indirect block already used by inode %d",slot+1,iblk_owner[DIBLK-IBLK_STRT]+1);
+	}
+	else
+	{
+		int* ptrs=(int*)block(DIBLK);
+		for(j=0;j<PTRS_PER_BLK;j++)
+		{
+			if(check_indirect(&(ptrs[j]),DIBLK,slot,"double indirect entry",j))
+			{
+				check_single(ptrs[j],slot);
+			}
+		}
+		return;
+	}
+	if(repair)
+	{
+		clear(&(node->double_indirect),home);
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// threads
+
+typedef struct _walker
+{
+	pthread_t thread;
+	int first;
+	int step;
+	void (*visit)(int slot);
+} walker;
+
+void* walk(void* arg)
+{
+	walker* w=(walker*)arg;
+	int slot;
+	for(slot=w->first;slot<NUM_NODES;slot+=w->step)
+	{
+		if(walked(slot))
+		{
+			w->visit(slot);
+		}
+	}
+	return NULL;
+}
+
+void walk_inodes(int threads, void (*visit)(int slot))
+{
+	//every inode in use, spread over the threads
+	walker w[MAX_THREADS];
+	int t;
+	for(t=0;t<threads;t++)
+	{
+		w[t].first=t;
+		w[t].step=threads;
+		w[t].visit=visit;
+		if(pthread_create(&(w[t].thread),NULL,walk,&(w[t]))!=0)
+		{
+			//no more threads, do the rest here
+			walk(&(w[t]));
+			w[t].thread=0;
+		}
+	}
+	for(t=0;t<threads;t++)
+	{
+		if(w[t].thread!=0)
+		{
+			pthread_join(w[t].thread,NULL);
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// the maps
+
+void check_map(char* flag, int used, const char* what, int n, int container)
+{
+	//compare a used flag with whether anything points at the block
+	char want=used ? '1' : '0';
+	if(*flag=='1'&&!used)
+	{
+		report(repair,"%s %d is marked used but nothing points at it",what,n);
+	}
+	else if(*flag!='1'&&used)
+	{
+		report(repair,"%s %d is in use but marked free",what,n);
+	}
+	else if(*flag!='0'&&*flag!='1'&&*flag!='\0')
+	{
+		report(repair,"%s %d has a bad flag 0x%02x",what,n,(unsigned char)*flag);
+	}
+	else
+	{
+		return;
+	}
+	if(repair)
+	{
+		*flag=want;
+		dirty[container]=1;
+	}
+}
+
+void check_refs(char* flag, int refs, int n, int container)
+{
+	//compare the reference count kept for a data block with the pointers found to it
+	int kept=MAP_REFS(*flag);
+	if(refs>MAX_REFS)
+	{
+		report(0,"data block %d has %d pointers, more than can be counted",n,refs);
+		return;
+	}
+	if(kept==refs)
+	{
+		return;
+	}
+	if(refs==0)
+	{
+		report(repair,"data block %d is marked used but nothing points at it",n);
+	}
+	else if(kept==0)
+	{
+		report(repair,"data block %d is in use but marked free",n);
+	}
+	else
+	{
+		report(repair,"data block %d has %d pointers but counts %d",n,refs,kept);
+	}
+	if(repair)
+	{
+		*flag=(refs==0) ? '0' : '0'+refs;
+		dirty[container]=1;
+	}
+}
+
+void check_summaries()
+{
+	//the summaries only matter if the next mount is going to trust them, repairing
+	//clears the clean flag so they get rebuilt
+	int i,j;
+	if(!sb.clean)
+	{
+		return;
+	}
+	for(i=0;i<NUM_MDATA;i++)
+	{
+		int used_count=0,shared=0;
+		for(j=0;j<fs.block_size;j++)
+		{
+			int refs=MAP_REFS(block(MDATA_STRT+i)[j]);
+			used_count+=(refs>0);
+			shared|=(refs>1);
+		}
+		if(used_count!=sb.mdata_used[i])
+		{
+			report(repair,"summary of metadata block %d says %d used, not %d",MDATA_STRT+i,sb.mdata_used[i],used_count);
+		}
+		if(shared&&!sb.mdata_shared[i])
+		{
+			//the mount wouldn't copy these blocks before writing them
+			report(repair,"summary of metadata block %d misses its shared blocks",MDATA_STRT+i);
+		}
+	}
+	for(i=0;i<NUM_NODES;i++)
+	{
+		inode* node=(inode*)block(i+NODE_STRT);
+		unsigned int hash=(sb.node_list[i]=='1'&&node->link_count>0) ? name_hash(node->name) : 0;
+		if(hash!=sb.name_hash[i])
+		{
+			report(repair,"summary of inode %d has the wrong name hash",i+1);
+		}
+	}
+}
+
+void check_csums()
+{
+	//the checksums of the blocks read, which are only written at unmount.  Has to come
+	//before anything gets repaired
+	int i;
+	if(!sb.clean)
+	{
+		return;
+	}
+	unsigned int* csums=(unsigned int*)block(CSUM_STRT);
+	for(i=1;i<DISK_STRT;i++)
+	{
+		if(HAS_CSUM(i)&&csums[i]!=0&&csums[i]!=block_csum(block(i),fs.block_size))
+		{
+			report(repair,"block %d doesn't match its checksum",i);
+		}
+	}
+}
+
+void check_maps()
+{
+	int i;
+	for(i=0;i<NUM_DATA;i++)
+	{
+		check_refs(&(block(MDATA_STRT+i/fs.block_size)[i%fs.block_size]),data_refs[i],DISK_STRT+i,MDATA_STRT+i/fs.block_size);
+	}
+	for(i=0;i<DIBLK-IBLK_STRT;i++)
+	{
+		check_map(&(indir.indir_blocks[i]),iblk_owner[i]!=UNCLAIMED,"indirect block",IBLK_STRT+i,INDIR_DATA);
+	}
+	check_map(&(indir.d_indir_block),iblk_owner[DIBLK-IBLK_STRT]!=UNCLAIMED,"double indirect block",DIBLK,INDIR_DATA);
+	if(dirty[INDIR_DATA])
+	{
+		memcpy(block(INDIR_DATA),&indir,sizeof(indir_data));
+	}
+}
+
+void check_nodes()
+{
+	//node_list and num_files, freeing leftover unlinked inodes when repairing
+	int i,count=0;
+	for(i=0;i<NUM_NODES;i++)
+	{
+		char* flag=&(sb.node_list[i]);
+		inode* node=(inode*)block(i+NODE_STRT);
+		if(*flag!='0'&&*flag!='1')
+		{
+			report(repair,"inode %d has a bad flag 0x%02x",i+1,(unsigned char)*flag);
+			if(repair)
+			{
+				*flag='0';
+				dirty[0]=1;
+			}
+			continue;
+		}
+		if(*flag=='1'&&node->link_count==0)
+		{
+			report(repair,"inode %d was unlinked but never freed",i+1);
+			if(repair)
+			{
+				*flag='0';
+				dirty[0]=1;
+				continue;
+			}
+		}
+		count+=(*flag=='1');
+	}
+	if(count!=sb.num_files)
+	{
+		report(repair,"superblock counts %d files, not %d",sb.num_files,count);
+		if(repair)
+		{
+			sb.num_files=count;
+			dirty[0]=1;
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// reading and writing the disk file
+
+int member_run(int i, int end, int* fd, off_t* pos)
+{
+	//how many of blocks i to end-1 follow each other on the member holding block i, see
+	//stripe_locate, and where that run starts
+	off_t mblock;
+	int member=stripe_locate(i,fs.members,fs.stripe_width,&mblock);
+	int n=fs.stripe_width-i%fs.stripe_width;
+	*fd=fs.fds[member];
+	*pos=mblock*fs.block_size;
+	return (n<end-i) ? n : end-i;
+}
+
+int read_meta()
+{
+	//everything but the data blocks, in one read per member run
+	size_t len=(size_t)DISK_STRT*fs.block_size;
+	meta=calloc(1,len);
+	dirty=calloc(1,DISK_STRT);
+	if(meta==NULL||dirty==NULL)
+	{
+		return -ENOMEM;
+	}
+	int i=0;
+	while(i<DISK_STRT)
+	{
+		int fd;
+		off_t pos;
+		int n=member_run(i,DISK_STRT,&fd,&pos);
+		size_t run=(size_t)n*fs.block_size;
+		size_t done=0;
+		while(done<run)
+		{
+			ssize_t got=pread(fd,block(i)+done,run-done,pos+done);
+			if(got<0)
+			{
+				return -errno;
+			}
+			if(got==0)
+			{
+				//never written, reads as zeros
+				break;
+			}
+			done+=got;
+		}
+		i+=n;
+	}
+	memcpy(&sb,meta,sizeof(superblock));
+	memcpy(&indir,block(INDIR_DATA),sizeof(indir_data));
+	return 0;
+}
+
+int write_meta()
+{
+	//write back each run of changed blocks
+	int i=0;
+	while(i<DISK_STRT)
+	{
+		if(!dirty[i])
+		{
+			i++;
+			continue;
+		}
+		int end=i;
+		while(end<DISK_STRT&&dirty[end])
+		{
+			end++;
+		}
+		int fd;
+		off_t pos;
+		int n=member_run(i,end,&fd,&pos);
+		size_t len=(size_t)n*fs.block_size;
+		if(pwrite(fd,block(i),len,pos)!=(ssize_t)len)
+		{
+			return -errno;
+		}
+		i+=n;
+	}
+	for(i=0;i<fs.members;i++)
+	{
+		if(fsync(fs.fds[i])<0)
+		{
+			return -errno;
+		}
+	}
+	return 0;
+}
+
+void check_data_csums()
+{
+	//one read per data block in use, after the inodes were walked
+	int i;
+	if(!sb.clean)
+	{
+		return;
+	}
+	unsigned int* csums=(unsigned int*)block(CSUM_STRT);
+	char* buf=malloc(fs.block_size);
+	if(buf==NULL)
+	{
+		return;
+	}
+	for(i=DISK_STRT;i<DISK_END;i++)
+	{
+		if(data_refs[i-DISK_STRT]==0||csums[i]==0)
+		{
+			continue;
+		}
+		int fd;
+		off_t pos;
+		member_run(i,i+1,&fd,&pos);
+		ssize_t got=pread(fd,buf,fs.block_size,pos);
+		if(got<fs.block_size)
+		{
+			memset(buf+(got>0 ? got : 0),0,fs.block_size-(got>0 ? got : 0));
+		}
+		if(csums[i]!=block_csum(buf,fs.block_size))
+		{
+			report(0,"data block %d doesn't match its checksum",i);
+		}
+	}
+	free(buf);
+}
+
+void sfs_fsck_usage()
+{
+	fprintf(stderr, "usage:  sfs_fsck [-n|-y] [-c] [-j threads] diskFile[,diskFile...]\n");
+	fprintf(stderr, "    -n            only report problems (default)\n");
+	fprintf(stderr, "    -y            repair problems\n");
+	fprintf(stderr, "    -c            check the data blocks in use against their checksums too\n");
+	fprintf(stderr, "    -j threads    threads walking the inodes (default one per cpu)\n");
+	exit(8);
+}
+
+int main(int argc, char *argv[])
+{
+	int threads=(int)sysconf(_SC_NPROCESSORS_ONLN);
+	int opt;
+	while((opt=getopt(argc,argv,"nycj:"))!=-1)
+	{
+		switch(opt)
+		{
+			case 'n': repair=0; break;
+			case 'y': repair=1; break;
+			case 'c': read_data=1; break;
+			case 'j': threads=atoi(optarg); break;
+			default: sfs_fsck_usage();
+		}
+	}
+	if(optind!=argc-1)
+	{
+		sfs_fsck_usage();
+	}
+	crc32c_init();
+	if(threads<1)
+	{
+		threads=1;
+	}
+	if(threads>MAX_THREADS)
+	{
+		threads=MAX_THREADS;
+	}
+
+	//a striped volume is a comma separated list of its members
+	char* names=strdup(argv[optind]);
+	char* save;
+	char* name;
+	fs.members=0;
+	for(name=strtok_r(names,",",&save);name!=NULL;name=strtok_r(NULL,",",&save))
+	{
+		if(fs.members==MAX_MEMBERS)
+		{
+			fprintf(stderr,"%s: more than %d disk files\n",argv[optind],MAX_MEMBERS);
+			return 8;
+		}
+		fs.fds[fs.members]=open(name,repair ? O_RDWR : O_RDONLY);
+		if(fs.fds[fs.members]<0)
+		{
+			perror(name);
+			return 8;
+		}
+		fs.members++;
+	}
+	free(names);
+	if(fs.members==0)
+	{
+		sfs_fsck_usage();
+	}
+	fs.fd=fs.fds[0];
+	superblock head;
+	if(pread(fs.fd,&head,sizeof(superblock),0)!=(ssize_t)sizeof(superblock)||head.verify!=VER)
+	{
+		fprintf(stderr,"%s: not an sfs disk file (or an older format)\n",argv[optind]);
+		return 8;
+	}
+	if(head.block_size<MIN_BLOCK_SIZE||head.block_size>MAX_BLOCK_SIZE||(head.block_size&(head.block_size-1))!=0)
+	{
+		fprintf(stderr,"%s: bad block size %d\n",argv[optind],head.block_size);
+		return 8;
+	}
+	if(head.stripe_members!=fs.members||head.stripe_width<1)
+	{
+		fprintf(stderr,"%s: volume is striped over %d disk files, %d given\n",argv[optind],head.stripe_members,fs.members);
+		return 8;
+	}
+	fs.block_size=head.block_size;
+	fs.stripe_width=head.stripe_width;
+	int retstat=read_meta();
+	if(retstat<0)
+	{
+		fprintf(stderr,"%s: %s\n",argv[optind],strerror(-retstat));
+		return 8;
+	}
+	data_refs=calloc(NUM_DATA,sizeof(int));
+	if(data_refs==NULL)
+	{
+		perror("sfs_fsck");
+		return 8;
+	}
+	int i;
+	for(i=0;i<NUM_IBLK;i++)
+	{
+		iblk_owner[i]=UNCLAIMED;
+	}
+	if(sb.dedup_entries>0)
+	{
+		//the dedup index saved at unmount holds its blocks until the next mount, which frees
+		//them whether or not the clean flag is still set by then
+		for(i=0;i<(sb.dedup_entries+DEDUP_PER_BLK-1)/DEDUP_PER_BLK;i++)
+		{
+			if(is_data(sb.dedup_start+i))
+			{
+				data_refs[sb.dedup_start+i-DISK_STRT]++;
+			}
+		}
+	}
+	printf("%s: %d byte blocks, %d files%s\n",argv[optind],fs.block_size,sb.num_files,sb.clean ? "" : ", not unmounted cleanly");
+
+	check_summaries();
+	check_csums();
+	walk_inodes(threads,claim_inode);
+	walk_inodes(threads,check_inode);
+	check_nodes();
+	check_maps();
+	if(read_data)
+	{
+		check_data_csums();
+	}
+
+	if(repair&&problems>0)
+	{
+		//the mount can't trust the summaries any more
+		sb.clean=0;
+		memcpy(meta,&sb,sizeof(superblock));
+		dirty[0]=1;
+		retstat=write_meta();
+		if(retstat<0)
+		{
+			fprintf(stderr,"%s: writing repairs: %s\n",argv[optind],strerror(-retstat));
+			return 8;
+		}
+	}
+	for(i=0;i<fs.members;i++)
+	{
+		close(fs.fds[i]);
+	}
+	printf("%d problems, %d repaired\n",problems,repaired);
+	if(problems==0)
+	{
+		return 0;
+	}
+	return (repaired==problems) ? 1 : 4;
+}
@@ -0,0 +1,86 @@
+/*
+  Simple File System
+
+  ioctl interface of the mounted filesystem, shared with user programs.
+  Commands are issued on an open file inside the mount point.
+
+*/
+
+#ifndef _SFS_IOCTL_H_
+#define _SFS_IOCTL_H_
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <sys/types.h>
+
+#define SFS_IOC_MAGIC 0xF5
+
+// SEEK_DATA / SEEK_HOLE answered from the block map.  The argument is
+// the starting offset on the way in and the resulting offset on the way
+// out.  Fails with ENXIO when there is no data (or hole) past the offset.
+#define SFS_IOC_SEEK_DATA _IOWR(SFS_IOC_MAGIC, 1, off_t)
+#define SFS_IOC_SEEK_HOLE _IOWR(SFS_IOC_MAGIC, 2, off_t)
+
+// Reflink clone, like FICLONERANGE (which the kernel never passes on to
+// fuse).  The range of the file called src_name (with or without the
+// leading /) is shared with the file the ioctl is issued on, without
+// copying any data; writes to either one copy the blocks they touch first.  Both
+// offsets have to be multiples of the block size (st_blksize), and so
+// does the length unless the range runs to the end of both files.  A
+// src_length of 0 means to the end of the source.  Fails with EINVAL
+// when things don't line up.
+struct sfs_clone_range {
+	char src_name[64];
+	int64_t src_offset;
+	int64_t src_length;
+	int64_t dest_offset;
+};
+
+#define SFS_IOC_CLONE_RANGE _IOW(SFS_IOC_MAGIC, 3, struct sfs_clone_range)
+
+// copy_file_range, which fuse 2 has no hook for.  Any range can be
+// copied; whole blocks are shared like SFS_IOC_CLONE_RANGE does whenever
+// both offsets sit at the same place within a block, and the rest is
+// copied.  src_length comes back as the number of bytes copied.
+#define SFS_IOC_COPY_RANGE _IOWR(SFS_IOC_MAGIC, 4, struct sfs_clone_range)
+
+// Fragmentation of the file the ioctl is issued on, counted in data
+// blocks and in extents (runs of consecutive blocks on disk), and of the
+// free space left in the filesystem.
+struct sfs_frag_report {
+	int32_t flags;		// SFS_DEFRAG_* for SFS_IOC_DEFRAG
+	int32_t moved;		// blocks SFS_IOC_DEFRAG moved
+	int64_t file_blocks;
+	int64_t file_extents;
+	int64_t free_blocks;
+	int64_t free_extents;
+	int64_t largest_free;	// longest run of free blocks
+};
+
+#define SFS_IOC_FRAG_REPORT _IOR(SFS_IOC_MAGIC, 5, struct sfs_frag_report)
+
+// Move the blocks of the file into the first run of free blocks that
+// holds all of them, then report like SFS_IOC_FRAG_REPORT.  Nothing moves
+// when the free space is too broken up for that.  Blocks shared with other
+// files (see SFS_IOC_CLONE_RANGE) stay where they are.
+#define SFS_IOC_DEFRAG _IOWR(SFS_IOC_MAGIC, 6, struct sfs_frag_report)
+
+#define SFS_DEFRAG_ALL		0x1	// every file in the filesystem, not just this one
+#define SFS_DEFRAG_COMPACT	0x2	// also move files already in one piece down when
+					// there is room, gathering the free space at the end
+
+// Start the counts and latency histograms read from /.sfs_stats over.
+// Works on any open file of the filesystem, /.sfs_stats included.
+#define SFS_IOC_STATS_RESET _IO(SFS_IOC_MAGIC, 7)
+
+// Flags of the file, like FS_IOC_GETFLAGS and FS_IOC_SETFLAGS.  Flags
+// that can't be set are left alone by SFS_IOC_SET_FLAGS.
+#define SFS_IOC_GET_FLAGS _IOR(SFS_IOC_MAGIC, 8, int32_t)
+#define SFS_IOC_SET_FLAGS _IOW(SFS_IOC_MAGIC, 9, int32_t)
+
+#define SFS_FL_COMPRESS	0x1	// compress what is written, a cluster of blocks at a time, when
+				// the file is flushed (-o compress sets it on new files).  Turning
+				// it off leaves compressed clusters as they are until rewritten
+#define SFS_FL_PACKED	0x2	// some of the file has been compressed, can't be set
+
+#endif
@@ -0,0 +1,507 @@
+/*
+  Simple File System
+
+  Replay of a trace recorded with -o trace=FILE (see sfs_trace.h).  Like
+  sfs_bench, sfs.c is built into it (with SFS_NO_MAIN) and the calls are
+  made on the handlers in sfs_oper directly, one after the other in the
+  order they finished when recorded, so calls that overlapped then don't
+  now.  At the end it prints what /.sfs_stats would have read, for the
+  replayed calls only.
+
+  usage: sfs_replay [-t] [-v] traceFile diskFile
+
+    -t   wait until each call is due, keeping the gaps of the recording
+         instead of running the calls back to back
+    -v   print every call that didn't come out like it did when recorded
+
+  Replay against a copy of the disk file taken when tracing started (or
+  a missing or empty diskFile for a trace that starts on a fresh
+  filesystem, it is formatted with the block size of the trace), or the
+  results won't line up.  The diskFile is written to.  File contents are
+  not in the trace, so writes put the same made up data every time.
+
+  Low-level traces are replayed through the high-level handlers, finding
+  the name of each inode number from the lookup or create that handed it
+  out.  Calls on files opened before tracing started are skipped, and so
+  are ioctls other than SFS_IOC_STATS_RESET, whose arguments aren't
+  recorded.  Results are only checked for high-level traces, low-level
+  handlers reply themselves and leave nothing to compare.
+
+  build: gcc -O2 -pthread -o sfs_replay sfs_replay.c `pkg-config fuse --cflags --libs`
+  with params.h, block.h and log.h on the include path.
+
+*/
+
+#define SFS_NO_MAIN
+#include "sfs.c"
+
+#include <time.h>
+
+#define MAX_IO (1<<30) //larger reads and writes mean the trace is broken
+
+typedef struct _open_file
+{
+	//a handle from the trace and the one the replayed open got for it.  Handles are
+	//slot numbers, so files opened more than once share one
+	uint64_t fh;
+	int dir; //opened with opendir
+	int opens; //not yet released
+	struct fuse_file_info fi;
+	char path[TRACE_MAX_NAME+2];
+} open_file;
+
+typedef struct _known_ino
+{
+	uint32_t ino;
+	char path[TRACE_MAX_NAME+2];
+} known_ino;
+
+struct replay_options
+{
+	int timing;
+	int verbose;
+};
+
+struct replay_options replay_opts;
+
+open_file* open_files;
+int num_open;
+int max_open;
+
+known_ino* inos;
+int num_inos;
+int max_inos;
+
+char* read_buff;
+char* write_buff;
+size_t buff_size;
+
+unsigned long replayed;
+unsigned long skipped;
+unsigned long mismatched;
+unsigned long failed;
+
+void log_conn(struct fuse_conn_info* conn)
+{
+	//log.c finds the log file through the fuse context, and there is none here
+}
+
+void replay_fail(const char* what)
+{
+	perror(what);
+	exit(EXIT_FAILURE);
+}
+
+void* grow(void* array, int* max, size_t size)
+{
+	*max=(*max>0) ? *max*2 : 64;
+	array=realloc(array,*max*size);
+	if(array==NULL)
+	{
+		replay_fail("sfs_replay");
+	}
+	return array;
+}
+
+open_file* find_open(uint64_t fh, int dir)
+{
+	int i;
+	for(i=num_open-1;i>=0;i--)
+	{
+		if(open_files[i].fh==fh&&open_files[i].dir==dir)
+		{
+			return &(open_files[i]);
+		}
+	}
+	return NULL;
+}
+
+void add_open(uint64_t fh, const char* path, struct fuse_file_info* fi, int dir)
+{
+	open_file* f=find_open(fh,dir);
+	if(f!=NULL)
+	{
+		f->opens++;
+		return;
+	}
+	if(num_open==max_open)
+	{
+		open_files=grow(open_files,&max_open,sizeof(open_file));
+	}
+	f=&(open_files[num_open++]);
+	f->fh=fh;
+	f->dir=dir;
+	f->opens=1;
+	f->fi=*fi;
+	strcpy(f->path,path);
+}
+
+void drop_open(open_file* f)
+{
+	if(--(f->opens)==0)
+	{
+		*f=open_files[--num_open];
+	}
+}
+
+const char* ino_path(uint32_t ino)
+{
+	if(ino==FUSE_ROOT_ID)
+	{
+		return "/";
+	}
+	int i;
+	for(i=0;i<num_inos;i++)
+	{
+		if(inos[i].ino==ino)
+		{
+			return inos[i].path;
+		}
+	}
+	return NULL;
+}
+
+void add_ino(uint32_t ino, const char* path)
+{
+	int i;
+	for(i=0;i<num_inos;i++)
+	{
+		if(inos[i].ino==ino)
+		{
+			break;
+		}
+	}
+	if(i==num_inos)
+	{
+		if(num_inos==max_inos)
+		{
+			inos=grow(inos,&max_inos,sizeof(known_ino));
+		}
+		num_inos++;
+	}
+	inos[i].ino=ino;
+	strcpy(inos[i].path,path);
+}
+
+void buff_need(size_t size)
+{
+	//read and write buffers of at least size bytes, the written data is the same on every run
+	if(size<=buff_size)
+	{
+		return;
+	}
+	free(read_buff);
+	free(write_buff);
+	read_buff=malloc(size);
+	write_buff=malloc(size);
+	if(read_buff==NULL||write_buff==NULL)
+	{
+		replay_fail("sfs_replay");
+	}
+	unsigned int seed=42;
+	size_t i;
+	for(i=0;i<size;i++)
+	{
+		write_buff[i]=(char)rand_r(&seed);
+	}
+	buff_size=size;
+}
+
+int ignore_name(void* buf, const char* name, const struct stat* stbuf, off_t off)
+{
+	return 0;
+}
+
+unsigned long long now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts_ns(&ts);
+}
+
+void wait_until(unsigned long long due)
+{
+	unsigned long long now=now_ns();
+	if(now<due)
+	{
+		struct timespec ts;
+		ts.tv_sec=(due-now)/1000000000ULL;
+		ts.tv_nsec=(due-now)%1000000000ULL;
+		while(nanosleep(&ts,&ts)<0&&errno==EINTR);
+	}
+}
+
+#define SKIPPED 0
+#define REPLAYED 1
+#define CHECKED 2 //replayed, and the result can be compared with the recorded one
+
+int replay_call(struct sfs_trace_rec* rec, const char* path, open_file* f, int* retstat)
+{
+	//make the call rec is a record of, on path and the open file f where it needs one
+	struct fuse_file_info fi;
+	struct stat statbuf;
+	switch(rec->op)
+	{
+		case OP_GETATTR:
+			*retstat=sfs_oper.getattr(path,&statbuf);
+			return CHECKED;
+		case OP_CREATE:
+			memset(&fi,0,sizeof(fi));
+			fi.flags=O_CREAT|O_RDWR;
+			*retstat=sfs_oper.create(path,rec->size,&fi);
+			if(*retstat==0)
+			{
+				add_open(rec->fh,path,&fi,0);
+			}
+			return CHECKED;
+		case OP_UNLINK:
+			*retstat=sfs_oper.unlink(path);
+			return CHECKED;
+		case OP_OPEN:
+		case OP_OPENDIR:
+			memset(&fi,0,sizeof(fi));
+			fi.flags=rec->size;
+			*retstat=(rec->op==OP_OPEN) ? sfs_oper.open(path,&fi) : sfs_oper.opendir(path,&fi);
+			if(*retstat==0)
+			{
+				add_open(rec->fh,path,&fi,rec->op==OP_OPENDIR);
+			}
+			return CHECKED;
+		case OP_MKDIR:
+			*retstat=sfs_oper.mkdir(path,rec->size);
+			return CHECKED;
+		case OP_RMDIR:
+			*retstat=sfs_oper.rmdir(path);
+			return CHECKED;
+	}
+	//the rest work on an open file
+	if(f==NULL)
+	{
+		return SKIPPED;
+	}
+	switch(rec->op)
+	{
+		case OP_RELEASE:
+		case OP_RELEASEDIR:
+			*retstat=f->dir ? sfs_oper.releasedir(f->path,&(f->fi)) : sfs_oper.release(f->path,&(f->fi));
+			drop_open(f);
+			return CHECKED;
+		case OP_FLUSH:
+			*retstat=sfs_oper.flush(f->path,&(f->fi));
+			return CHECKED;
+		case OP_FSYNC:
+			*retstat=sfs_oper.fsync(f->path,rec->size,&(f->fi));
+			return CHECKED;
+		case OP_READ:
+			buff_need(rec->size);
+			*retstat=sfs_oper.read(f->path,read_buff,rec->size,rec->offset,&(f->fi));
+			return CHECKED;
+		case OP_WRITE:
+			buff_need(rec->size);
+			*retstat=sfs_oper.write(f->path,write_buff,rec->size,rec->offset,&(f->fi));
+			return CHECKED;
+		case OP_READDIR:
+			//the whole directory is listed every time, whatever the offset
+			*retstat=sfs_oper.readdir(f->path,NULL,ignore_name,0,&(f->fi));
+			return REPLAYED;
+		case OP_IOCTL:
+			*retstat=sfs_oper.ioctl(f->path,rec->size,NULL,&(f->fi),0,NULL);
+			return CHECKED;
+	}
+	return SKIPPED;
+}
+
+int replay(struct sfs_trace_rec* rec, const char* name, int lowlevel)
+{
+	//returns 0 for a call that was skipped
+	if(rec->size>MAX_IO&&(rec->op==OP_READ||rec->op==OP_WRITE))
+	{
+		fprintf(stderr,"sfs_replay: %llu byte %s, the trace is broken\n",(unsigned long long)rec->size,op_names[rec->op]);
+		exit(EXIT_FAILURE);
+	}
+	char path[TRACE_MAX_NAME+2];
+	if(rec->op==OP_FORGET||(rec->op==OP_IOCTL&&(int)rec->size!=SFS_IOC_STATS_RESET))
+	{
+		return 0;
+	}
+	if(lowlevel)
+	{
+		//only the root directory has names in it at the low level
+		if(rec->name_len>0)
+		{
+			snprintf(path,sizeof(path),"/%s",name);
+			if(rec->op==OP_LOOKUP||rec->op==OP_CREATE)
+			{
+				if(rec->ino==0)
+				{
+					//the lookup found nothing, or the create failed
+					return 0;
+				}
+				add_ino(rec->ino,path);
+			}
+			if(rec->op==OP_LOOKUP)
+			{
+				rec->op=OP_GETATTR;
+			}
+		}
+		else
+		{
+			const char* known=ino_path(rec->ino);
+			if(known==NULL)
+			{
+				return 0;
+			}
+			strcpy(path,known);
+		}
+	}
+	else
+	{
+		snprintf(path,sizeof(path),"%s",name);
+	}
+	int retstat=0;
+	int dir=(rec->op==OP_READDIR||rec->op==OP_RELEASEDIR);
+	int how=replay_call(rec,path,find_open(rec->fh,dir),&retstat);
+	if(how==SKIPPED)
+	{
+		return 0;
+	}
+	if(retstat<0)
+	{
+		failed++;
+	}
+	if(!lowlevel&&how==CHECKED&&retstat!=rec->result)
+	{
+		mismatched++;
+		if(replay_opts.verbose)
+		{
+			printf("%s %s at %lld size %llu: %d, recorded %d\n",op_names[rec->op],path,
+				(long long)rec->offset,(unsigned long long)rec->size,retstat,(int)rec->result);
+		}
+	}
+	return 1;
+}
+
+void sfs_replay_usage()
+{
+	fprintf(stderr, "usage:  sfs_replay [-t] [-v] traceFile diskFile\n");
+	fprintf(stderr, "    -t   keep the gaps between the calls in the trace\n");
+	fprintf(stderr, "    -v   print every call that came out differently\n");
+	fprintf(stderr, "diskFile should be a copy of the disk file from when tracing started, it is written to\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	int opt;
+	while((opt=getopt(argc,argv,"tv"))!=-1)
+	{
+		switch(opt)
+		{
+			case 't': replay_opts.timing=1; break;
+			case 'v': replay_opts.verbose=1; break;
+			default: sfs_replay_usage();
+		}
+	}
+	if(optind!=argc-2)
+	{
+		sfs_replay_usage();
+	}
+
+	FILE* trace=fopen(argv[optind],"r");
+	if(trace==NULL)
+	{
+		replay_fail(argv[optind]);
+	}
+	struct sfs_trace_header head;
+	if(fread(&head,sizeof(head),1,trace)!=1||head.magic!=TRACE_MAGIC)
+	{
+		fprintf(stderr,"sfs_replay: %s is not a trace\n",argv[optind]);
+		return EXIT_FAILURE;
+	}
+	if(head.version!=TRACE_VER)
+	{
+		fprintf(stderr,"sfs_replay: %s is a version %u trace, this reads version %d\n",argv[optind],head.version,TRACE_VER);
+		return EXIT_FAILURE;
+	}
+
+	sfs_data=calloc(1,sizeof(struct sfs_state));
+	if(sfs_data==NULL)
+	{
+		replay_fail("sfs_replay");
+	}
+	sfs_data->diskfile=argv[optind+1];
+	sfs_data->logfile=fopen("/dev/null","w");
+	sfs_opts.block_size=head.block_size;
+	struct fuse_conn_info conn;
+	memset(&conn,0,sizeof(conn));
+	sfs_oper.init(&conn);
+	if(fs.block_size!=head.block_size)
+	{
+		fprintf(stderr,"sfs_replay: traced with %d byte blocks, %s has %d byte ones\n",head.block_size,argv[optind+1],fs.block_size);
+	}
+
+	unsigned long records=0;
+	unsigned long long span=0;
+	unsigned long long started=now_ns();
+	struct sfs_trace_rec rec;
+	char name[TRACE_MAX_NAME+1];
+	while(fread(&rec,sizeof(rec),1,trace)==1)
+	{
+		if(rec.op>=NUM_OPS||fread(name,1,rec.name_len,trace)!=rec.name_len)
+		{
+			fprintf(stderr,"sfs_replay: record %lu is broken, stopping there\n",records);
+			break;
+		}
+		name[rec.name_len]='\0';
+		records++;
+		span=rec.start+rec.took;
+		if(replay_opts.timing)
+		{
+			wait_until(started+rec.start);
+		}
+		if(replay(&rec,name,head.lowlevel))
+		{
+			replayed++;
+		}
+		else
+		{
+			skipped++;
+		}
+	}
+	double took=(now_ns()-started)/1e9;
+	fclose(trace);
+
+	//release what the trace left open, so that everything is on disk
+	while(num_open>0)
+	{
+		open_file* f=&(open_files[num_open-1]);
+		if(f->dir)
+		{
+			sfs_oper.releasedir(f->path,&(f->fi));
+		}
+		else
+		{
+			sfs_oper.release(f->path,&(f->fi));
+		}
+		drop_open(f);
+	}
+
+	time_t traced=head.started;
+	printf("%s: %s trace from %s",argv[optind],head.lowlevel ? "low-level" : "high-level",ctime(&traced));
+	printf("%lu calls, %lu replayed, %lu skipped, %lu failed",records,replayed,skipped,failed);
+	if(!head.lowlevel)
+	{
+		printf(", %lu came out differently",mismatched);
+	}
+	printf("\nrecorded over %.3f s, replayed in %.3f s\n\n",span/1e9,took);
+	char* text=stats_text();
+	if(text!=NULL)
+	{
+		fputs(text,stdout);
+		free(text);
+	}
+	sfs_oper.destroy(sfs_data);
+	free(read_buff);
+	free(write_buff);
+	return (mismatched>0) ? 2 : 0;
+}
@@ -0,0 +1,469 @@
+/*
+  Simple File System
+
+  Tests of the parts of the filesystem that are easy to get subtly wrong
+  and hard to see going wrong from a mount.  Like sfs_bench, sfs.c is
+  built into it (with SFS_NO_MAIN) so its helpers can be called directly,
+  and the handlers in sfs_oper are called on a scratch disk file.
+
+  Tests, picked with -t as a comma separated list (default all):
+
+    lz       the LZ codec of compressed clusters on its own: round trips of
+             zero, repetitive and random data up to a whole cluster, output
+             that doesn't fit, and damaged input fed to the decoder
+    cluster  compressing clusters through the handlers (cluster_pack and
+             cluster_unpack): files of zeros, repetitive and random data,
+             sizes on either side of PACK_BLOCKS blocks, writing into a
+             compressed cluster, and damaged pack headers on disk
+    crc      the block checksum: the CRC32C check value, and the crc32
+             instruction version against the tables at lengths around the
+             three CRC_STRIDE byte pieces it works on, from every alignment
+
+  Every check that fails is printed; the exit status is the number of
+  them, so 0 when all pass.  Build it with -fsanitize=address as well to
+  have reads and writes past a buffer caught.
+
+  usage: sfs_test [-b block_size] [-t tests] [diskFile]
+
+  Without a diskFile a temporary one is made and removed at the end.  A
+  diskFile that is given is overwritten.
+
+  build: gcc -O2 -pthread -o sfs_test sfs_test.c `pkg-config fuse --cflags --libs`
+  with params.h, block.h and log.h on the include path.
+
+*/
+
+#define SFS_NO_MAIN
+#include "sfs.c"
+
+const char* test_names="lz,cluster,crc";
+
+int failures;
+
+//note a check that didn't hold, and keep going
+#define CHECK(cond) do { if(!(cond)) { fprintf(stderr,"sfs_test: %s:%d: %s\n",__func__,__LINE__,#cond); failures++; } } while(0)
+
+void log_conn(struct fuse_conn_info* conn)
+{
+	//log.c finds the log file through the fuse context, and there is none here
+}
+
+void fill_zero(char* buf, int len, unsigned int seed)
+{
+	memset(buf,0,len);
+}
+
+void fill_text(char* buf, int len, unsigned int seed)
+{
+	//words from a small set, compresses well but not to nothing
+	static const char* words[]={"block ","inode ","cluster ","the ","of ","pointer ","\n","map ","free "};
+	int i=0;
+	while(i<len)
+	{
+		const char* w=words[rand_r(&seed)%(sizeof(words)/sizeof(words[0]))];
+		while(*w!='\0'&&i<len)
+		{
+			buf[i++]=*w++;
+		}
+	}
+}
+
+void fill_random(char* buf, int len, unsigned int seed)
+{
+	//doesn't compress at all
+	int i;
+	for(i=0;i<len;i++)
+	{
+		buf[i]=(char)(rand_r(&seed)>>7);
+	}
+}
+
+typedef void (*fill_fn)(char* buf, int len, unsigned int seed);
+
+void lz_round_trip(fill_fn fill, int len, int compressible)
+{
+	//compress len bytes and decompress them again, into buffers exactly as large as needed
+	//so that going past them shows
+	int cap=len+len/255+16;
+	char* in=malloc(len+1);
+	char* packed=malloc(cap);
+	char* out=malloc(len+1);
+	fill(in,len,len);
+	int plen=lz_compress(in,len,packed,cap);
+	CHECK(plen>0);
+	if(compressible&&len>=4096)
+	{
+		CHECK(plen<len/2);
+	}
+	if(plen>0)
+	{
+		CHECK(lz_decompress(packed,plen,out,len)==len);
+		CHECK(memcmp(in,out,len)==0);
+		if(len>0)
+		{
+			//one byte short of room to decompress into
+			CHECK(lz_decompress(packed,plen,out,len-1)==-1);
+		}
+		//output that doesn't fit is given up on, not cut short
+		CHECK(lz_compress(in,len,packed,plen-1)==-1);
+	}
+	free(in);
+	free(packed);
+	free(out);
+}
+
+void lz_damaged(int len)
+{
+	//whatever the decoder is given, it stays inside its buffers and says when it is nonsense
+	char* in=malloc(len);
+	char* packed=malloc(len+len/255+16);
+	char* out=malloc(len);
+	fill_text(in,len,1);
+	int plen=lz_compress(in,len,packed,len+len/255+16);
+	CHECK(plen>0);
+	int i;
+	for(i=0;i<plen;i++)
+	{
+		//every truncation: the sequence cut short is rejected, or what came before it is
+		//decoded and it comes out short
+		int r=lz_decompress(packed,i,out,len);
+		CHECK(r<len);
+		CHECK(r<0||memcmp(in,out,r)==0);
+	}
+	unsigned int seed=7;
+	for(i=0;i<1000;i++)
+	{
+		//bytes flipped here and there, and the rest decoded anyway
+		char* bad=malloc(plen);
+		memcpy(bad,packed,plen);
+		int k;
+		for(k=0;k<1+i%4;k++)
+		{
+			bad[rand_r(&seed)%plen]^=1<<(rand_r(&seed)%8);
+		}
+		int r=lz_decompress(bad,plen,out,len);
+		CHECK(r>=-1&&r<=len);
+		free(bad);
+	}
+	for(i=0;i<1000;i++)
+	{
+		//noise
+		int n=1+i;
+		char* noise=malloc(n);
+		fill_random(noise,n,i);
+		int r=lz_decompress(noise,n,out,len);
+		CHECK(r>=-1&&r<=len);
+		free(noise);
+	}
+	//a match before the start of the output, with an offset of 0, and one longer than the
+	//room left; a length of literals and one of a match that run off the end
+	unsigned char early[]={0x10,'a',2,0};
+	unsigned char zero[]={0x10,'a',0,0};
+	unsigned char longer[]={0x1f,'a',1,0,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,0};
+	unsigned char lits[]={0xf0,255,255};
+	unsigned char match[]={0x1f,'a',1,0,255};
+	CHECK(lz_decompress((char*)early,sizeof(early),out,len)==-1);
+	CHECK(lz_decompress((char*)zero,sizeof(zero),out,len)==-1);
+	CHECK(lz_decompress((char*)longer,sizeof(longer),out,16)==-1);
+	CHECK(lz_decompress((char*)lits,sizeof(lits),out,len)==-1);
+	CHECK(lz_decompress((char*)match,sizeof(match),out,len)==-1);
+	free(in);
+	free(packed);
+	free(out);
+}
+
+void test_lz()
+{
+	int cluster=PACK_BLOCKS*fs.block_size;
+	int lens[]={0,1,3,4,5,15,16,19,255,270,4096,cluster-1,cluster};
+	unsigned int i;
+	for(i=0;i<sizeof(lens)/sizeof(lens[0]);i++)
+	{
+		lz_round_trip(fill_zero,lens[i],1);
+		lz_round_trip(fill_text,lens[i],1);
+		lz_round_trip(fill_random,lens[i],0);
+	}
+	//what cluster_pack asks for: a block smaller than the cluster, which random data misses
+	char* in=malloc(cluster);
+	char* packed=malloc(cluster);
+	fill_random(in,cluster,3);
+	CHECK(lz_compress(in,cluster,packed,cluster-fs.block_size-sizeof(pack_header))==-1);
+	free(in);
+	free(packed);
+	lz_damaged(cluster);
+}
+
+void put_file(const char* path, const char* data, int len)
+{
+	//a file holding data, released so that file_pack has had its go at it
+	struct fuse_file_info fi;
+	memset(&fi,0,sizeof(fi));
+	CHECK(sfs_oper.create(path,S_IFREG|0644,&fi)==0);
+	CHECK(sfs_oper.write(path,data,len,0,&fi)==len);
+	CHECK(sfs_oper.release(path,&fi)==0);
+}
+
+int read_file(const char* path, char* buf, int len)
+{
+	//what a read of the whole file gives
+	struct fuse_file_info fi;
+	memset(&fi,0,sizeof(fi));
+	CHECK(sfs_oper.open(path,&fi)==0);
+	int r=sfs_oper.read(path,buf,len,0,&fi);
+	CHECK(sfs_oper.release(path,&fi)==0);
+	return r;
+}
+
+void check_file(const char* path, const char* data, int len)
+{
+	char* buf=malloc(len+1);
+	CHECK(read_file(path,buf,len+1)==len);
+	CHECK(memcmp(buf,data,len)==0);
+	free(buf);
+}
+
+void check_pack(const char* path, fill_fn fill, int len, int packs, int raw)
+{
+	//writing a file of len bytes compresses packs clusters and leaves raw of them alone
+	char* data=malloc(len);
+	fill(data,len,len);
+	unsigned long packs_at=stats.packs;
+	unsigned long raw_at=stats.pack_raw;
+	put_file(path,data,len);
+	CHECK(stats.packs-packs_at==(unsigned long)packs);
+	CHECK(stats.pack_raw-raw_at==(unsigned long)raw);
+	check_file(path,data,len);
+	free(data);
+}
+
+void test_cluster()
+{
+	int bs=fs.block_size;
+	int cluster=PACK_BLOCKS*bs;
+	sfs_opts.compress=1;
+	check_pack("/zero",fill_zero,cluster,1,0);
+	check_pack("/text",fill_text,cluster,1,0);
+	check_pack("/random",fill_random,cluster,0,1);
+	//a cluster the end of the file runs into isn't compressed, it may still be written to
+	check_pack("/short",fill_text,cluster-1,0,0);
+	check_pack("/one",fill_text,cluster+1,1,0);
+	check_pack("/two",fill_text,2*cluster,2,0);
+
+	//writing into a compressed cluster gives it its blocks back, and releasing compresses it
+	//again
+	char* data=malloc(2*cluster);
+	fill_text(data,2*cluster,2*cluster);
+	struct fuse_file_info fi;
+	memset(&fi,0,sizeof(fi));
+	CHECK(sfs_oper.open("/two",&fi)==0);
+	unsigned long unpacks_at=stats.unpacks;
+	unsigned long packs_at=stats.packs;
+	memset(data+cluster+bs-3,'x',7);
+	CHECK(sfs_oper.write("/two",data+cluster+bs-3,7,cluster+bs-3,&fi)==7);
+	CHECK(stats.unpacks-unpacks_at==1);
+	CHECK(sfs_oper.release("/two",&fi)==0);
+	CHECK(stats.packs-packs_at==1);
+	check_file("/two",data,2*cluster);
+
+	//damaged headers of the first cluster of /two: the read fails rather than giving back
+	//something else or running off its buffers
+	inode node;
+	CHECK(find_file("/two",&node)>=0);
+	int p=node.direct[0];
+	CHECK(IS_PACKED(p)&&PACKED_BLOCK(p)!=0);
+	char* saved=block_alloc();
+	char* bad=block_alloc();
+	CHECK(fs_block_read(PACKED_BLOCK(p),saved)>=0);
+	pack_header head;
+	memcpy(&head,saved,sizeof(head));
+	int k;
+	for(k=0;k<6;k++)
+	{
+		pack_header h=head;
+		memcpy(bad,saved,bs);
+		switch(k)
+		{
+			case 0: h.length=0; break;
+			case 1: h.length=head.length-1; break; //the last sequence cut short
+			case 2: h.length=cluster; break; //more than the blocks it has
+			case 3: h.length=0xffffffff; break;
+			case 4: h.raw=head.raw-1; break;
+			case 5: memset(bad+sizeof(h),0xff,bs-sizeof(h)); break; //lengths that never end
+		}
+		memcpy(bad,&h,sizeof(h));
+		//through fs_block_write, so that the checksum is right and it is up to the decoder
+		CHECK(fs_block_write(PACKED_BLOCK(p),bad)>=0);
+		CHECK(read_file("/two",data,bs)==-EIO);
+	}
+	CHECK(fs_block_write(PACKED_BLOCK(p),saved)>=0);
+	CHECK(read_file("/two",data,bs)==bs);
+	free(saved);
+	free(bad);
+	free(data);
+	sfs_opts.compress=0;
+}
+
+uint32_t crc_of(uint32_t (*fn)(uint32_t, const char*, size_t), const char* buf, size_t len)
+{
+	return ~fn(~(uint32_t)0,buf,len);
+}
+
+void test_crc()
+{
+	//the check value of CRC32C, for both ways of computing it
+	const char* check="123456789";
+	CHECK(crc32c(check,9)==0xe3069283);
+	CHECK(crc_of(crc32c_sw,check,9)==0xe3069283);
+	CHECK(crc_of(crc32c_sw,check,0)==0);
+	int hw=CRC32C_HW();
+	if(hw)
+	{
+		CHECK(crc_of(crc32c_hw,check,9)==0xe3069283);
+		CHECK(crc_of(crc32c_hw,check,0)==0);
+	}
+	else
+	{
+		printf("no %s crc32 instruction, only the tables are tested\n",CRC32C_HW_NAME);
+	}
+
+	//a CRC_STRIDE byte piece after something else, put together with crc32c_shift
+	int max=8*CRC_STRIDE;
+	char* buf=malloc(max+16);
+	fill_random(buf,max+16,5);
+	uint32_t a=crc32c_sw(0x12345678,buf,100);
+	CHECK((crc32c_shift(a)^crc32c_sw(0,buf+100,CRC_STRIDE))==crc32c_sw(0x12345678,buf,100+CRC_STRIDE));
+
+	//every length up to a few rounds of pieces, from every alignment, and lengths around a
+	//round split over two calls anywhere
+	int mids[]={16,CRC_STRIDE,3*CRC_STRIDE,6*CRC_STRIDE};
+	int at,len,i,k;
+	for(at=0;at<16;at++)
+	{
+		for(len=0;len<=max;len+=(len<4*CRC_STRIDE) ? 1 : 61)
+		{
+			uint32_t sw=crc_of(crc32c_sw,buf+at,len);
+			if(hw)
+			{
+				CHECK(crc_of(crc32c_hw,buf+at,len)==sw);
+			}
+		}
+		for(i=0;i<(int)(sizeof(mids)/sizeof(mids[0]));i++)
+		{
+			for(len=mids[i]-9;len<=mids[i]+9;len++)
+			{
+				uint32_t sw=crc_of(crc32c_sw,buf+at,len);
+				for(k=1;k<len;k+=(k<16) ? 1 : 37)
+				{
+					CHECK(~crc32c_sw(crc32c_sw(~(uint32_t)0,buf+at,k),buf+at+k,len-k)==sw);
+					if(hw)
+					{
+						CHECK(~crc32c_hw(crc32c_hw(~(uint32_t)0,buf+at,k),buf+at+k,len-k)==sw);
+					}
+				}
+			}
+		}
+	}
+	free(buf);
+}
+
+int picked(const char* test)
+{
+	//is test in the -t list
+	size_t len=strlen(test);
+	const char* s=test_names;
+	while(s!=NULL)
+	{
+		if(strncmp(s,test,len)==0&&(s[len]==','||s[len]=='\0'))
+		{
+			return 1;
+		}
+		s=strchr(s,',');
+		if(s!=NULL)
+		{
+			s++;
+		}
+	}
+	return 0;
+}
+
+void sfs_test_usage()
+{
+	fprintf(stderr, "usage:  sfs_test [-b block_size] [-t tests] [diskFile]\n");
+	fprintf(stderr, "    -b block_size  block size to format with (default %d)\n", DEF_BLOCK_SIZE);
+	fprintf(stderr, "    -t tests       comma separated list of lz, cluster and crc (default all)\n");
+	fprintf(stderr, "diskFile is overwritten, without one a temporary file is used\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	int opt;
+	while((opt=getopt(argc,argv,"b:t:"))!=-1)
+	{
+		switch(opt)
+		{
+			case 'b': sfs_opts.block_size=atoi(optarg); break;
+			case 't': test_names=optarg; break;
+			default: sfs_test_usage();
+		}
+	}
+	if(optind<argc-1||sfs_opts.block_size<MIN_BLOCK_SIZE||sfs_opts.block_size>MAX_BLOCK_SIZE||
+		(sfs_opts.block_size&(sfs_opts.block_size-1))!=0)
+	{
+		sfs_test_usage();
+	}
+
+	char tmp_name[]="/tmp/sfs_test.XXXXXX";
+	char* diskfile=tmp_name;
+	if(optind==argc-1)
+	{
+		diskfile=argv[optind];
+		if(truncate(diskfile,0)<0&&errno!=ENOENT)
+		{
+			perror(diskfile);
+			return EXIT_FAILURE;
+		}
+	}
+	else
+	{
+		int fd=mkstemp(tmp_name);
+		if(fd<0)
+		{
+			perror(tmp_name);
+			return EXIT_FAILURE;
+		}
+		close(fd);
+	}
+
+	sfs_data=calloc(1,sizeof(struct sfs_state));
+	if(sfs_data==NULL)
+	{
+		perror("sfs_test");
+		return EXIT_FAILURE;
+	}
+	sfs_data->diskfile=diskfile;
+	sfs_data->logfile=fopen("/dev/null","w");
+	struct fuse_conn_info conn;
+	memset(&conn,0,sizeof(conn));
+	sfs_oper.init(&conn);
+	if(picked("lz"))
+	{
+		test_lz();
+	}
+	if(picked("cluster"))
+	{
+		test_cluster();
+	}
+	if(picked("crc"))
+	{
+		test_crc();
+	}
+	sfs_oper.destroy(sfs_data);
+
+	if(diskfile==tmp_name)
+	{
+		unlink(tmp_name);
+	}
+	printf("%d byte blocks: %d failed\n",fs.block_size,failures);
+	return failures;
+}
@@ -0,0 +1,52 @@
+/*
+  Simple File System
+
+  Binary trace of the calls the filesystem serves, recorded when mounted
+  with -o trace=FILE and run again by sfs_replay.  The file is a header
+  followed by one record per call, in the order the calls finished.  Each
+  record is followed by name_len bytes of name, without a terminating
+  zero: the path for the high-level api, and the name looked up, created
+  or unlinked for the low-level one.  Everything is in host byte order.
+  File contents aren't recorded, only where and how much.
+
+*/
+
+#ifndef _SFS_TRACE_H_
+#define _SFS_TRACE_H_
+
+#include <stdint.h>
+
+// operations, as counted in /.sfs_stats and recorded in the trace
+enum
+{
+	OP_LOOKUP, OP_FORGET, OP_GETATTR, OP_CREATE, OP_UNLINK, OP_OPEN, OP_RELEASE, OP_FLUSH, OP_FSYNC,
+	OP_READ, OP_WRITE, OP_MKDIR, OP_RMDIR, OP_OPENDIR, OP_READDIR, OP_RELEASEDIR, OP_IOCTL, NUM_OPS
+};
+
+#define TRACE_MAGIC 0x54534653	// "SFST"
+#define TRACE_VER 1
+#define TRACE_MAX_NAME 255
+
+struct sfs_trace_header {
+	uint32_t magic;
+	uint32_t version;
+	int32_t lowlevel;	// recorded through the low-level api
+	int32_t block_size;	// of the filesystem traced
+	int64_t started;	// wall clock seconds when tracing started
+};
+
+struct sfs_trace_rec {
+	uint64_t start;		// nanoseconds since tracing started
+	uint32_t took;		// nanoseconds the call took, UINT32_MAX for 4.29 s or more
+	uint8_t op;		// OP_*
+	uint8_t name_len;
+	uint16_t flags;		// none yet
+	int32_t result;		// what a high-level handler returned, 0 for low-level ones
+	uint32_t ino;		// low-level inode number, the one found for lookup and create
+	int64_t offset;
+	uint64_t size;		// bytes for read and write, the mode for create, open
+				// flags, datasync, forget count or ioctl command
+	uint64_t fh;		// file handle, as set by open and create
+};
+
+#endif